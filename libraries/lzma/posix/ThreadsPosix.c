@@ -0,0 +1,199 @@
+/* ThreadsPosix.c -- C/Threads.h on POSIX threads (libswf), see ThreadsPosix.h.
+
+Handles are objects with a mutex and a condition: a thread is joined by
+Handle_WaitObject, an event is waited for until it is set (an auto-reset event
+is reset by the wait), and a semaphore is waited for until its count is above
+zero (and decremented). */
+
+#include "ThreadsPosix.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "../C/Threads.h"
+
+enum
+{
+  k_Thread,
+  k_Event,
+  k_Semaphore
+};
+
+struct CPosixHandle
+{
+  int kind;
+  pthread_t thread;
+  int joined;
+  int manualReset;
+  UInt32 count; /* event: signaled (0 or 1); semaphore: count */
+  UInt32 maxCount;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+/* Owned by the thread, which may outlive its handle. */
+typedef struct
+{
+  THREAD_FUNC_TYPE func;
+  LPVOID param;
+} CThreadStart;
+
+static HANDLE Handle_Create(int kind)
+{
+  HANDLE h = (HANDLE)calloc(1, sizeof(struct CPosixHandle));
+  if (h == NULL)
+    return NULL;
+  h->kind = kind;
+  if (kind != k_Thread)
+  {
+    if (pthread_mutex_init(&h->mutex, NULL) != 0)
+    {
+      free(h);
+      return NULL;
+    }
+    if (pthread_cond_init(&h->cond, NULL) != 0)
+    {
+      pthread_mutex_destroy(&h->mutex);
+      free(h);
+      return NULL;
+    }
+  }
+  return h;
+}
+
+WRes HandlePtr_Close(HANDLE *p)
+{
+  HANDLE h = *p;
+  if (h != NULL)
+  {
+    if (h->kind == k_Thread)
+    {
+      /* Like CloseHandle, closing does not end the thread. */
+      if (!h->joined)
+        pthread_detach(h->thread);
+    }
+    else
+    {
+      pthread_cond_destroy(&h->cond);
+      pthread_mutex_destroy(&h->mutex);
+    }
+    free(h);
+    *p = NULL;
+  }
+  return 0;
+}
+
+WRes Handle_WaitObject(HANDLE h)
+{
+  if (h->kind == k_Thread)
+  {
+    WRes res = h->joined ? 0 : pthread_join(h->thread, NULL);
+    if (res == 0)
+      h->joined = 1;
+    return res;
+  }
+  pthread_mutex_lock(&h->mutex);
+  while (h->count == 0)
+    pthread_cond_wait(&h->cond, &h->mutex);
+  if (h->kind == k_Semaphore || !h->manualReset)
+    h->count--;
+  pthread_mutex_unlock(&h->mutex);
+  return 0;
+}
+
+static void *Thread_Start(void *p)
+{
+  CThreadStart start = *(CThreadStart *)p;
+  free(p);
+  start.func(start.param);
+  return NULL;
+}
+
+WRes Thread_Create(CThread *p, THREAD_FUNC_TYPE func, LPVOID param)
+{
+  WRes res;
+  CThreadStart *start = (CThreadStart *)malloc(sizeof(CThreadStart));
+  *p = Handle_Create(k_Thread);
+  if (start == NULL || *p == NULL)
+  {
+    free(start);
+    free(*p);
+    *p = NULL;
+    return ENOMEM;
+  }
+  start->func = func;
+  start->param = param;
+  res = pthread_create(&(*p)->thread, NULL, Thread_Start, start);
+  if (res != 0)
+  {
+    free(start);
+    free(*p);
+    *p = NULL;
+  }
+  return res;
+}
+
+static WRes Event_Create(CEvent *p, int manualReset, int signaled)
+{
+  *p = Handle_Create(k_Event);
+  if (*p == NULL)
+    return ENOMEM;
+  (*p)->manualReset = manualReset;
+  (*p)->count = signaled ? 1 : 0;
+  return 0;
+}
+
+static WRes Event_SetState(CEvent *p, UInt32 signaled)
+{
+  HANDLE h = *p;
+  pthread_mutex_lock(&h->mutex);
+  h->count = signaled;
+  if (signaled)
+    pthread_cond_broadcast(&h->cond);
+  pthread_mutex_unlock(&h->mutex);
+  return 0;
+}
+
+WRes Event_Set(CEvent *p) { return Event_SetState(p, 1); }
+WRes Event_Reset(CEvent *p) { return Event_SetState(p, 0); }
+
+WRes ManualResetEvent_Create(CManualResetEvent *p, int signaled) { return Event_Create(p, 1, signaled); }
+WRes AutoResetEvent_Create(CAutoResetEvent *p, int signaled) { return Event_Create(p, 0, signaled); }
+WRes ManualResetEvent_CreateNotSignaled(CManualResetEvent *p) { return ManualResetEvent_Create(p, 0); }
+WRes AutoResetEvent_CreateNotSignaled(CAutoResetEvent *p) { return AutoResetEvent_Create(p, 0); }
+
+
+WRes Semaphore_Create(CSemaphore *p, UInt32 initCount, UInt32 maxCount)
+{
+  *p = Handle_Create(k_Semaphore);
+  if (*p == NULL)
+    return ENOMEM;
+  (*p)->count = initCount;
+  (*p)->maxCount = maxCount;
+  return 0;
+}
+
+WRes Semaphore_ReleaseN(CSemaphore *p, UInt32 num)
+{
+  HANDLE h = *p;
+  WRes res = 0;
+  pthread_mutex_lock(&h->mutex);
+  /* Like ReleaseSemaphore, going over the maximum count fails. */
+  if (num > h->maxCount - h->count)
+    res = EINVAL;
+  else
+  {
+    h->count += num;
+    pthread_cond_broadcast(&h->cond);
+  }
+  pthread_mutex_unlock(&h->mutex);
+  return res;
+}
+
+WRes Semaphore_Release1(CSemaphore *p) { return Semaphore_ReleaseN(p, 1); }
+
+
+WRes CriticalSection_Init(CCriticalSection *p)
+{
+  return pthread_mutex_init(p, NULL);
+}
@@ -0,0 +1,35 @@
+/* ThreadsPosix.h -- the Windows types and calls that C/Threads.h is written for,
+on POSIX threads (libswf).
+
+Not part of the LZMA SDK. When not building for Windows, it is included before
+every SDK source (-include), so that the SDK's Threads.h compiles unchanged, and
+ThreadsPosix.c is built instead of C/Threads.c. */
+
+#ifndef __LIBSWF_THREADS_POSIX_H
+#define __LIBSWF_THREADS_POSIX_H
+
+#ifndef _WIN32
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void *LPVOID;
+
+/* A thread, event or semaphore, see ThreadsPosix.c */
+typedef struct CPosixHandle *HANDLE;
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+#define DeleteCriticalSection(p) pthread_mutex_destroy(p)
+#define EnterCriticalSection(p) pthread_mutex_lock(p)
+#define LeaveCriticalSection(p) pthread_mutex_unlock(p)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif
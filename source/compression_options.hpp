@@ -0,0 +1,90 @@
+/**
+ * libswf - Compression settings
+ */
+
+#ifndef COMPRESSION_OPTIONS_HPP
+#define COMPRESSION_OPTIONS_HPP
+
+#include <cstddef> // size_t
+#include <cstdint> // uint32_t
+
+namespace swf {
+
+	/**
+	 * Encoder settings used by exportSwf, exportExe and replaceImg. Fields
+	 * that only apply to one of zlib and LZMA are ignored by the other one.
+	 * The default values compress like the library always has: zlib level 9,
+	 * LZMA with an 8 MB dictionary and 128 fast bytes, in one thread.
+	 */
+	struct CompressionOptions {
+		/// [0,9]. With LZMA, levels below 5 use the fast (hash chain) match finder.
+		int level = 9;
+		/// zlib strategy given to deflateInit2, 0 is Z_DEFAULT_STRATEGY.
+		int strategy = 0;
+		/// LZMA dictionary size in bytes, 0 for the level's default. It is never larger than the input.
+		uint32_t dictionarySize = 1 << 23;
+		/// LZMA fast bytes [5,273], 0 for the level's default.
+		int fastBytes = 128;
+		/// Number of threads (0 means one per hardware thread). LZMA uses at most 2.
+		unsigned threads = 1;
+		/**
+		 * Bytes the encoder may allocate, 0 for no limit. zlib runs fewer
+		 * threads and LZMA uses a smaller dictionary to stay under it.
+		 */
+		size_t memoryLimit = 0;
+		/**
+		 * zlib only. When not 0, exportSwf compresses in one stream, in one
+		 * thread ('threads' and 'memoryLimit' are ignored), and keeps a copy
+		 * of the deflate state at the first tag boundary after every
+		 * 'checkpointInterval' bytes of uncompressed SWF (about 256 KB each
+		 * at level 9). The next zlib export with the same level and strategy
+		 * only serializes and compresses again from the last checkpoint
+		 * before the first tag changed by a replace* function since. Tags
+		 * returned by getTagWithId, getTagsOfType or findBySymbolName count
+		 * as changed from then on, as they can be changed through the pointer.
+		 */
+		size_t checkpointInterval = 0;
+		/**
+		 * zlib only. When not 0, deflate with optimal parsing (Zopfli-style)
+		 * with this many iterations per block, 15 being Zopfli's default.
+		 * Segments of 1 MB are compressed by 'threads' threads. Much slower
+		 * than level 9 for a few percent less, 'level', 'strategy' and
+		 * 'checkpointInterval' are then ignored.
+		 */
+		int optimalIterations = 0;
+
+		constexpr bool operator==(const CompressionOptions &other) const {
+			return level == other.level && strategy == other.strategy && dictionarySize == other.dictionarySize
+			       && fastBytes == other.fastBytes && threads == other.threads && memoryLimit == other.memoryLimit
+			       && checkpointInterval == other.checkpointInterval && optimalIterations == other.optimalIterations;
+		}
+		constexpr bool operator!=(const CompressionOptions &other) const { return !(*this == other); }
+
+		/// Fastest compression, using every hardware thread.
+		static constexpr CompressionOptions fast() {
+			CompressionOptions o;
+			o.level = 1;
+			o.dictionarySize = 0; // 64 KB at level 1
+			o.fastBytes = 0;
+			o.threads = 0;
+			return o;
+		}
+		static constexpr CompressionOptions defaults() {
+			return CompressionOptions();
+		}
+		/**
+		 * Smallest output: LZMA with a 64 MB dictionary and 273 fast bytes, in
+		 * one thread, as more threads would split zlib in larger parallel
+		 * blocks (LZMA compresses the same with its threaded match finder).
+		 */
+		static constexpr CompressionOptions max() {
+			CompressionOptions o;
+			o.dictionarySize = 1 << 26;
+			o.fastBytes = 273;
+			return o;
+		}
+	};
+
+} // swf
+
+#endif // COMPRESSION_OPTIONS_HPP
@@ -6,8 +6,10 @@
  * - http://www.asawicki.info/news_1368_lzma_sdk_-_how_to_use.html
  */
 
-#include <algorithm> // min
+#include <algorithm> // min, max
 #include <cstring> // memcpy
+#include <exception> // exception_ptr
+#include <thread> // hardware_concurrency
 #include <lzma/C/LzmaEnc.h> // LZMA encode functions
 #include <lzma/C/LzmaDec.h> // LZMA decode functions
 #include <lzma/C/Lzma2Dec.h> // LZMA2 decode functions
@@ -17,190 +19,499 @@ using namespace std;
 
 namespace lzmasdk {
 
-	typedef struct {
-		ISeqInStream SeqInStream;
-		const std::vector<unsigned char> *Buf;
-		size_t BufPos;
-	} VectorInStream;
+	static void *Alloc(ISzAllocPtr p, size_t size) { (void)p; return malloc(size); }
+	static void Free(ISzAllocPtr p, void *address) { (void)p; free(address); }
 
-	SRes VectorInStream_Read(const ISeqInStream *p, void *buf, size_t *size) {
-		VectorInStream *ctx = (VectorInStream*)p;
-		*size = min(*size, ctx->Buf->size() - ctx->BufPos);
-		if (*size) memcpy(buf, &(*ctx->Buf)[ctx->BufPos], *size);
-		ctx->BufPos += *size;
-		return SZ_OK;
-	}
 
-	typedef struct {
-		ISeqOutStream SeqOutStream;
-		std::vector<unsigned char> *Buf;
-	} VectorOutStream;
+	static ISzAlloc allocator = { Alloc, Free };
 
-	size_t VectorOutStream_Write(const ISeqOutStream *p, const void *buf, size_t size) {
-		VectorOutStream *ctx = (VectorOutStream*)p;
-		if (size) {
-			size_t oldSize = ctx->Buf->size();
-			ctx->Buf->resize(oldSize + size);
-			memcpy(&(*ctx->Buf)[oldSize], buf, size);
-		}
-		return size;
+	size_t lzmasdk_compress_memory(uint32_t dict_size, bool binary_tree)
+	{
+		// dictSize * 11.5 + 6 MB with bt4, dictSize * 7.5 + 6 MB with hc4.
+		return (binary_tree ? size_t(dict_size) * 23 / 2 : size_t(dict_size) * 15 / 2) + (size_t(6) << 20);
+	}
+
+	size_t lzmasdk_compress_bound(size_t in_data_size)
+	{
+		return in_data_size + in_data_size / 3 + 128;
 	}
 
-	static void *Alloc(ISzAllocPtr p, size_t size) { (void)p; return malloc(size); }
-	static void Free(ISzAllocPtr p, void *address) { (void)p; free(address); }
 
-	vector<uint8_t> lzmasdk_compress(const vector<uint8_t> &in_data)
+	struct encoder::state {
+		state() : handle(nullptr) {}
+		state(const state &) = delete;
+		state &operator=(const state &) = delete;
+		~state() {
+			if (handle != nullptr) {
+				LzmaEnc_Destroy(handle, &allocator, &allocator);
+			}
+		}
+		CLzmaEncHandle handle;
+	};
+
+	encoder::encoder(const encoder_options &options_) : impl(new state()), options(options_)
 	{
-		vector<uint8_t> out_data;
+		impl->handle = LzmaEnc_Create(&allocator);
+		if (impl->handle == nullptr) {
+			throw lzmasdk_exception("lzma sdk: no memory.");
+		}
+	}
 
-		static ISzAlloc allocator = { Alloc, Free };
+	encoder::~encoder() = default;
 
+	void encoder::set_properties(const uint64_t size, const bool end_mark)
+	{
 		CLzmaEncProps props;
-		CLzmaEncHandle encoder = nullptr;
-
-		Byte header[LZMA_PROPS_SIZE];
-		size_t headerSize = LZMA_PROPS_SIZE;
-		int res;
 
-		int dictionary = 23;         // [0,27], default 23 (8MB)
-		int fastBytes = 128;         // [5,273], default 128
 		int literalContextBits = 3;  // [0,8], default 3
 		int literalPosBits = 0;      // [0,4], default 0
 		int posBits = 2;             // [0,4], default 2
-		int eos = 1;                 // write "end of stream" marker?
-		int multithreading = 1;      // use multithreading if available?
-		int algorithm = 2;
-
-		encoder = LzmaEnc_Create(&allocator);
-		if (encoder == nullptr) {
-			throw lzmasdk_exception("lzma sdk: no memory.");
+		unsigned threads = options.threads;
+		if (threads == 0) {
+			threads = thread::hardware_concurrency();
 		}
+		int multithreading = (threads > 1); // threaded match finder?
 
 		LzmaEncProps_Init(&props);
 
-		props.dictSize = 1 << dictionary;
+		props.level = options.level;
+		props.dictSize = options.dict_size;
+		props.reduceSize = size; // no larger dictionary than the input
 		props.lc = literalContextBits;
 		props.lp = literalPosBits;
 		props.pb = posBits;
-		props.algo = algorithm;
-		props.fb = fastBytes;
+		props.fb = options.fast_bytes > 0 ? options.fast_bytes : -1;
 		// props.btMode = 1;
 		// props.numHashBytes = 4;
 		// props.mc = 32;
-		props.writeEndMark = eos ? 1 : 0;
+		props.writeEndMark = end_mark ? 1 : 0;
 		props.numThreads = multithreading ? 2 : 1;
 		LzmaEncProps_Normalize(&props);
-		res = LzmaEnc_SetProps(encoder, &props);
-		if (res != SZ_OK) {
-			if (encoder != nullptr) {
-				LzmaEnc_Destroy(encoder, &allocator, &allocator);
+		if (options.memory_limit > 0) {
+			while (props.dictSize > (1u << 12) &&
+			       lzmasdk_compress_memory(props.dictSize, props.btMode != 0) > options.memory_limit) {
+				props.dictSize >>= 1;
 			}
+		}
+		int res = LzmaEnc_SetProps(impl->handle, &props);
+		if (res != SZ_OK) {
 			throw lzmasdk_exception("lzma sdk: Could not set encoder properties: " + to_string(res));
 		}
+	}
 
-		LzmaEnc_WriteProperties(encoder, header, &headerSize);
-
-		out_data.insert(out_data.end(), header, header + headerSize);
-
-		VectorInStream inStream = { {&VectorInStream_Read}, &in_data, 0 };
-		VectorOutStream outStream = { {&VectorOutStream_Write}, &out_data };
+	namespace {
+		/// ISeqInStream over a chunk_source. Exceptions are kept for after the SDK returns.
+		struct SourceStream {
+			ISeqInStream vt;
+			const chunk_source *source;
+			exception_ptr error;
+		};
+
+		SRes SourceStream_Read(const ISeqInStream *p, void *buf, size_t *size) {
+			SourceStream *ctx = (SourceStream*)p;
+			try {
+				*size = (*ctx->source)(static_cast<uint8_t*>(buf), *size);
+				return SZ_OK;
+			} catch (...) {
+				ctx->error = current_exception();
+				*size = 0;
+				return SZ_ERROR_READ;
+			}
+		}
 
-		res = LzmaEnc_Encode(encoder, (ISeqOutStream*)&outStream, (ISeqInStream*)&inStream, nullptr, &allocator, &allocator);
+		/// ICompressProgress over a progress_callback.
+		struct ProgressReporter {
+			ICompressProgress vt;
+			const progress_callback *progress;
+			uint64_t total;
+			bool stopped;
+			exception_ptr error;
+		};
+
+		SRes ProgressReporter_Progress(const ICompressProgress *p, UInt64 inSize, UInt64) {
+			ProgressReporter *ctx = (ProgressReporter*)p;
+			try {
+				if (inSize != static_cast<UInt64>(-1) && !(*ctx->progress)(inSize, ctx->total)) {
+					ctx->stopped = true;
+					return SZ_ERROR_PROGRESS;
+				}
+				return SZ_OK;
+			} catch (...) {
+				ctx->error = current_exception();
+				return SZ_ERROR_PROGRESS;
+			}
+		}
 
-		if (res != SZ_OK) {
-			if (encoder != nullptr) {
-				LzmaEnc_Destroy(encoder, &allocator, &allocator);
+		/// ISeqOutStream over a chunk_sink.
+		struct SinkStream {
+			ISeqOutStream vt;
+			const chunk_sink *sink;
+			bool stopped;
+			exception_ptr error;
+		};
+
+		size_t SinkStream_Write(const ISeqOutStream *p, const void *buf, size_t size) {
+			SinkStream *ctx = (SinkStream*)p;
+			try {
+				if (!(*ctx->sink)(static_cast<const uint8_t*>(buf), size)) {
+					ctx->stopped = true;
+					return 0;
+				}
+				return size;
+			} catch (...) {
+				ctx->error = current_exception();
+				return 0;
 			}
-			throw lzmasdk_exception("lzma sdk: Error during compressing: " + to_string(res));
 		}
+	}
+
+	bool encoder::encode(const chunk_source &source, const chunk_sink &sink, const uint64_t size,
+	                     const progress_callback &progress)
+	{
+		// Without the size, the decoder can only find the end by the marker.
+		set_properties(size, options.end_mark || size == unknown_size);
 
-		if (encoder != nullptr) {
-			LzmaEnc_Destroy(encoder, &allocator, &allocator);
+		Byte header[LZMA_PROPS_SIZE];
+		size_t headerSize = LZMA_PROPS_SIZE;
+		LzmaEnc_WriteProperties(impl->handle, header, &headerSize);
+		if (!sink(header, headerSize)) {
+			return false;
 		}
 
-		return out_data;
+		SourceStream inStream = { {&SourceStream_Read}, &source, nullptr };
+		SinkStream outStream = { {&SinkStream_Write}, &sink, false, nullptr };
+		ProgressReporter reporter = { {&ProgressReporter_Progress}, &progress, size, false, nullptr };
+
+		int res = LzmaEnc_Encode(impl->handle, &outStream.vt, &inStream.vt, progress ? &reporter.vt : nullptr,
+		                         &allocator, &allocator);
+
+		if (inStream.error) {
+			rethrow_exception(inStream.error);
+		} else if (outStream.error) {
+			rethrow_exception(outStream.error);
+		} else if (reporter.error) {
+			rethrow_exception(reporter.error);
+		} else if (outStream.stopped || reporter.stopped) {
+			return false;
+		} else if (res != SZ_OK) {
+			throw lzmasdk_exception("lzma sdk: Error during compressing: " + to_string(res));
+		}
+		return true;
 	}
 
-
-	vector<uint8_t> lzmasdk_decompress(const vector<uint8_t> &in_data, const int lzma2)
+	bool encoder::encode(const uint8_t *in_data, size_t in_data_size, vector<uint8_t> &out, const size_t offset,
+	                     const progress_callback &progress)
 	{
-		vector<uint8_t> out_data;
+		set_properties(in_data_size, options.end_mark);
 
-		static ISzAlloc allocator = { Alloc, Free };
+		// The properties and the stream are written in place: 'out' is sized
+		// once for the worst case and then shrunk to the end of the stream.
+		size_t headerSize = LZMA_PROPS_SIZE;
+		out.resize(offset + LZMA_PROPS_SIZE + lzmasdk_compress_bound(in_data_size));
+		LzmaEnc_WriteProperties(impl->handle, out.data() + offset, &headerSize);
+
+		ProgressReporter reporter = { {&ProgressReporter_Progress}, &progress, in_data_size, false, nullptr };
+		size_t destLen = out.size() - offset - headerSize;
+		int res = LzmaEnc_MemEncode(impl->handle, out.data() + offset + headerSize, &destLen, in_data, in_data_size,
+		                            options.end_mark ? 1 : 0, progress ? &reporter.vt : nullptr, &allocator, &allocator);
+		if (reporter.error) {
+			out.resize(offset);
+			rethrow_exception(reporter.error);
+		} else if (reporter.stopped) {
+			out.resize(offset);
+			return false;
+		} else if (res != SZ_OK) {
+			throw lzmasdk_exception("lzma sdk: Error during compressing: " + to_string(res));
+		}
+
+		out.resize(offset + headerSize + destLen);
+		// The SDK does not report the end of the input.
+		if (progress && !progress(in_data_size, in_data_size)) {
+			out.resize(offset);
+			return false;
+		}
+		return true;
+	}
 
-		const int BLOCK_SIZE (128*1024);
 
-		size_t avail;
+	struct decoder::state {
+		explicit state(int lzma2_) : lzma2(lzma2_), dec(), dictionary(), next(nullptr), left(0), total(0),
+		                             out(nullptr), consumed(0), status(LZMA_STATUS_NOT_SPECIFIED), finished(false) {
+			if (lzma2) {
+				Lzma2Dec_Construct(&dec.lzma2);
+			} else {
+				LzmaDec_Construct(&dec.lzma);
+			}
+		}
+		state(const state &) = delete;
+		state &operator=(const state &) = delete;
+		~state() {
+			// The dictionary is ours, only the probabilities are freed.
+			LzmaDec_FreeProbs(&lzma(), &allocator);
+		}
+		CLzmaDec &lzma() {
+			return lzma2 ? dec.lzma2.decoder : dec.lzma;
+		}
+		SRes decode(SizeT dicLimit, const Byte *src, SizeT *srcLen, ELzmaFinishMode finishMode) {
+			if (lzma2) {
+				return Lzma2Dec_DecodeToDic(&dec.lzma2, dicLimit, src, srcLen, finishMode, &status);
+			}
+			return LzmaDec_DecodeToDic(&dec.lzma, dicLimit, src, srcLen, finishMode, &status);
+		}
+		int lzma2;
 		union {
 			CLzmaDec lzma;
 			CLzma2Dec lzma2;
-		} state;
+		} dec;
+		vector<uint8_t> dictionary; // allocated on first use
+		const uint8_t *next;        // input
+		size_t left;
+		uint64_t total;             // bytes decoded
+		const uint8_t *out;         // output of the last step, in the dictionary
+		size_t consumed;            // input consumed by the last step
 		ELzmaStatus status;
-		size_t srcLen, destLen;
+		bool finished;
+	};
+
+	decoder::decoder(const uint8_t *props, const size_t props_size, const int lzma2, const uint64_t size_,
+	                 const size_t buffer_size_)
+		: impl(new state(lzma2)), size(size_), buffer_size(buffer_size_)
+	{
+		if (props_size < (lzma2 ? 1 : LZMA_PROPS_SIZE)) {
+			throw lzmasdk_exception("lzma sdk: Data error during decompression.");
+		}
 		int res;
-		int propertiesLength;
+		if (lzma2) {
+			res = Lzma2Dec_AllocateProbs(&impl->dec.lzma2, props[0], &allocator);
+		} else {
+			res = LzmaDec_AllocateProbs(&impl->dec.lzma, props, LZMA_PROPS_SIZE, &allocator);
+		}
+		if (res != SZ_OK) {
+			throw lzmasdk_exception("lzma sdk: Incorrect stream properties: " + to_string(res));
+		}
+		reset();
+	}
 
-		propertiesLength = lzma2 ? 1 : LZMA_PROPS_SIZE;
+	decoder::~decoder() = default;
 
-		vector<Byte> tmp (BLOCK_SIZE);
+	void decoder::reset()
+	{
+		if (impl->lzma2) {
+			Lzma2Dec_Init(&impl->dec.lzma2);
+		} else {
+			LzmaDec_Init(&impl->dec.lzma);
+		}
+		CLzmaDec &dec = impl->lzma();
+		dec.dic = impl->dictionary.data();
+		dec.dicBufSize = impl->dictionary.size();
+		impl->next = nullptr;
+		impl->left = 0;
+		impl->total = 0;
+		impl->finished = false;
+	}
 
-		if (lzma2) {
-			Lzma2Dec_Construct(&state.lzma2);
-			res = Lzma2Dec_Allocate(&state.lzma2, in_data[0], &allocator);
-			if (res != SZ_OK) {
-				Lzma2Dec_Free(&state.lzma2, &allocator);
-				throw lzmasdk_exception("lzma sdk: Incorrect stream properties: " + to_string(res));
+	void decoder::input(const uint8_t *data, const size_t size_)
+	{
+		if (impl->left > 0) {
+			throw lzmasdk_exception("lzma sdk: The previous input was not consumed.");
+		}
+		impl->next = data;
+		impl->left = size_;
+	}
+
+	size_t decoder::step(size_t max_out)
+	{
+		CLzmaDec &dec = impl->lzma();
+		if (impl->dictionary.empty()) {
+			// The stream never refers further back than the dictionary size
+			// from its properties, nor than its own size.
+			uint64_t dict_size = dec.prop.dicSize;
+			if (size < dict_size) {
+				dict_size = size;
 			}
-		} else {
-			LzmaDec_Construct(&state.lzma);
-			res = LzmaDec_Allocate(&state.lzma, in_data.data(), propertiesLength, &allocator);
-			if (res != SZ_OK) {
-				LzmaDec_Free(&state.lzma, &allocator);
-				throw lzmasdk_exception("lzma sdk: Incorrect stream properties: " + to_string(res));
+			impl->dictionary.resize(max<size_t>(static_cast<size_t>(dict_size), 1 << 12));
+			dec.dic = impl->dictionary.data();
+			dec.dicBufSize = impl->dictionary.size();
+		}
+		if (dec.dicPos == dec.dicBufSize) {
+			dec.dicPos = 0;
+		}
+
+		size_t start = dec.dicPos;
+		size_t limit = min(dec.dicBufSize - start, max_out);
+		ELzmaFinishMode finishMode = LZMA_FINISH_ANY;
+		if (size != unknown_size && size - impl->total <= limit) {
+			limit = static_cast<size_t>(size - impl->total);
+			finishMode = LZMA_FINISH_END;
+		}
+
+		SizeT srcLen = impl->left;
+		SRes res = impl->decode(start + limit, impl->next, &srcLen, finishMode);
+		impl->next += srcLen;
+		impl->left -= srcLen;
+		impl->consumed = srcLen;
+		impl->out = dec.dic + start;
+		size_t produced = dec.dicPos - start;
+		impl->total += produced;
+
+		if (res != SZ_OK) {
+			throw lzmasdk_exception("lzma sdk: Error while decompressing: " + to_string(res));
+		}
+		if (impl->status == LZMA_STATUS_FINISHED_WITH_MARK ||
+		    (impl->total == size && impl->status == LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK)) {
+			impl->finished = true;
+		}
+		return produced;
+	}
+
+	size_t decoder::read(uint8_t *out, const size_t size_)
+	{
+		size_t produced = 0;
+		while (produced < size_ && !impl->finished) {
+			size_t n = step(size_ - produced);
+			memcpy(out + produced, impl->out, n);
+			produced += n;
+			if (n == 0 && impl->consumed == 0) {
+				break; // needs more input
 			}
 		}
+		return produced;
+	}
 
-		const uint8_t *data = in_data.data() + propertiesLength;
-		avail = in_data.size() - propertiesLength;
+	bool decoder::feed(const uint8_t *data, const size_t size_, const chunk_sink &sink)
+	{
+		input(data, size_);
+		while (!impl->finished) {
+			size_t n = step(buffer_size);
+			if (n > 0 && !sink(impl->out, n)) {
+				return false;
+			}
+			if (n == 0 && impl->consumed == 0) {
+				break; // needs more input
+			}
+		}
+		return true;
+	}
 
-		if (lzma2) {
-			Lzma2Dec_Init(&state.lzma2);
-		} else {
-			LzmaDec_Init(&state.lzma);
+	bool decoder::read_all(vector<uint8_t> &out, const size_t offset, const progress_callback &progress)
+	{
+		if (offset > out.size() || impl->total != 0) {
+			throw lzmasdk_exception("lzma sdk: Data error during decompression.");
 		}
+		CLzmaDec &dec = impl->lzma();
+		const size_t input_size = impl->left;
+
+		// Decode up to the expected size first, then one byte further to
+		// find the end marker, or more data than expected. With 'progress',
+		// it stops every 256 KB on the way to report it.
+		size_t limit = out.size() - offset;
+		bool stopped = false;
+		out.resize(out.size() + 1);
 		while (true) {
-			srcLen = avail;
-			destLen = BLOCK_SIZE;
-
-			if (lzma2) {
-				res = Lzma2Dec_DecodeToBuf(&state.lzma2, tmp.data(), &destLen, data, &srcLen, LZMA_FINISH_ANY, &status);
-			} else {
-				res = LzmaDec_DecodeToBuf(&state.lzma, tmp.data(), &destLen, data, &srcLen, LZMA_FINISH_ANY, &status);
+			dec.dic = out.data() + offset;
+			dec.dicBufSize = out.size() - offset;
+			size_t stop = progress ? min<size_t>(limit, dec.dicPos + 256 * 1024) : limit;
+			SizeT srcLen = impl->left;
+			SRes res = impl->decode(stop, impl->next, &srcLen, LZMA_FINISH_ANY);
+			impl->next += srcLen;
+			impl->left -= srcLen;
+			if (res != SZ_OK) {
+				throw lzmasdk_exception("lzma sdk: Error while decompressing: " + to_string(res));
 			}
-			data += srcLen;
-			avail -= srcLen;
-			if (res == SZ_OK && destLen > 0) {
-				out_data.insert(out_data.end(), tmp.begin(), tmp.begin() + destLen);
+			if (impl->status == LZMA_STATUS_FINISHED_WITH_MARK ||
+			    (impl->status == LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK && impl->left == 0 &&
+			     (stop == limit || dec.dicPos < stop))) {
+				break;
+			} else if (impl->status == LZMA_STATUS_NEEDS_MORE_INPUT) {
+				throw lzmasdk_exception("lzma sdk: Data error during decompression.");
 			}
-			if (res != SZ_OK || status == LZMA_STATUS_FINISHED_WITH_MARK || status == LZMA_STATUS_NEEDS_MORE_INPUT) {
+			if (progress && !progress(input_size - impl->left, input_size)) {
+				stopped = true;
 				break;
 			}
+			if (stop < limit) {
+				continue;
+			}
+			if (limit == dec.dicBufSize) {
+				// More data than expected, the only case that reallocates.
+				out.resize(offset + max<size_t>(dec.dicBufSize * 2, 64 * 1024));
+			}
+			limit = out.size() - offset;
 		}
+		stopped = stopped || (progress && !progress(input_size - impl->left, input_size));
+		// Stopped by 'progress', the stream is left unfinished.
+		out.resize(stopped ? offset : offset + dec.dicPos);
+		impl->total = dec.dicPos;
+		impl->finished = !stopped;
+
+		dec.dic = impl->dictionary.data();
+		dec.dicBufSize = impl->dictionary.size();
+		dec.dicPos = 0;
+		return !stopped;
+	}
+
+	size_t decoder::pending_input() const
+	{
+		return impl->left;
+	}
+
+	bool decoder::finished() const
+	{
+		return impl->finished;
+	}
+
+
+	bool lzmasdk_compress_into(const uint8_t *in_data, size_t in_data_size, vector<uint8_t> &out,
+	                           const size_t offset, const encoder_options &options, const progress_callback &progress)
+	{
+		return encoder(options).encode(in_data, in_data_size, out, offset, progress);
+	}
+
+	vector<uint8_t> lzmasdk_compress(const vector<uint8_t> &in_data, const encoder_options &options)
+	{
+		vector<uint8_t> out_data;
+		lzmasdk_compress_into(in_data.data(), in_data.size(), out_data, 0, options);
+		return out_data;
+	}
 
 
-		if (status == LZMA_STATUS_NEEDS_MORE_INPUT) {
+	vector<uint8_t> lzmasdk_decompress(const vector<uint8_t> &in_data, const int lzma2)
+	{
+		vector<uint8_t> out_data;
+		lzmasdk_decompress(in_data.data(), in_data.size(), [&out_data](const uint8_t *data, size_t size) {
+			out_data.insert(out_data.end(), data, data + size);
+			return true;
+		}, lzma2);
+		return out_data;
+	}
+
+	bool lzmasdk_decompress_into(const uint8_t *in_data, size_t in_data_size, vector<uint8_t> &out,
+	                             const size_t offset, const progress_callback &progress)
+	{
+		if (in_data_size < LZMA_PROPS_SIZE) {
 			throw lzmasdk_exception("lzma sdk: Data error during decompression.");
-		} else if (res != SZ_OK) {
-			throw lzmasdk_exception("lzma sdk: Error while decompressing: " + to_string(res));
 		}
+		decoder dec(in_data, LZMA_PROPS_SIZE);
+		dec.input(in_data + LZMA_PROPS_SIZE, in_data_size - LZMA_PROPS_SIZE);
+		return dec.read_all(out, offset, progress);
+	}
 
-		if (lzma2) {
-			Lzma2Dec_Free(&state.lzma2, &allocator);
-		} else {
-			LzmaDec_Free(&state.lzma, &allocator);
+	bool lzmasdk_decompress(const uint8_t *in_data, size_t in_data_size, const chunk_sink &sink,
+	                        const int lzma2, const size_t chunk_size)
+	{
+		size_t propertiesLength = lzma2 ? 1 : LZMA_PROPS_SIZE;
+		if (in_data_size < propertiesLength) {
+			throw lzmasdk_exception("lzma sdk: Data error during decompression.");
 		}
 
-		return out_data;
+		decoder dec(in_data, propertiesLength, lzma2, unknown_size, chunk_size);
+		if (!dec.feed(in_data + propertiesLength, in_data_size - propertiesLength, sink)) {
+			return false;
+		}
+		if (!dec.finished()) {
+			throw lzmasdk_exception("lzma sdk: Data error during decompression.");
+		}
+		return true;
 	}
 
 } // lzmasdk
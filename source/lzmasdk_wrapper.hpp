@@ -13,15 +13,178 @@
 #include <cstdint> // uint8_t
 #include <string>
 #include <exception> // exception
+#include <functional> // function
+#include <memory> // unique_ptr
 #include <lzma/C/LzmaEnc.h> // LZMA encode functions
 #include <lzma/C/LzmaDec.h> // LZMA decode functions
 #include <lzma/C/Lzma2Dec.h> // LZMA2 decode functions
 
 namespace lzmasdk {
 
-	std::vector<uint8_t> lzmasdk_compress(const std::vector<uint8_t> &in_data);
+	/// Encoder settings. 0 (or -1 for 'level') means the LZMA SDK's default for the level.
+	struct encoder_options {
+		int level = 5;                // [0,9], below 5 uses the fast (hash chain) match finder
+		uint32_t dict_size = 1 << 23; // bytes, clamped to the size of the input
+		int fast_bytes = 128;         // [5,273]
+		/**
+		 * With 'threads' > 1 (or 0 on a multi-core machine) the encoder runs its
+		 * match finder in separate threads (LzFindMt). An LZMA stream cannot be split, so it does not use more
+		 * than that: any value above 1 behaves like 2.
+		 */
+		unsigned threads = 1;
+		/// Bytes the encoder may allocate, 0 for no limit. The dictionary is halved until it fits (down to 4 KB).
+		size_t memory_limit = 0;
+		/// Write the end of stream marker. It is always written if the size of the input is not known.
+		bool end_mark = true;
+	};
+
+	/// Size of a stream that is not known in advance.
+	inline constexpr uint64_t unknown_size = ~uint64_t(0);
+
+	/// Receives decompressed data. Returning false stops the decompression.
+	using chunk_sink = std::function<bool(const uint8_t *data, size_t size)>;
+	/// Writes up to 'size' bytes of input to 'data' and returns how many, 0 at the end of the input.
+	using chunk_source = std::function<size_t(uint8_t *data, size_t size)>;
+	/**
+	 * Called as the work goes on with the bytes of input done so far and
+	 * their total. Returning false stops it: the function returns false.
+	 */
+	using progress_callback = std::function<bool(uint64_t done, uint64_t total)>;
+
+	/**
+	 * LZMA compressor, which can be reused for several streams. The SDK
+	 * encoder pulls its input, so it streams from a source to a sink, with
+	 * buffers bounded by the dictionary size.
+	 */
+	class encoder {
+		public:
+			explicit encoder(const encoder_options &options_ = encoder_options());
+			encoder(const encoder &) = delete;
+			encoder &operator=(const encoder &) = delete;
+			~encoder();
+
+			/**
+			 * Compresses the input from 'source' and passes the properties,
+			 * then the LZMA stream, to 'sink'. 'size' is the size of the
+			 * input, if known, to fit the dictionary to it. With 'threads' > 1,
+			 * 'source' is called from another thread. Returns false if 'sink'
+			 * or 'progress' (see lzmasdk_compress_into, with 'size' as the
+			 * total) stopped the compression.
+			 */
+			bool encode(const chunk_source &source, const chunk_sink &sink, const uint64_t size = unknown_size,
+			            const progress_callback &progress = progress_callback());
+			/// Compresses 'in_data' into 'out' from 'offset' on, see lzmasdk_compress_into.
+			bool encode(const uint8_t *in_data, size_t in_data_size, std::vector<uint8_t> &out, const size_t offset,
+			            const progress_callback &progress = progress_callback());
+
+		private:
+			struct state;
+			std::unique_ptr<state> impl;
+			encoder_options options;
+			void set_properties(const uint64_t size, const bool end_mark);
+	};
+
+	/**
+	 * Streaming LZMA (or LZMA2) decompressor. Push: feed() the input as it
+	 * comes and get the output through a sink, in chunks of up to
+	 * 'buffer_size' bytes. Pull: give it input() and read() the output into
+	 * your own buffer. Besides the probabilities, it allocates a dictionary
+	 * of the size in the properties, or 'size' if smaller.
+	 */
+	class decoder {
+		public:
+			/**
+			 * 'props' are the stream properties: LZMA_PROPS_SIZE bytes, or 1
+			 * with LZMA2. With a known 'size_' the stream ends after that many
+			 * bytes, with or without end marker.
+			 */
+			decoder(const uint8_t *props, const size_t props_size, const int lzma2 = 0,
+			        const uint64_t size_ = unknown_size, const size_t buffer_size_ = 128 * 1024);
+			decoder(const decoder &) = delete;
+			decoder &operator=(const decoder &) = delete;
+			~decoder();
+
+			/// Returns false if 'sink' stopped the decompression.
+			bool feed(const uint8_t *data, const size_t size_, const chunk_sink &sink);
+
+			/// Input for read(), which must stay valid until it is consumed.
+			void input(const uint8_t *data, const size_t size_);
+			/**
+			 * Decompresses the input into 'out'. Returns the number of bytes
+			 * written, which is less than 'size_' only when the input is
+			 * consumed or the stream has ended.
+			 */
+			size_t read(uint8_t *out, const size_t size_);
+			/**
+			 * Decompresses all of the input into 'out' from 'offset' on, using
+			 * 'out' itself as the dictionary, see lzmasdk_decompress_into. Only
+			 * at the start of a stream.
+			 */
+			bool read_all(std::vector<uint8_t> &out, const size_t offset,
+			              const progress_callback &progress = progress_callback());
+			/// Input left, after the end of the stream if finished.
+			size_t pending_input() const;
+			/// True once the end of the stream was reached.
+			bool finished() const;
+			/// Starts a new stream with the same properties.
+			void reset();
+
+		private:
+			struct state;
+			std::unique_ptr<state> impl;
+			uint64_t size;
+			size_t buffer_size;
+			/// Decodes up to 'max_out' bytes into the dictionary.
+			size_t step(size_t max_out);
+	};
+
+	/// Approximate memory the encoder allocates with a 'dict_size' dictionary (lzma.txt).
+	size_t lzmasdk_compress_memory(uint32_t dict_size, bool binary_tree = true);
+
+	/// Upper bound of the size of the LZMA stream for 'in_data_size' bytes, without the properties.
+	size_t lzmasdk_compress_bound(size_t in_data_size);
+
+	/**
+	 * Compresses into 'out' from 'offset' on (properties followed by the LZMA
+	 * stream), keeping the bytes before it. 'out' is sized once with
+	 * lzmasdk_compress_bound and then shrunk to the end of the stream.
+	 * 'progress' is called by the encoder (ICompressProgress), every 128 KB
+	 * of input. When it stops the compression, 'out' is resized to
+	 * 'offset' and false is returned.
+	 */
+	bool lzmasdk_compress_into(const uint8_t *in_data, size_t in_data_size, std::vector<uint8_t> &out,
+	                           const size_t offset, const encoder_options &options,
+	                           const progress_callback &progress = progress_callback());
+	std::vector<uint8_t> lzmasdk_compress(const std::vector<uint8_t> &in_data, const encoder_options &options);
+	inline std::vector<uint8_t> lzmasdk_compress(const std::vector<uint8_t> &in_data, unsigned threads = 1) {
+		encoder_options options;
+		options.threads = threads;
+		return lzmasdk_compress(in_data, options);
+	}
 	std::vector<uint8_t> lzmasdk_decompress(const std::vector<uint8_t> &in_data, const int lzma2 = 0);
 
+	/**
+	 * Decompresses 'in_data' (properties followed by the LZMA stream) into
+	 * 'out' from 'offset' on, using 'out' itself as the decoder's dictionary.
+	 * 'out' should already have room for the whole output, it is only grown
+	 * if the data turns out to be larger. It is resized to the end of the
+	 * output. Reaching the end of 'out' exactly when the input runs out ends
+	 * the stream, so streams without an end marker are accepted.
+	 * 'progress' is called every 256 KB of output with the compressed bytes
+	 * consumed. When it stops the decompression, 'out' is resized to
+	 * 'offset' and false is returned.
+	 */
+	bool lzmasdk_decompress_into(const uint8_t *in_data, size_t in_data_size, std::vector<uint8_t> &out,
+	                             const size_t offset = 0, const progress_callback &progress = progress_callback());
+
+	/**
+	 * Decompresses 'in_data' (properties followed by the LZMA stream) in chunks
+	 * of up to 'chunk_size' bytes, passing each one to 'sink' as soon as it is
+	 * ready. Returns false if 'sink' stopped the decompression.
+	 */
+	bool lzmasdk_decompress(const uint8_t *in_data, size_t in_data_size, const chunk_sink &sink,
+	                        const int lzma2 = 0, const size_t chunk_size = 128 * 1024);
+
 	class lzmasdk_exception : public std::exception {
 		public:
 			explicit lzmasdk_exception(const std::string &message = "lzmasdk_exception")
@@ -34,9 +197,6 @@ namespace lzmasdk {
 			std::string error_message;
 	};
 
-	SRes VectorInStream_Read(const ISeqInStream *p, void *buf, size_t *size);
-	size_t VectorOutStream_Write(const ISeqOutStream *p, const void *buf, size_t size);
-
 } // lzmasdk
 
 #endif // LZMASDK_HPP
@@ -0,0 +1,193 @@
+/**
+ * libswf - Read-only memory-mapped files and gathered file writes
+ */
+
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <windows.h>
+#else
+	#include <sys/mman.h> // mmap, munmap
+	#include <sys/stat.h> // fstat
+	#include <sys/uio.h>  // writev, iovec
+	#include <climits>    // IOV_MAX
+	#include <fcntl.h>    // open
+	#include <unistd.h>   // close
+	#include <cerrno>     // errno
+	#include <cstring>    // strerror
+#endif
+
+#include <algorithm> // min
+
+using namespace std;
+
+namespace swf {
+
+	namespace {
+
+		class FileMapping {
+		public:
+			FileMapping(const void *addr_, size_t size_) : addr(addr_), size(size_) {}
+			FileMapping(const FileMapping &) = delete;
+			FileMapping &operator=(const FileMapping &) = delete;
+			~FileMapping() {
+#ifdef _WIN32
+				UnmapViewOfFile(addr);
+#else
+				munmap(const_cast<void *>(addr), size);
+#endif
+			}
+			const void *addr;
+			size_t size;
+		};
+
+#ifdef _WIN32
+		struct HandleCloser {
+			explicit HandleCloser(HANDLE h_) : h(h_) {}
+			HandleCloser(const HandleCloser &) = delete;
+			HandleCloser &operator=(const HandleCloser &) = delete;
+			~HandleCloser() { if (h != nullptr && h != INVALID_HANDLE_VALUE) CloseHandle(h); }
+			HANDLE h;
+		};
+#else
+		struct FdCloser {
+			explicit FdCloser(int fd_) : fd(fd_) {}
+			FdCloser(const FdCloser &) = delete;
+			FdCloser &operator=(const FdCloser &) = delete;
+			~FdCloser() { if (fd >= 0) close(fd); }
+			int fd;
+		};
+#endif
+
+	} // anonymous
+
+#ifdef _WIN32
+
+	SharedBytes mapFile(const string &path) {
+		int wlen = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+		wstring wpath(static_cast<size_t>(wlen > 0 ? wlen : 1), L'\0');
+		MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], wlen);
+
+		HandleCloser file(CreateFileW(wpath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+		if (file.h == INVALID_HANDLE_VALUE) {
+			throw mapped_file_exception("Could not open file '" + path + "'.");
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file.h, &fileSize)) {
+			throw mapped_file_exception("Could not get the size of file '" + path + "'.");
+		}
+		size_t size = static_cast<size_t>(fileSize.QuadPart);
+		if (size == 0) {
+			return SharedBytes();
+		}
+		HandleCloser mapping(CreateFileMappingW(file.h, nullptr, PAGE_READONLY, 0, 0, nullptr));
+		if (mapping.h == nullptr) {
+			throw mapped_file_exception("Could not map file '" + path + "'.");
+		}
+		const void *addr = MapViewOfFile(mapping.h, FILE_MAP_READ, 0, 0, 0);
+		if (addr == nullptr) {
+			throw mapped_file_exception("Could not map file '" + path + "'.");
+		}
+		// The view stays valid after both handles are closed.
+		auto fm = make_shared<const FileMapping>(addr, size);
+		return SharedBytes(fm, static_cast<const uint8_t *>(addr), size);
+	}
+
+	void writeFile(const string &path, const vector<SharedBytes> &segments) {
+		int wlen = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+		wstring wpath(static_cast<size_t>(wlen > 0 ? wlen : 1), L'\0');
+		MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], wlen);
+
+		HandleCloser file(CreateFileW(wpath.c_str(), GENERIC_WRITE, 0, nullptr,
+		                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+		if (file.h == INVALID_HANDLE_VALUE) {
+			throw mapped_file_exception("Could not create file '" + path + "'.");
+		}
+		// WriteFile has no gathering variant for regular (buffered) files.
+		for (const auto &segment : segments) {
+			const uint8_t *data = segment.data();
+			size_t left = segment.size();
+			while (left > 0) {
+				DWORD chunk = static_cast<DWORD>(left > 0x40000000 ? 0x40000000 : left);
+				DWORD written = 0;
+				if (!WriteFile(file.h, data, chunk, &written, nullptr)) {
+					throw mapped_file_exception("Could not write to file '" + path + "'.");
+				}
+				data += written;
+				left -= written;
+			}
+		}
+	}
+
+#else
+
+	SharedBytes mapFile(const string &path) {
+		FdCloser file(::open(path.c_str(), O_RDONLY));
+		if (file.fd < 0) {
+			throw mapped_file_exception("Could not open file '" + path + "': " + strerror(errno));
+		}
+		struct stat st;
+		if (fstat(file.fd, &st) != 0) {
+			throw mapped_file_exception("Could not get the size of file '" + path + "': " + strerror(errno));
+		}
+		size_t size = static_cast<size_t>(st.st_size);
+		if (size == 0) {
+			return SharedBytes();
+		}
+		void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+		if (addr == MAP_FAILED) {
+			throw mapped_file_exception("Could not map file '" + path + "': " + strerror(errno));
+		}
+		// The mapping stays valid after the file descriptor is closed.
+		auto fm = make_shared<const FileMapping>(addr, size);
+		return SharedBytes(fm, static_cast<const uint8_t *>(addr), size);
+	}
+
+	void writeFile(const string &path, const vector<SharedBytes> &segments) {
+		FdCloser file(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666));
+		if (file.fd < 0) {
+			throw mapped_file_exception("Could not create file '" + path + "': " + strerror(errno));
+		}
+
+		vector<iovec> iov;
+		iov.reserve(segments.size());
+		for (const auto &segment : segments) {
+			if (!segment.empty()) {
+				iov.push_back({const_cast<uint8_t *>(segment.data()), segment.size()});
+			}
+		}
+
+		// writev may write less than asked, or be limited to IOV_MAX segments.
+		size_t first = 0;
+		while (first < iov.size()) {
+			int count = static_cast<int>(min<size_t>(iov.size() - first, IOV_MAX));
+			ssize_t written = writev(file.fd, &iov[first], count);
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				throw mapped_file_exception("Could not write to file '" + path + "': " + strerror(errno));
+			}
+			size_t left = static_cast<size_t>(written);
+			while (first < iov.size() && left >= iov[first].iov_len) {
+				left -= iov[first].iov_len;
+				++first;
+			}
+			if (left > 0) {
+				iov[first].iov_base = static_cast<uint8_t *>(iov[first].iov_base) + left;
+				iov[first].iov_len -= left;
+			}
+		}
+
+		if (close(file.fd) != 0) {
+			file.fd = -1;
+			throw mapped_file_exception("Could not write to file '" + path + "': " + strerror(errno));
+		}
+		file.fd = -1;
+	}
+
+#endif
+
+} // swf
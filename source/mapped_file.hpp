@@ -0,0 +1,43 @@
+/**
+ * libswf - Read-only memory-mapped files and gathered file writes
+ */
+
+#ifndef SWF_MAPPED_FILE_HPP
+#define SWF_MAPPED_FILE_HPP
+
+#include <string>
+#include <vector>    // vector
+#include <exception> // exception
+#include "shared_bytes.hpp"
+
+namespace swf {
+
+	class mapped_file_exception : public std::exception {
+		public:
+			explicit mapped_file_exception(const std::string &message = "mapped_file_exception")
+				: std::exception(), error_message(message) {}
+			const char *what() const noexcept
+			{
+				return error_message.c_str();
+			}
+		private:
+			std::string error_message;
+	};
+
+	/**
+	 * Maps the whole file into memory, read-only. The mapping is released
+	 * when the last view into it is destroyed, and the file must not be
+	 * modified until then. On Windows the path is expected to be UTF-8.
+	 */
+	SharedBytes mapFile(const std::string &path);
+
+	/**
+	 * Creates (or truncates) the file at 'path' and writes the segments to it
+	 * in order, straight from where they are (writev on POSIX), without
+	 * joining them in a buffer first. On Windows the path is expected to be UTF-8.
+	 */
+	void writeFile(const std::string &path, const std::vector<SharedBytes> &segments);
+
+} // swf
+
+#endif // SWF_MAPPED_FILE_HPP
@@ -0,0 +1,74 @@
+/**
+ * libswf - SharedBytes class
+ */
+
+#ifndef SWF_SHARED_BYTES_HPP
+#define SWF_SHARED_BYTES_HPP
+
+#include <vector>    // vector
+#include <cstdint>   // uint8_t
+#include <memory>    // shared_ptr, make_shared
+#include <stdexcept> // out_of_range
+#include <utility>   // move
+
+namespace swf {
+
+	/**
+	 * Read-only byte range that shares ownership of the buffer it points into.
+	 *
+	 * Tag bodies are views into the decompressed SWF buffer, which is shared by
+	 * every tag, so parsing a SWF does not copy them. Assigning new bytes to a
+	 * tag (e.g. in the replace* functions) gives that tag a private buffer and
+	 * leaves the others pointing to the shared one.
+	 */
+	class SharedBytes {
+	public:
+		SharedBytes() : owner(), ptr(nullptr), length(0) {}
+		SharedBytes(const SharedBytes &) = default;
+		SharedBytes(SharedBytes &&) = default;
+		SharedBytes &operator=(const SharedBytes &) = default;
+		SharedBytes &operator=(SharedBytes &&) = default;
+
+		/// Takes ownership of the vector, no copy is made.
+		SharedBytes(std::vector<uint8_t> &&bytes) : owner(), ptr(nullptr), length(bytes.size()) {
+			auto buf = std::make_shared<const std::vector<uint8_t>>(std::move(bytes));
+			this->ptr = buf->data();
+			this->owner = std::move(buf);
+		}
+		SharedBytes(const std::vector<uint8_t> &bytes) : SharedBytes(std::vector<uint8_t>(bytes)) {}
+
+		/// View of 'size' bytes at 'data', kept alive by 'owner'.
+		SharedBytes(std::shared_ptr<const void> owner_, const uint8_t *data_, size_t size_)
+			: owner(std::move(owner_)), ptr(data_), length(size_) {}
+
+		/// View of a sub-range of this one, sharing the same buffer.
+		inline SharedBytes sub(size_t offset, size_t size) const {
+			if (offset > this->length || size > this->length - offset) {
+				throw std::out_of_range("SharedBytes: sub-range out of bounds.");
+			}
+			return SharedBytes(this->owner, this->ptr + offset, size);
+		}
+
+		inline const uint8_t *data() const { return this->ptr; }
+		inline size_t size() const { return this->length; }
+		inline bool empty() const { return this->length == 0; }
+		inline const uint8_t *begin() const { return this->ptr; }
+		inline const uint8_t *end() const { return this->ptr + this->length; }
+		inline uint8_t operator[](size_t pos) const { return this->ptr[pos]; }
+
+		inline std::vector<uint8_t> toVector() const { return std::vector<uint8_t>(begin(), end()); }
+
+		/// True if both views point into the same buffer.
+		inline bool sharesBufferWith(const SharedBytes &other) const {
+			return this->owner == other.owner;
+		}
+
+	private:
+		std::shared_ptr<const void> owner;
+		const uint8_t *ptr;
+		size_t length;
+	};
+
+} // swf
+
+#endif // SWF_SHARED_BYTES_HPP
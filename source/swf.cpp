@@ -4,10 +4,15 @@
 
 #include "swf.hpp"
 
-#include <algorithm> // search, iter_swap
+#include <algorithm> // search, iter_swap, copy
+#include <atomic>    // atomic
 #include <bitset>    // bitset
-#include <cmath>     // ceil
+#include <cmath>     // ceil, sqrt
+#include <future>    // async, future
+#include <limits>    // numeric_limits
 #include <map>       // map
+#include <mutex>     // mutex, lock_guard
+#include <thread>    // thread, hardware_concurrency
 //#include "xz_lzma_wrapper.hpp"
 #include <lodepng/lodepng.h> // export/import png
 #include "zlib_wrapper.hpp"
@@ -15,34 +20,96 @@
 #include "minimp3_ex.hpp" // get_mp3_info
 #include "swf_utils.hpp"
 #include "dynamic_bitset.hpp"
+#include "mapped_file.hpp"
 
 using namespace std;
 using namespace swf;
 
-map<int, string> SWF::tagTypeNames = {
-    {-1, "File Header"}, {0, "End"}, {1, "ShowFrame"}, {2, "DefineShape"}, {3, "FreeCharacter"}, {4, "PlaceObject"},
-    {5, "RemoveObject"}, {6, "DefineBitsJPEG"}, {7, "DefineButton"}, {8, "JPEGTables"}, {9, "SetBackgroundColor"},
-    {10, "DefineFont"}, {11, "DefineText"}, {12, "DoAction"}, {13, "DefineFontInfo"}, {14, "DefineSound"}, {15, "StartSound"},
-    {16, "StopSound"}, {17, "DefineButtonSound"}, {18, "SoundStreamHead"}, {19, "SoundStreamBlock"}, {20, "DefineBitsLossless"},
-    {21, "DefineBitsJPEG2"}, {22, "DefineShape2"}, {23, "DefineButtonCxform"}, {24, "Protect"}, {25, "PathsArePostscript"},
-    {26, "PlaceObject2"}, {28, "RemoveObject2"}, {29, "SyncFrame"}, {31, "FreeAll"}, {32, "DefineShape3"}, {33, "DefineText2"},
-    {34, "DefineButton2"}, {35, "DefineBitsJPEG3"}, {36, "DefineBitsLossless2"}, {37, "DefineEditText"}, {38, "DefineVideo"},
-    {39, "DefineSprite"}, {40, "NameCharacter"}, {41, "ProductInfo"}, {42, "DefineTextFormat"}, {43, "FrameLabel"},
-    {45, "SoundStreamHead2"}, {46, "DefineMorphShape"}, {47, "GenerateFrame"}, {48, "DefineFont2"}, {49, "GeneratorCommand"},
-    {50, "DefineCommandObject"}, {51, "CharacterSet"}, {52, "ExternalFont"}, {56, "Export"}, {57, "Import"},
-    {58, "EnableDebugger"}, {59, "DoInitAction"}, {60, "DefineVideoStream"}, {61, "VideoFrame"}, {62, "DefineFontInfo2"},
-    {63, "DebugID"}, {64, "EnableDebugger2"}, {65, "ScriptLimits"}, {66, "SetTabIndex"}, {69, "FileAttributes"},
-    {70, "PlaceObject3"}, {71, "Import2"}, {72, "DoABCDefine"}, {73, "DefineFontAlignZones"}, {74, "CSMTextSettings"},
-    {75, "DefineFont3"}, {76, "SymbolClass"}, {77, "Metadata"}, {78, "DefineScalingGrid"}, {82, "DoABC"}, {83, "DefineShape4"},
-    {84, "DefineMorphShape2"}, {86, "DefineSceneAndFrameData"}, {87, "DefineBinaryData"}, {88, "DefineFontName"},
-    {89, "StartSound2"}, {90, "DefineBitsJPEG4"}, {91, "DefineFont4"}, {93, "EnableTelemetry"}, {94, "PlaceObject4"}
-    };
-
-SWF::SWF(const vector<uint8_t> &buffer) : tags(), version(),
-			frameSize(), frameRate(), frameCount(), projector() {
-	this->parseSwf(buffer);
+SWF::SWF(const vector<uint8_t> &buffer, ParseMode mode, OriginalMode originalMode_, const Progress &progress,
+         unsigned threads) : tags(), idIndex(), typeIndex(), version(),
+			frameSize(), frameRate(), frameCount(), projector(), parseMode(mode), symbols(), symbolsById(), symbolsByName(),
+			original(), modified(false), originalMode(originalMode_), zlibReconstruction(), zlibCheckpoints(),
+			firstChangedTag(numeric_limits<size_t>::max()), firstEditedTag(numeric_limits<size_t>::max()) {
+	this->parseSwf(extractSwf(SharedBytes(buffer)), progress, threads);
 }
 
+SWF::SWF(vector<uint8_t> &&buffer, ParseMode mode, OriginalMode originalMode_, const Progress &progress,
+         unsigned threads) : tags(), idIndex(), typeIndex(), version(),
+			frameSize(), frameRate(), frameCount(), projector(), parseMode(mode), symbols(), symbolsById(), symbolsByName(),
+			original(), modified(false), originalMode(originalMode_), zlibReconstruction(), zlibCheckpoints(),
+			firstChangedTag(numeric_limits<size_t>::max()), firstEditedTag(numeric_limits<size_t>::max()) {
+	this->parseSwf(extractSwf(SharedBytes(move(buffer))), progress, threads);
+}
+
+SWF::SWF(const SharedBytes &buffer, ParseMode mode, OriginalMode originalMode_, const Progress &progress,
+         unsigned threads) : tags(), idIndex(), typeIndex(), version(),
+			frameSize(), frameRate(), frameCount(), projector(), parseMode(mode), symbols(), symbolsById(), symbolsByName(),
+			original(), modified(false), originalMode(originalMode_), zlibReconstruction(), zlibCheckpoints(),
+			firstChangedTag(numeric_limits<size_t>::max()), firstEditedTag(numeric_limits<size_t>::max()) {
+	this->parseSwf(extractSwf(buffer), progress, threads);
+}
+
+SWF SWF::open(const string &path, ParseMode mode, OriginalMode originalMode, const Progress &progress,
+              unsigned threads) {
+	SharedBytes file;
+	try {
+		file = mapFile(path);
+	} catch (const mapped_file_exception &mfe) {
+		throw swf_exception(mfe.what());
+	}
+	return SWF(file, mode, originalMode, progress, threads);
+}
+
+struct SWF::ZlibCheckpoints {
+	struct Checkpoint {
+		size_t tags = 0;       // tags before the checkpoint
+		size_t offset = 0;     // position in the uncompressed SWF
+		size_t compressed = 0; // bytes of the zlib stream before the checkpoint
+		unique_ptr<zlib::deflater> state{};
+	};
+	int level = 0;
+	int strategy = 0;
+	size_t interval = 0;
+	/// zlib stream of the last export, up to its last checkpoint.
+	vector<uint8_t> stream{};
+	vector<Checkpoint> points{};
+};
+
+SWF::SWF(SWF &&) = default;
+SWF &SWF::operator=(SWF &&) = default;
+SWF::~SWF() = default;
+
+namespace {
+
+	/**
+	 * progress.callback, called when 'interval' more bytes are done than at
+	 * the last call, or all of them (once), and when the work starts over
+	 * (fewer done). Empty without a callback, so that the wrappers skip
+	 * reporting altogether.
+	 */
+	function<bool(uint64_t, uint64_t)> throttled(const Progress &progress) {
+		if (!progress.callback) {
+			return nullptr;
+		}
+		auto last = make_shared<uint64_t>(0);
+		return [&progress, last](uint64_t done, uint64_t total) {
+			if (done == *last || (done > *last && done - *last < progress.interval && done < total)) {
+				return true;
+			}
+			*last = done;
+			return progress.callback(done, total);
+		};
+	}
+
+	/// Reports all of the 'total' bytes done at once, for work that was skipped.
+	void reportDone(const Progress &progress, uint64_t total) {
+		if (progress.callback && !progress.callback(total, total)) {
+			throw swf_cancelled_exception();
+		}
+	}
+
+} // anonymous
+
 
 /**
  * Export SWF as EXE. The binary file is as follows:
@@ -57,69 +124,97 @@ SWF::SWF(const vector<uint8_t> &buffer) : tags(), version(),
  * 3. Footer 0xFA123456 (little endian)
  * 4. SWF binary
  */
-vector<uint8_t> SWF::exportExe(const vector<uint8_t> &proj, CompressionChoice compression) {
-
-	vector<uint8_t> bytes = this->toBytes();
-
-	if (compression == CompressionChoice::zlib) {
-		bytes = zlibCompress(bytes);
-	} else if (compression == CompressionChoice::lzma) {
-		bytes = lzmaCompress(bytes);
-	} else if (compression != CompressionChoice::uncompressed) {
-		throw swf_exception("Invalid compression option.");
-	}
-
-	SWF_DEBUG("SWF binary size: " << bytes.size() << " bytes (" << bytesToMiB(bytes.size()) << " MiB).");
-
-	// Compressed length to save alongside footer
-	// so that we can calculate later the start position of the swf file
-	array<uint8_t, 4> length = dectobytes_le<uint32_t>(static_cast<uint32_t>(bytes.size()));
+vector<SharedBytes> SWF::exportExeSegments(const SharedBytes &proj, CompressionChoice compression,
+                                           const CompressionOptions &options, const Progress &progress) {
 
+	bool windows;
 	if (!proj.empty()) {
-		this->projector.buffer = proj;
-		if (isPEfile(this->projector.buffer)) {
-			this->projector.windows = true;
-		} else if (isELFfile(this->projector.buffer)) {
-			this->projector.windows = false;
+		if (isPEfile(proj.data(), proj.size())) {
+			windows = true;
+		} else if (isELFfile(proj.data(), proj.size())) {
+			windows = false;
 		} else {
 			throw swf_exception("Invalid projector file.");
 		}
-	} else if (!this->hasProjector()) {
+	} else if (this->hasProjector()) {
+		windows = this->projector.windows;
+	} else {
 		throw swf_exception("No projector file given.");
 	}
+	SharedBytes projectorBytes = proj.empty() ? this->projector.buffer : proj;
+
+	SharedBytes swfBytes = this->exportSwfBytes(compression, options, progress);
 
-	if (this->projector.windows) {
-		// 1st comes projector
-		concatVectorWithContainer(bytes, this->projector.buffer, false);
-		// 2nd comes swf (aka original 'bytes')
-		// 3rd comes projector footer
-		concatVectorWithContainer(bytes, this->projector.footer);
-		// 4th comes swf length
-		concatVectorWithContainer(bytes, length);
+	// Compressed length to save alongside footer
+	// so that we can calculate later the start position of the swf file
+	auto length = make_shared<array<uint8_t, 4>>(dectobytes_le<uint32_t>(static_cast<uint32_t>(swfBytes.size())));
+	SharedBytes lengthBytes(length, length->data(), length->size());
+	SharedBytes footerBytes(nullptr, Projector::footer.data(), Projector::footer.size());
+
+	if (windows) {
+		return {projectorBytes, swfBytes, footerBytes, lengthBytes};
 	} else {
-		// 1st comes projector
-		// 2nd comes swf length
-		// 3rd comes projector footer
-		// 4th comes swf (aka original 'bytes')
-		concatVectorWithContainer(bytes, this->projector.footer, false);
-		concatVectorWithContainer(bytes, length, false);
-		concatVectorWithContainer(bytes, this->projector.buffer, false);
+		return {projectorBytes, lengthBytes, footerBytes, swfBytes};
+	}
+}
+
+vector<uint8_t> SWF::exportExe(const vector<uint8_t> &proj, CompressionChoice compression,
+                               const CompressionOptions &options, const Progress &progress) {
+
+	// 'proj' is only viewed while exporting, not kept.
+	auto segments = this->exportExeSegments(SharedBytes(nullptr, proj.data(), proj.size()), compression, options,
+	                                         progress);
+
+	size_t size = 0;
+	for (const auto &segment : segments) {
+		size += segment.size();
+	}
+	vector<uint8_t> bytes(size);
+	uint8_t *out = bytes.data();
+	for (const auto &segment : segments) {
+		out = copy(segment.begin(), segment.end(), out);
 	}
 
 	return bytes;
 }
 
+void SWF::exportExeFile(const string &path, const string &projectorPath, CompressionChoice compression,
+                        const CompressionOptions &options, const Progress &progress) {
+	try {
+		SharedBytes proj = projectorPath.empty() ? SharedBytes() : mapFile(projectorPath);
+		writeFile(path, this->exportExeSegments(proj, compression, options, progress));
+	} catch (const mapped_file_exception &mfe) {
+		throw swf_exception(mfe.what());
+	}
+}
+
 /**
  * Export SWF
  */
-vector<uint8_t> SWF::exportSwf(CompressionChoice compression) {
+vector<uint8_t> SWF::exportSwf(CompressionChoice compression, const CompressionOptions &options,
+                               const Progress &progress) {
+
+	if (this->unmodifiedAs(compression, options)) {
+		if (this->zlibReconstruction) {
+			return this->reconstructZlib(progress);
+		}
+		reportDone(progress, this->serializedSize() - 8);
+		return this->original.toVector();
+	}
 
-	vector<uint8_t> bytes = this->toBytes();
+	// With checkpoints, the SWF is serialized as it is compressed.
+	bool checkpoints = compression == CompressionChoice::zlib && options.checkpointInterval > 0
+	                   && options.optimalIterations == 0;
+	vector<uint8_t> bytes = checkpoints ? this->zlibCompressFromCheckpoint(options, progress) : this->toBytes();
 
-	if (compression == CompressionChoice::zlib) {
-		bytes = zlibCompress(bytes);
+	if (checkpoints) {
+		// Compressed already.
+	} else if (compression == CompressionChoice::zlib) {
+		bytes = zlibCompress(bytes, options, progress);
 	} else if (compression == CompressionChoice::lzma) {
-		bytes = lzmaCompress(bytes);
+		bytes = lzmaCompress(bytes, options, progress);
+	} else if (compression == CompressionChoice::smallest) {
+		bytes = smallestCompress(bytes, options, progress);
 	} else if (compression != CompressionChoice::uncompressed) {
 		throw swf_exception("Invalid compression option.");
 	}
@@ -129,219 +224,355 @@ vector<uint8_t> SWF::exportSwf(CompressionChoice compression) {
 	return bytes;
 }
 
-void SWF::parseSwf(const vector<uint8_t> &buffer) {
+SharedBytes SWF::exportSwfBytes(CompressionChoice compression, const CompressionOptions &options,
+                                const Progress &progress) {
+	if (this->unmodifiedAs(compression, options) && !this->zlibReconstruction) {
+		reportDone(progress, this->serializedSize() - 8);
+		return this->original;
+	}
+	return SharedBytes(this->exportSwf(compression, options, progress));
+}
 
-	vector<uint8_t> swfBuf;
+bool SWF::isModified() const {
+	return this->modified || any_of(this->tags.begin(), this->tags.end(), [](const unique_ptr<Tag> &t) {
+		return t->modified;
+	});
+}
 
-	swfBuf = exe2swf(buffer);
+bool SWF::unmodifiedAs(CompressionChoice compression, const CompressionOptions &options) const {
+	if (this->isModified() || options != CompressionOptions()) {
+		return false;
+	} else if (this->zlibReconstruction) {
+		return compression == CompressionChoice::zlib;
+	} else if (this->original.empty()) {
+		return false;
+	}
+	switch (this->original[0]) {
+		case 'C':
+			return compression == CompressionChoice::zlib;
+		case 'Z':
+			return compression == CompressionChoice::lzma;
+		case 'F':
+			return compression == CompressionChoice::uncompressed;
+		default:
+			return false;
+	}
+}
 
-	if (swfBuf.size() > 4) {
-		SWF_DEBUG("Read " << swfBuf.size() << " bytes (" << bytesToMiB(swfBuf.size()) << " MiB).");
+void SWF::parseSwf(SharedBytes swfData, const Progress &progress, unsigned threads) {
+
+	if (swfData.size() > 4) {
+		SWF_DEBUG("Read " << swfData.size() << " bytes (" << bytesToMiB(swfData.size()) << " MiB).");
 	} else {
 		throw swf_exception("Invalid SWF file. File too small.");
 	}
 
-	size_t cur = parseSwfHeader(swfBuf);
+	// From here on the (decompressed) buffer is shared by all tags, which
+	// only keep views into it.
+	bool compressed = swfData[0] != 'F';
+	size_t cur = parseSwfHeader(swfData, progress, threads);
 
-	//find all tags
-	size_t tagStart = cur;
+	// Walk the tag headers. Each tag gets a view of its body, which is decoded
+	// right away, or in lazy mode only when the tag is first accessed. The
+	// progress of a compressed SWF was reported while decompressing it.
+	auto report = compressed ? nullptr : throttled(progress);
+	for (size_t i = 1; cur < swfData.size(); ++i) {
 
-	for (int id = 1; tagStart < swfBuf.size(); ++id) {
+		if (cur + 2 > swfData.size()) {
+			throw swf_exception("Invalid SWF file. Tag " + to_string(i) + " header is truncated.");
+		}
+		int type = bytestodec_le<uint16_t>(swfData.data() + cur) >> 6;
 
-		auto t = make_unique<Tag>();
-		auto len = t->parseTagHeader(swfBuf.data(), cur);
-		t->i = id;
+		unique_ptr<Tag> t = (this->parseMode == ParseMode::eager) ? makeTag(type) : nullptr;
+		if (!t) {
+			t = make_unique<Tag>();
+			t->decoded = (tagInfo(type).decoder == TagDecoder::none);
+		}
 
-		if (tagName(t->type) == "DefineBinaryData") {
-			auto dbd = make_unique<Tag_DefineBinaryData>();
-			dbd->i = t->i;
-			dbd->type = t->type;
-			dbd->longTag = t->longTag;
-			dbd->id = bytestodec_le<uint16_t>(swfBuf.data() + cur);
-			cur += 2;
-			dbd->reserved = bytestodec_le<uint32_t>(swfBuf.data() + cur);
-			cur += 4;
-			len -= 6;
-			// Copy tag data
-			for (size_t i = 0; i < len; ++i) {
-				dbd->data.emplace_back(swfBuf[cur++]);
-			}
-			// Add tag to vector of tags
-			tags.emplace_back(move(dbd));
-		} else if (tagName(t->type) == "DefineSound") {
-			auto ds = make_unique<Tag_DefineSound>();
-			ds->i = t->i;
-			ds->type = t->type;
-			ds->longTag = t->longTag;
-			ds->id = bytestodec_le<uint16_t>(swfBuf.data() + cur);
-			cur += 2;
-			bitset<8> soundInfo{};
-			bytesToBitset(soundInfo, array<uint8_t, 1>{swfBuf[cur++]});
-			subBitset(soundInfo, ds->soundFormat, 0);
-			subBitset(soundInfo, ds->soundRate, 4);
-			subBitset(soundInfo, ds->soundSize, 4 + 2);
-			subBitset(soundInfo, ds->soundType, 4 + 2 + 1);
-			ds->soundSampleCount = bytestodec_le<uint32_t>(swfBuf.data() + cur);
-			cur += 4;
-			len -= 7;
-			// Copy tag data
-			for (size_t i = 0; i < len; ++i) {
-				ds->data.emplace_back(swfBuf[cur++]);
-			}
-			// Add tag to vector of tags
-			tags.emplace_back(move(ds));
-		} else if (tagName(t->type) == "DefineBitsLossless" || tagName(t->type) == "DefineBitsLossless2") {
-			auto dbl = make_unique<Tag_DefineBitsLossless>();
-			dbl->i = t->i;
-			dbl->type = t->type;
-			dbl->longTag = t->longTag;
-			dbl->id = bytestodec_le<uint16_t>(swfBuf.data() + cur);
-			cur += 2;
-			if (tagName(t->type) == "DefineBitsLossless2") {
-				dbl->version2 = true;
-			}
-			dbl->bitmapFormat = bytestodec_le<uint8_t>(swfBuf.data() + cur);
-			++cur;
-			dbl->bitmapWidth = bytestodec_le<uint16_t>(swfBuf.data() + cur);
-			cur += 2;
-			dbl->bitmapHeight = bytestodec_le<uint16_t>(swfBuf.data() + cur);
-			cur += 2;
-			if (dbl->bitmapFormat == 3) {
-				dbl->bitmapColorTableSize = bytestodec_le<uint8_t>(swfBuf.data() + cur);
-				++cur;
-				len--;
-			}
-			len -= 7;
+		auto len = t->parseTagHeader(swfData.data(), cur);
+		t->i = i;
 
-			for (size_t i = 0; i < len; ++i) {
-				dbl->data.emplace_back(swfBuf[cur++]);
-			}
-			// Add tag to vector of tags
-			tags.emplace_back(move(dbl));
-
-		} else if (tagName(t->type) == "SymbolClass") {
-			auto sc = make_unique<Tag_SymbolClass>();
-
-			sc->i = t->i;
-			sc->type = t->type;
-			sc->longTag = t->longTag;
-
-			sc->numSymbols = bytestodec_le<uint16_t>(swfBuf.data() + cur);
-			cur += 2;
-			for (int i = 0; i < sc->numSymbols; ++i) {
-				uint16_t tid = bytestodec_le<uint16_t>(swfBuf.data() + cur);
-				cur += 2;
-				string name;
-				while (true) {
-					if (swfBuf[cur] == 0) {
-						break;
-					}
-					name += static_cast<char>(swfBuf[cur]);
-					++cur;
-				}
-				++cur;
-				sc->symbolClass.emplace_back(pair<size_t, string>(tid, name));
-				//SWF_DEBUG(tid << " - " << name);
-			}
-			// Add tag to vector of tags
-			tags.emplace_back(move(sc));
-		} else {
-			// Copy tag data
-			for (size_t i = 0; i < len; ++i) {
-				t->data.emplace_back(swfBuf[cur++]);
-			}
-			// Add tag to vector of tags
-			tags.emplace_back(move(t));
+		if (cur + len > swfData.size()) {
+			throw swf_exception("Invalid SWF file. Tag " + to_string(i) + " exceeds the file size.");
+		}
+
+		t->data = swfData.sub(cur, len);
+		readId(*t);
+		cur += len;
+
+		if (this->parseMode == ParseMode::eager && !t->decoded) {
+			decodeBody(*t);
 		}
 
 		/*SWF_DEBUG("Tag type: " << t.type << " (" << tagName(t.type) << ")\nTag length: " <<
 		      to_string(t.length) << " bytes (" << bytesToKiB(t.length) + " KiB).");*/
 
-		tagStart = cur;
+		tags.emplace_back(move(t));
+
+		if (report && !report(cur, swfData.size())) {
+			throw swf_cancelled_exception();
+		}
 	}
 
-	fillTagsSymbolName();
+	buildTagIndex();
+	buildSymbolIndex();
+
+	if (this->originalMode == OriginalMode::reconstruct && this->original.size() > 8 && this->original[0] == 'C') {
+		this->keepZlibReconstruction(swfData);
+	}
 }
 
-void SWF::fillTagsSymbolName() {
+/**
+ * Finds what reproduces the loaded CWS file from 'swf', the SWF it
+ * decompresses to, and lets go of the file. It is kept if this SWF does
+ * not serialize back to 'swf', since exports would not reproduce it then,
+ * and if the stream was not written by zlib: when deflate stops
+ * reproducing it before its last eighth.
+ */
+void SWF::keepZlibReconstruction(const SharedBytes &swf) {
+	// Compared a tag at a time, without a copy of the whole SWF. The header
+	// was read from 'swf'.
+	if (this->serializedSize() != swf.size()) {
+		return;
+	}
+	size_t pos = 8 + this->frameSize.size() + this->frameRate.size() + this->frameCount.size();
+	vector<uint8_t> bytes;
+	for (const auto &t : this->tags) {
+		bytes.resize(t->serializedSize());
+		t->writeTo(bytes.data());
+		if (!equal(bytes.begin(), bytes.end(), swf.begin() + static_cast<long>(pos))) {
+			return;
+		}
+		pos += bytes.size();
+	}
+
+	const size_t streamSize = this->original.size() - 8;
+	zlib::reconstruction r;
+	try {
+		r = zlib::zlib_find_reconstruction(this->original.data() + 8, streamSize, swf.data() + 8, swf.size() - 8);
+	} catch (const zlib::zlib_exception &) {
+		return;
+	}
+	if (r.tail.size() > streamSize / 8) {
+		return;
+	}
+	this->zlibReconstruction = make_unique<zlib::reconstruction>(move(r));
+	this->original = SharedBytes();
+}
+
+vector<uint8_t> SWF::reconstructZlib(const Progress &progress) const {
+	vector<uint8_t> swf = this->toBytes();
+	vector<uint8_t> buffer{'C', 'W', 'S', this->version};
+	buffer.insert(buffer.end(), swf.begin() + 4, swf.begin() + 8); // Length
+	try {
+		if (!zlib::zlib_reconstruct_into(swf.data() + 8, swf.size() - 8, *this->zlibReconstruction, buffer, 8,
+		                                 throttled(progress))) {
+			throw swf_cancelled_exception();
+		}
+	} catch (const zlib::zlib_exception &ze) {
+		throw swf_exception(ze.what());
+	}
+	return buffer;
+}
+
+/**
+ * Creates an empty, undecoded object of the Tag subclass for 'type',
+ * or nullptr if there is no subclass for it.
+ */
+unique_ptr<Tag> SWF::makeTag(int type) {
+	unique_ptr<Tag> t;
+	switch (tagInfo(type).decoder) {
+		case TagDecoder::binaryData:
+			t = make_unique<Tag_DefineBinaryData>();
+			break;
+		case TagDecoder::sound:
+			t = make_unique<Tag_DefineSound>();
+			break;
+		case TagDecoder::bitsLossless:
+		case TagDecoder::bitsLossless2: {
+			auto dbl = make_unique<Tag_DefineBitsLossless>();
+			dbl->version2 = (tagInfo(type).decoder == TagDecoder::bitsLossless2);
+			t = move(dbl);
+			break;
+		}
+		case TagDecoder::symbolClass:
+			t = make_unique<Tag_SymbolClass>();
+			break;
+		case TagDecoder::none:
+		default:
+			return nullptr;
+	}
+	t->type = static_cast<short>(type);
+	t->decoded = false;
+	return t;
+}
+
+void SWF::decodeBody(Tag &t) {
+	try {
+		t.parseBody();
+	} catch (const out_of_range &) {
+		throw swf_exception("Invalid SWF file. Tag " + to_string(t.i) + " (" + tagName(t.type) + ") is truncated.");
+	}
+}
+
+/**
+ * In lazy mode, replaces the undecoded tag by an object of its subclass,
+ * with the fields decoded. Does nothing for tags that are already decoded.
+ */
+Tag *SWF::decodeTag(unique_ptr<Tag> &t) {
+	if (!t->decoded) {
+		auto typed = makeTag(t->type);
+		typed->i = t->i;
+		typed->longTag = t->longTag;
+		typed->offset = t->offset;
+		typed->headerLength = t->headerLength;
+		typed->bodyLength = t->bodyLength;
+		typed->data = t->data;
+		typed->modified = t->modified;
+		typed->symbolName = t->symbolName;
+		decodeBody(*typed);
+		t = move(typed);
+	}
+	return t.get();
+}
+
+Tag *SWF::editTag(size_t pos) {
+	Tag *t = decodeTag(this->tags[pos]);
+	t->modified = true;
+	this->firstEditedTag = min(this->firstEditedTag, pos);
+	return t;
+}
+
+void SWF::changeTag(Tag &t) {
+	t.modified = true;
+	this->firstChangedTag = min(this->firstChangedTag, t.i - 1);
+}
+
+Tag *SWF::findTag(size_t id) const {
+	auto it = this->idIndex.find(id);
+	if (it == this->idIndex.end()) {
+		return nullptr;
+	}
+	return decodeTag(this->tags[it->second]);
+}
+
+void SWF::buildSymbolIndex() {
+	this->symbols.clear();
+	this->symbolsById.clear();
+	this->symbolsByName.clear();
+
+	constexpr int symbolClass = tagId("SymbolClass");
+	auto sc = this->typeIndex.find(symbolClass);
+	if (sc != this->typeIndex.end()) {
+		for (size_t n : sc->second) {
+			auto *t = static_cast<Tag_SymbolClass *>(decodeTag(this->tags[n]));
+			for (const auto &p : t->symbolClass) {
+				this->symbolsById.emplace(p.first, this->symbols.size());
+				this->symbolsByName.emplace(p.second, p.first);
+				this->symbols.emplace_back(p);
+			}
+		}
+	}
+
 	/// Apparently there can be symbols with same ID (e.g. HF v0.3.0 has story04
 	/// and story05 both with ID=216), although this is likely a bug, as there is
 	/// no tag for story05 and tags can't have the same ID. But considering this,
 	/// we fill the tags' symbolName as if there could be tags with same ID.
-	std::map<size_t, size_t> duplicates;
+	unordered_map<size_t, size_t> duplicates;
 	for (auto &t : this->tags) {
-		auto names = this->getSymbolName(t->id);
-		if (names.empty()) {
+		if (!isDefinitionTag(t->type)) {
 			continue;
-		} else if (names.size() == 1) {
-			t->symbolName = names[0];
-		} else if (names.size() > 1) {
-			if (duplicates.find(t->id) == duplicates.end()) {
-				duplicates[t->id] = 0;
-			} else {
-				++duplicates[t->id];
-			}
-			t->symbolName = names[duplicates[t->id]];
 		}
+		auto range = this->symbolsById.equal_range(t->id);
+		size_t count = static_cast<size_t>(distance(range.first, range.second));
+		size_t k = (count > 1) ? duplicates[t->id]++ : 0;
+		if (k < count) {
+			t->symbolName = this->symbols[next(range.first, static_cast<long>(k))->second].second;
+		}
+	}
+}
+
+/**
+ * Sets the character ID of a definition tag from the first two bytes of its
+ * body, so that every definition tag has one, whether it has a subclass or not.
+ */
+void SWF::readId(Tag &t) {
+	int idOffset = tagInfo(t.type).idOffset;
+	if (idOffset >= 0 && t.data.size() >= static_cast<size_t>(idOffset) + 2) {
+		t.id = bytestodec_le<uint16_t>(t.data.data() + idOffset);
+	}
+}
+
+void SWF::buildTagIndex() {
+	this->idIndex.clear();
+	this->typeIndex.clear();
+	this->idIndex.reserve(this->tags.size());
+	for (size_t n = 0; n < this->tags.size(); ++n) {
+		const Tag &t = *this->tags[n];
+		if (isDefinitionTag(t.type)) {
+			// Keep the first one if there are duplicate IDs.
+			this->idIndex.emplace(t.id, n);
+		}
+		this->typeIndex[t.type].emplace_back(n);
 	}
 }
 
-size_t SWF::parseSwfHeader(vector<uint8_t> &buffer) {
+size_t SWF::parseSwfHeader(SharedBytes &swfData, const Progress &progress, unsigned threads) {
 	size_t cur = 0;
 
 	//Check if file is SWF and what compression is used
 	SWF_DEBUG_NNL("Compression: ");
 	// bytes 0, 1, 2
-	string signature{static_cast<char>(buffer[cur]), static_cast<char>(buffer[++cur]), static_cast<char>(buffer[++cur])};
+	string signature{static_cast<char>(swfData[cur]), static_cast<char>(swfData[++cur]), static_cast<char>(swfData[++cur])};
 
 	if (signature == "FWS") { // FWS is SWF in little-endian
 		SWF_DEBUG("Uncompressed");
 	} else if (signature == "CWS") {
 		SWF_DEBUG("zlib");
-		buffer = zlibDecompress(buffer);
+		swfData = SharedBytes(zlibDecompress(swfData.data(), swfData.size(), progress, threads));
 	} else if (signature == "ZWS") {
 		SWF_DEBUG("LZMA");
-		buffer = lzmaDecompress(buffer);
+		swfData = SharedBytes(lzmaDecompress(swfData.data(), swfData.size(), progress));
 	} else {
 		throw swf_exception("Invalid SWF file. Unrecognized header.");
 	}
 
 	// Check version
-	this->version = buffer[++cur]; // byte 3
+	this->version = swfData[++cur]; // byte 3
 	SWF_DEBUG("SWF version: " << to_string(this->version));
 
 	// Check file length
 	// bytes 4, 5, 6, 7
-	uint32_t length = bytestodec_le<uint32_t>(buffer.data() + cur + 1);
+	uint32_t length = bytestodec_le<uint32_t>(swfData.data() + cur + 1);
 	cur += 4;
 	SWF_DEBUG("File length: " << length << " bytes (" << bytesToMiB(length) << " MiB).");
 
-	if (buffer.size() != length) {
+	if (swfData.size() != length) {
 		throw swf_exception("Bytes read and SWF size don't match.");
 	}
 
 	SWF_DEBUG("Frame size:");
 	// Nbits - number of bits used for each field of the frame size (there are 4 fields)
-	bitset<5> nbits_bitset(buffer[++cur] >> 3); // byte 8
+	bitset<5> nbits_bitset(swfData[++cur] >> 3); // byte 8
 	int nbits = static_cast<int>(nbits_bitset.to_ulong());
 	SWF_DEBUG("\tNbits: " << nbits);
 	size_t frameSizeBytes = static_cast<int>(ceil(((static_cast<float>(nbits) * 4.0f) + 5.0f) / 8.0f));
 
 	// If frame size is 9 bytes long, cur should be 17 after this
 	for (size_t i = 0; i < frameSizeBytes; ++i) {
-		this->frameSize.emplace_back(static_cast<char>(buffer[cur++]));
+		this->frameSize.emplace_back(static_cast<char>(swfData[cur++]));
 	}
 
 #ifdef SWF_DEBUG_BUILD
 	debugFrameSize(this->frameSize, nbits);
 #endif
 
-	this->frameRate = {buffer[cur], buffer[++cur]}; // bytes 17, 18
+	this->frameRate = {swfData[cur], swfData[++cur]}; // bytes 17, 18
 
 	// Looks like 1st byte isn't used, otherwise this should be little-endian
 	SWF_DEBUG("Frame rate: " << to_string(this->frameRate[1]));
 
-	this->frameCount = {buffer[++cur], buffer[++cur]}; // bytes 19, 20
+	this->frameCount = {swfData[++cur], swfData[++cur]}; // bytes 19, 20
 
 	SWF_DEBUG("Frame count: " << bytestodec_le<uint16_t>(this->frameCount.data()));
 
@@ -384,194 +615,785 @@ void SWF::debugFrameSize(const vector<uint8_t> &fs, size_t nbits) {
 #endif
 }
 
-vector<Tag *> SWF::getTagsOfType(int type) {
-	vector<Tag *> tmp;
-	for (auto &t : this->tags) {
-		if (t->type == type) {
-			tmp.emplace_back(t.get());
-		}
+SWF::TagRange SWF::getTagsOfType(int type) {
+	auto it = this->typeIndex.find(type);
+	if (it == this->typeIndex.end()) {
+		return TagRange();
 	}
-	return tmp;
+	return TagRange(this, it->second);
+}
+
+SWF::ConstTagRange SWF::getTagsOfType(int type) const {
+	auto it = this->typeIndex.find(type);
+	if (it == this->typeIndex.end()) {
+		return ConstTagRange();
+	}
+	return ConstTagRange(this, it->second);
 }
 
 Tag * SWF::getTagWithId(size_t id) {
-	for (auto &t : this->tags) {
-		if (t->id == id) {
-			return t.get();
-		}
+	auto it = this->idIndex.find(id);
+	if (it == this->idIndex.end()) {
+		return nullptr;
 	}
-	return nullptr;
+	return this->editTag(it->second);
+}
+
+const Tag * SWF::getTagWithId(size_t id) const {
+	return this->findTag(id);
 }
 
 vector< pair<size_t, string> > SWF::getAllSymbols() const {
-	vector< pair<size_t, string> > symbols;
-	for (auto const &t : this->tags) {
-		if (t->type == tagId("SymbolClass")) {
-			auto *sc = static_cast<Tag_SymbolClass *>(t.get());
-			concatVectorWithContainer(symbols, sc->symbolClass);
-		}
-	}
-	return symbols;
+	return this->symbols;
 }
 
 vector<string> SWF::getSymbolName(size_t id) const {
 	vector<string> names;
-	for (auto const &t : this->tags) {
-		if (t->type == tagId("SymbolClass")) {
-			auto *sc = static_cast<Tag_SymbolClass *>(t.get());
-			auto it = find_if(sc->symbolClass.begin(), sc->symbolClass.end(),
-				  [id](const pair<size_t, string> &p) -> bool { return p.first == id; });
-			if (it != sc->symbolClass.end()) {
-				names.emplace_back(it->second);
-			}
-		}
+	auto range = this->symbolsById.equal_range(id);
+	for (auto it = range.first; it != range.second; ++it) {
+		names.emplace_back(this->symbols[it->second].second);
 	}
 	return names;
 }
 
-vector<uint8_t> SWF::toBytes() const {
-	vector<uint8_t> buffer{'F', 'W', 'S', this->version};
+Tag *SWF::findBySymbolName(const string &name) {
+	auto it = this->symbolsByName.find(name);
+	if (it == this->symbolsByName.end()) {
+		return nullptr;
+	}
+	return this->getTagWithId(it->second);
+}
 
-	vector<uint8_t> buf;
+size_t SWF::serializedSize() const {
+	size_t length = 8 + this->frameSize.size() + this->frameRate.size() + this->frameCount.size();
 	for (const auto &t : tags) {
-		vector<uint8_t> bytes = t->toBytes();
-		buf.insert(buf.end(), bytes.begin(), bytes.end());
+		length += t->serializedSize();
 	}
+	return length;
+}
 
-	uint32_t length = 12 + static_cast<uint32_t>(this->frameSize.size()) + static_cast<uint32_t>(buf.size());
+uint8_t *SWF::writeTo(uint8_t *out) const {
+	const uint8_t signature[] = {'F', 'W', 'S', this->version};
+	out = copy(begin(signature), end(signature), out);
+	out = dectobytes_le<uint32_t>(static_cast<uint32_t>(this->serializedSize()), out);
+	out = copy(this->frameSize.begin(), this->frameSize.end(), out);
+	out = copy(this->frameRate.begin(), this->frameRate.end(), out);
+	out = copy(this->frameCount.begin(), this->frameCount.end(), out);
 
-	array<uint8_t, 4> len = dectobytes_le<uint32_t>(length);
-	buffer.insert(buffer.end(), len.begin(), len.end());
-	buffer.insert(buffer.end(), this->frameSize.begin(), this->frameSize.end());
-	buffer.insert(buffer.end(), this->frameRate.begin(), this->frameRate.end());
-	buffer.insert(buffer.end(), this->frameCount.begin(), this->frameCount.end());
+	for (const auto &t : tags) {
+		out = t->writeTo(out);
+	}
 
-	buffer.insert(buffer.end(), buf.begin(), buf.end());
+	return out;
+}
 
+vector<uint8_t> SWF::toBytes() const {
+	vector<uint8_t> buffer(this->serializedSize());
+	this->writeTo(buffer.data());
 	return buffer;
 }
 
-vector<uint8_t> SWF::zlibCompress(const vector<uint8_t> &swf) {
+namespace {
+
+	/// zlib_compress_parallel_into with the threads that fit in options.memoryLimit.
+	bool deflateInto(const uint8_t *data, size_t size, vector<uint8_t> &out, size_t offset,
+	                 const CompressionOptions &options,
+	                 const zlib::progress_callback &progress = zlib::progress_callback()) {
+		const size_t blockSize = 128 * 1024;
+		unsigned threads = options.threads;
+		if (threads == 0) {
+			threads = max(1u, thread::hardware_concurrency());
+		}
+		if (options.memoryLimit > 0) {
+			size_t fit = options.memoryLimit / zlib::zlib_parallel_thread_memory(blockSize);
+			threads = static_cast<unsigned>(max<size_t>(1, min<size_t>(threads, fit)));
+		}
+		if (options.optimalIterations > 0) {
+			return zlib::zlib_compress_optimal_into(data, size, out, offset, options.optimalIterations, threads,
+			                                        1024 * 1024, progress);
+		}
+		return zlib::zlib_compress_parallel_into(data, size, out, offset, options.level, threads, blockSize,
+		                                         options.strategy, progress);
+	}
+
+} // anonymous
+
+vector<uint8_t> SWF::zlibCompress(const vector<uint8_t> &swf, const CompressionOptions &options,
+                                  const Progress &progress) {
 
 	vector<uint8_t> buffer{'C', 'W', 'S', (this->version >= 6 ? this->version : static_cast<uint8_t>(6))};
-	buffer.reserve(buffer.size() + swf.size()); // more efficient
 	buffer.insert(buffer.end(), swf.begin() + 4, swf.begin() + 8); // Length
-	vector<uint8_t> compressed = zlib::zlib_compress(swf.data()+8, swf.size()-8, Z_BEST_COMPRESSION);
-	buffer.insert(buffer.end(), compressed.begin(), compressed.end());
+	// Compressed in place after the header.
+	if (!deflateInto(swf.data() + 8, swf.size() - 8, buffer, 8, options, throttled(progress))) {
+		throw swf_cancelled_exception();
+	}
 	return buffer;
 }
 
-vector<uint8_t> SWF::zlibDecompress(const vector<uint8_t> &swf) {
+/**
+ * zlibCompress for exportSwf, which serializes the SWF as it compresses it.
+ * The compression resumes (deflateCopy) from the last checkpoint of the
+ * previous export before the first tag that may have changed since (see
+ * firstChangedTag), after the compressed bytes before it, so only the tags
+ * after it are serialized and compressed. New checkpoints are taken after it.
+ */
+vector<uint8_t> SWF::zlibCompressFromCheckpoint(const CompressionOptions &options, const Progress &progress) {
+
+	const size_t size = this->serializedSize();
+
+	unique_ptr<ZlibCheckpoints> old = move(this->zlibCheckpoints);
+	auto cache = make_unique<ZlibCheckpoints>();
+	cache->level = options.level;
+	cache->strategy = options.strategy;
+	cache->interval = options.checkpointInterval;
+
+	size_t reused = 0;
+	if (old && old->level == options.level && old->strategy == options.strategy
+	    && old->interval == options.checkpointInterval) {
+		size_t unchanged = min(this->firstChangedTag, this->firstEditedTag);
+		while (reused < old->points.size() && old->points[reused].tags <= unchanged) {
+			++reused;
+		}
+	}
 
-	vector<uint8_t> buffer(swf.begin(), swf.begin() + 8);
-	buffer[0] = 'F';
+	vector<uint8_t> buffer{'C', 'W', 'S', (this->version >= 6 ? this->version : static_cast<uint8_t>(6))};
+	buffer.resize(8);
+	dectobytes_le<uint32_t>(static_cast<uint32_t>(size), buffer.data() + 4); // Length
+
+	// Serialized bytes not compressed yet: the rest of the header when
+	// starting over, then whole tags. 'pos' is where they end in the SWF.
+	vector<uint8_t> pending;
+	unique_ptr<zlib::deflater> deflater;
+	size_t pos, tag;
+	if (reused > 0) {
+		const ZlibCheckpoints::Checkpoint &last = old->points[reused - 1];
+		deflater = make_unique<zlib::deflater>(*last.state);
+		cache->stream = move(old->stream);
+		cache->stream.resize(last.compressed);
+		pos = last.offset;
+		tag = last.tags;
+		cache->points.insert(cache->points.end(), make_move_iterator(old->points.begin()),
+		                     make_move_iterator(old->points.begin() + static_cast<long>(reused)));
+	} else {
+		deflater = make_unique<zlib::deflater>(options.level, options.strategy);
+		pending.insert(pending.end(), this->frameSize.begin(), this->frameSize.end());
+		pending.insert(pending.end(), this->frameRate.begin(), this->frameRate.end());
+		pending.insert(pending.end(), this->frameCount.begin(), this->frameCount.end());
+		pos = 8 + pending.size();
+		tag = 0;
+	}
+	old.reset();
+
+	// The reused compressed bytes, and then the new ones, go straight to the output.
+	buffer.reserve(8 + cache->stream.size() + deflater->bound(size - pos + pending.size()));
+	buffer.insert(buffer.end(), cache->stream.begin(), cache->stream.end());
+	auto sink = [&buffer](const uint8_t *data, size_t n) {
+		buffer.insert(buffer.end(), data, data + n);
+		return true;
+	};
+
+	// Fed in steps, to report large tags. Cancelling drops the checkpoints,
+	// the next export starts over.
+	auto report = throttled(progress);
+	auto feed = [&]() {
+		size_t fed = pos - pending.size();
+		for (size_t done = 0; done < pending.size();) {
+			size_t step = min<size_t>(pending.size() - done, 256 * 1024);
+			deflater->feed(pending.data() + done, step, sink);
+			done += step;
+			if (report && !report(fed + done - 8, size - 8)) {
+				throw swf_cancelled_exception();
+			}
+		}
+		pending.clear();
+	};
+	size_t lastCheckpoint = pos;
+	for (; tag < this->tags.size(); ++tag) {
+		Tag &t = *this->tags[tag];
+		size_t at = pending.size();
+		pending.resize(at + t.serializedSize());
+		t.writeTo(pending.data() + at);
+		pos += pending.size() - at;
+		bool checkpoint = pos - lastCheckpoint >= options.checkpointInterval && pos < size;
+		if (checkpoint || pending.size() >= 256 * 1024) {
+			feed();
+		}
+		if (checkpoint) {
+			ZlibCheckpoints::Checkpoint point;
+			point.tags = tag + 1;
+			point.offset = pos;
+			point.compressed = buffer.size() - 8;
+			point.state = make_unique<zlib::deflater>(*deflater);
+			cache->points.emplace_back(move(point));
+			lastCheckpoint = pos;
+		}
+	}
+	feed();
+	deflater->finish(sink);
+	if (report && !report(size - 8, size - 8)) {
+		throw swf_cancelled_exception();
+	}
+
+	// Only the stream up to the last checkpoint is needed to resume.
+	size_t keep = cache->points.empty() ? 0 : cache->points.back().compressed;
+	cache->stream.insert(cache->stream.end(), buffer.begin() + static_cast<long>(8 + cache->stream.size()),
+	                     buffer.begin() + static_cast<long>(8 + keep));
+	this->zlibCheckpoints = move(cache);
+	this->firstChangedTag = numeric_limits<size_t>::max();
+	return buffer;
+}
+
+namespace {
+
+	/**
+	 * Size of the FWS buffer a compressed SWF decompresses to, from the length
+	 * in its header. A length beyond deflate's maximum ratio (1032:1) is not
+	 * trusted up front, the buffer is then grown while decompressing.
+	 */
+	size_t decompressedSize(const uint8_t *swf, size_t compressedSize) {
+		size_t length = bytestodec_le<uint32_t>(swf + 4);
+		return max<size_t>(8, min<size_t>(length, 8 + 1032 * (compressedSize + 1)));
+	}
+
+} // anonymous
 
-	vector<uint8_t> tmp(swf.begin() + 8, swf.end());
-	vector<uint8_t> decompressed = zlib::zlib_decompress(tmp);
+vector<uint8_t> SWF::zlibDecompress(const uint8_t *swf, size_t size, const Progress &progress, unsigned threads) {
 
-	buffer.insert(buffer.end(), decompressed.begin(), decompressed.end());
+	if (size < 8) {
+		throw swf_exception("Invalid SWF file. Header is incomplete.");
+	}
+
+	// Inflate straight into the final buffer, after the header. Large
+	// bodies are inflated by 'threads' threads, small ones by zlib.
+	vector<uint8_t> buffer(decompressedSize(swf, size - 8));
+	copy(swf, swf + 8, buffer.begin());
+	buffer[0] = 'F';
+
+	if (!zlib::zlib_decompress_parallel_into(swf + 8, size - 8, buffer, 8, threads, 4 * 1024 * 1024,
+	                                         throttled(progress))) {
+		throw swf_cancelled_exception();
+	}
 
 	return buffer;
 }
 
-vector<uint8_t> SWF::lzmaCompress(const vector<uint8_t> &swf) {
+namespace {
+
+	lzmasdk::encoder_options lzmaOptionsOf(const CompressionOptions &options) {
+		lzmasdk::encoder_options lzmaOptions;
+		lzmaOptions.level = options.level;
+		lzmaOptions.dict_size = options.dictionarySize;
+		lzmaOptions.fast_bytes = options.fastBytes;
+		lzmaOptions.threads = options.threads;
+		lzmaOptions.memory_limit = options.memoryLimit;
+		return lzmaOptions;
+	}
+
+} // anonymous
+
+vector<uint8_t> SWF::lzmaCompress(const vector<uint8_t> &swf, const CompressionOptions &options,
+                                  const Progress &progress) {
 
 	vector<uint8_t> buffer{'Z', 'W', 'S', (this->version >= 13 ? this->version : static_cast<uint8_t>(13))};
-	buffer.reserve(buffer.size() + swf.size()); // more efficient
 	buffer.insert(buffer.end(), swf.begin() + 4, swf.begin() + 8); // Length
+	buffer.resize(12); // LZMA stream size, set below
 
-	vector<uint8_t> tmp(swf.begin() + 8, swf.end());
-	//vector<uint8_t> compressed = xz_lzma_compress(tmp); // Using XZ Utils
-	vector<uint8_t> compressed = lzmasdk::lzmasdk_compress(tmp); // Using LZMA SDK
+	// Compressed in place after the header.
+	if (!lzmasdk::lzmasdk_compress_into(swf.data() + 8, swf.size() - 8, buffer, 12, lzmaOptionsOf(options),
+	                                   throttled(progress))) { // Using LZMA SDK
+		throw swf_cancelled_exception();
+	}
 
 	// -5 because lzma properties are not included in the size
-	array<uint8_t, 4> compressedSize = dectobytes_le<uint32_t>(static_cast<uint32_t>(compressed.size()) - 5);
-	buffer.insert(buffer.end(), compressedSize.begin(), compressedSize.end());
-
-	buffer.insert(buffer.end(), compressed.begin(), compressed.end());
+	dectobytes_le<uint32_t>(static_cast<uint32_t>(buffer.size() - 12 - 5), buffer.data() + 8);
 
 	return buffer;
 }
 
-vector<uint8_t> SWF::lzmaDecompress(const vector<uint8_t> &swf) {
+vector<uint8_t> SWF::smallestCompress(const vector<uint8_t> &swf, const CompressionOptions &options,
+                                      const Progress &progress) {
+
+	// Size of the smallest complete SWF so far. The other compression stops
+	// as soon as its output is larger.
+	atomic<size_t> best(numeric_limits<size_t>::max());
+	auto finished = [&best](size_t size) {
+		size_t current = best.load();
+		while (size < current && !best.compare_exchange_weak(current, size)) {}
+	};
+
+	vector<uint8_t> zlibBuffer{'C', 'W', 'S', (this->version >= 6 ? this->version : static_cast<uint8_t>(6))};
+	zlibBuffer.insert(zlibBuffer.end(), swf.begin() + 4, swf.begin() + 8); // Length
+	vector<uint8_t> lzmaBuffer{'Z', 'W', 'S', (this->version >= 13 ? this->version : static_cast<uint8_t>(13))};
+	lzmaBuffer.insert(lzmaBuffer.end(), swf.begin() + 4, swf.begin() + 8); // Length
+	lzmaBuffer.resize(12); // LZMA stream size, set below
+
+	// Set when 'progress' cancels, which stops both.
+	atomic<bool> cancelled(false);
+	auto report = throttled(progress);
+	// Input bytes done by each compression, a stopped one counting as done:
+	// the slower one is reported, so that it goes on after the other ends.
+	const uint64_t total = swf.size() - 8;
+	atomic<uint64_t> zlibAt(0), lzmaAt(0);
+	mutex reportLock;
+	auto update = [&](atomic<uint64_t> &at, uint64_t done) {
+		at = done;
+		if (report) {
+			lock_guard<mutex> lock(reportLock);
+			if (!cancelled && !report(min(zlibAt.load(), lzmaAt.load()), total)) {
+				cancelled = true;
+			}
+		}
+		return !cancelled;
+	};
+
+	future<bool> zlibDone = async(launch::async, [&]() {
+		bool done;
+		if (options.threads == 1 && options.optimalIterations == 0) {
+			// One stream, which stops as soon as it is larger than the LZMA one.
+			auto sink = [&](const uint8_t *data, size_t size) {
+				zlibBuffer.insert(zlibBuffer.end(), data, data + size);
+				return zlibBuffer.size() <= best.load() && !cancelled;
+			};
+			zlib::deflater deflater(options.level, options.strategy);
+			const size_t step = 256 * 1024;
+			done = true;
+			for (size_t pos = 0; done && pos < total; pos += step) {
+				size_t n = min<size_t>(step, total - pos);
+				done = deflater.feed(swf.data() + 8 + pos, n, sink) && update(zlibAt, pos + n);
+			}
+			done = done && deflater.finish(sink);
+		} else {
+			// Parallel blocks or optimal parsing, as zlibCompress. The output
+			// is not known until the end, so only cancelling stops it.
+			done = deflateInto(swf.data() + 8, total, zlibBuffer, 8, options, [&](uint64_t at, uint64_t) {
+				return update(zlibAt, at);
+			});
+		}
+		if (done) {
+			finished(zlibBuffer.size());
+		}
+		update(zlibAt, total);
+		return done;
+	});
+	// Stops zlib, for an error in LZMA.
+	auto stopZlib = [&]() {
+		best = 0;
+		cancelled = true;
+		zlibDone.wait();
+	};
+
+	bool lzmaDone;
+	try {
+		const uint8_t *next = swf.data() + 8;
+		const uint8_t *end = swf.data() + swf.size();
+		auto source = [&](uint8_t *out, size_t size) {
+			size = min<size_t>(size, static_cast<size_t>(end - next));
+			copy(next, next + size, out);
+			next += size;
+			return size;
+		};
+		auto sink = [&](const uint8_t *data, size_t size) {
+			lzmaBuffer.insert(lzmaBuffer.end(), data, data + size);
+			return lzmaBuffer.size() <= best.load() && !cancelled;
+		};
+		lzmasdk::encoder encoder(lzmaOptionsOf(options));
+		auto lzmaProgress = [&](uint64_t done, uint64_t) {
+			return update(lzmaAt, done);
+		};
+		lzmaDone = encoder.encode(source, sink, total, report ? lzmaProgress : lzmasdk::progress_callback());
+		if (lzmaDone) {
+			finished(lzmaBuffer.size());
+		}
+		update(lzmaAt, total);
+	} catch (const lzmasdk::lzmasdk_exception &le) {
+		stopZlib();
+		throw swf_exception(le.what());
+	} catch (...) {
+		stopZlib();
+		throw;
+	}
 
-	vector<uint8_t> buffer(swf.begin(), swf.begin() + 8);
-	buffer[0] = 'F';
+	bool zlibOk;
+	try {
+		zlibOk = zlibDone.get();
+	} catch (const zlib::zlib_exception &ze) {
+		throw swf_exception(ze.what());
+	}
+	if (cancelled || (report && !report(total, total))) {
+		throw swf_cancelled_exception();
+	}
 
-	vector<uint8_t> tmp(swf.begin() + 12, swf.end());
-	//vector<uint8_t> decompressed = xz_lzma_decompress(tmp); // Using XZ Utils
-	vector<uint8_t> decompressed = lzmasdk::lzmasdk_decompress(tmp); // Using LZMA SDK
+	if (zlibOk && (!lzmaDone || zlibBuffer.size() <= lzmaBuffer.size())) {
+		return zlibBuffer;
+	}
+	// -5 because lzma properties are not included in the size
+	dectobytes_le<uint32_t>(static_cast<uint32_t>(lzmaBuffer.size() - 12 - 5), lzmaBuffer.data() + 8);
+	return lzmaBuffer;
+}
+
+SizeEstimate SWF::estimateCompressedSize(CompressionChoice compression, const CompressionOptions &options) {
+
+	if (this->unmodifiedAs(compression, options)) {
+		size_t size = this->zlibReconstruction
+		              ? 8 + static_cast<size_t>(this->zlibReconstruction->prefix) + this->zlibReconstruction->tail.size()
+		              : this->original.size();
+		return {size, size, size};
+	} else if (compression == CompressionChoice::uncompressed) {
+		size_t size = this->serializedSize();
+		return {size, size, size};
+	} else if (compression == CompressionChoice::smallest) {
+		SizeEstimate z = this->estimateCompressedSize(CompressionChoice::zlib, options);
+		SizeEstimate l = this->estimateCompressedSize(CompressionChoice::lzma, options);
+		return {min(z.size, l.size), min(z.low, l.low), min(z.high, l.high)};
+	} else if (compression != CompressionChoice::zlib && compression != CompressionChoice::lzma) {
+		throw swf_exception("Invalid compression option.");
+	}
 
-	buffer.insert(buffer.end(), decompressed.begin(), decompressed.end());
+	const bool deflate = (compression == CompressionChoice::zlib);
+	const size_t samples = 16;
+	const size_t blockSize = deflate ? 64 * 1024 : 256 * 1024;
+	// zlib header and adler32, LZMA properties, after the SWF header.
+	const size_t overhead = deflate ? 8 + 2 + 4 : 12 + 5;
+
+	vector<uint8_t> swf = this->toBytes();
+	const size_t bodySize = swf.size() - 8;
+	if (bodySize < 2 * samples * blockSize) {
+		size_t size = deflate ? this->zlibCompress(swf, options).size() : this->lzmaCompress(swf, options).size();
+		return {size, size, size};
+	}
+
+	// Compressed size of one block in the middle of each sixteenth of the body.
+	const uint8_t *body = swf.data() + 8;
+	vector<size_t> compressed(samples);
+	auto compressBlock = [&](size_t n) {
+		size_t stratum = bodySize / samples;
+		size_t start = n * stratum + (stratum - blockSize) / 2;
+		if (!deflate) {
+			lzmasdk::encoder_options lzmaOptions = lzmaOptionsOf(options);
+			lzmaOptions.threads = 1;
+			vector<uint8_t> out;
+			lzmasdk::lzmasdk_compress_into(body + start, blockSize, out, 0, lzmaOptions);
+			return out.size() - 5;
+		} else if (options.optimalIterations > 0) {
+			return zlib::zlib_compress_optimal(body + start, blockSize, options.optimalIterations, 1).size() - 6;
+		}
+		size_t size = 0;
+		auto count = [&size](const uint8_t *, size_t chunk) { size += chunk; return true; };
+		zlib::deflater deflater(options.level, options.strategy, -15);
+		size_t window = min<size_t>(start, 32 * 1024);
+		deflater.set_dictionary(body + start - window, window);
+		deflater.feed(body + start, blockSize, count);
+		deflater.finish(count);
+		return size;
+	};
+
+	unsigned threads = options.threads == 0 ? max(1u, thread::hardware_concurrency()) : options.threads;
+	threads = static_cast<unsigned>(min<size_t>(threads, samples));
+	atomic<size_t> next(0);
+	exception_ptr error;
+	atomic<bool> failed(false);
+	auto worker = [&]() {
+		try {
+			size_t n;
+			while (!failed && (n = next++) < samples) {
+				compressed[n] = compressBlock(n);
+			}
+		} catch (...) {
+			if (!failed.exchange(true)) {
+				error = current_exception();
+			}
+		}
+	};
+	vector<thread> pool;
+	for (unsigned t = 1; t < threads; ++t) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for (auto &t : pool) {
+		t.join();
+	}
+	if (error) {
+		rethrow_exception(error);
+	}
+
+	// Mean ratio, and a 95% interval from Student's t with 15 degrees of
+	// freedom, with the finite population correction.
+	double mean = 0;
+	for (size_t c : compressed) {
+		mean += static_cast<double>(c) / static_cast<double>(blockSize);
+	}
+	mean /= samples;
+	double variance = 0;
+	for (size_t c : compressed) {
+		double r = static_cast<double>(c) / static_cast<double>(blockSize) - mean;
+		variance += r * r;
+	}
+	variance /= samples - 1;
+	double sampled = static_cast<double>(samples * blockSize) / static_cast<double>(bodySize);
+	double margin = 2.131 * sqrt(variance / samples * (1 - sampled)) * static_cast<double>(bodySize);
+	double size = mean * static_cast<double>(bodySize);
+	return {overhead + static_cast<size_t>(size), overhead + static_cast<size_t>(max(0.0, size - margin)),
+	        overhead + static_cast<size_t>(size + margin)};
+}
+
+vector<uint8_t> SWF::lzmaDecompress(const uint8_t *swf, size_t size, const Progress &progress) {
+
+	if (size < 12) {
+		throw swf_exception("Invalid SWF file. Header is incomplete.");
+	}
+
+	// Bytes 8-11 are the size of the LZMA stream, without the 5 bytes of properties.
+	size_t compressedSize = size - 12;
+	size_t statedSize = static_cast<size_t>(bytestodec_le<uint32_t>(swf + 8)) + 5;
+	if (statedSize < compressedSize) {
+		compressedSize = statedSize;
+	}
+
+	// Decode straight into the final buffer, after the header.
+	vector<uint8_t> buffer(decompressedSize(swf, compressedSize));
+	copy(swf, swf + 8, buffer.begin());
+	buffer[0] = 'F';
+
+	if (!lzmasdk::lzmasdk_decompress_into(swf + 12, compressedSize, buffer, 8, throttled(progress))) { // Using LZMA SDK
+		throw swf_cancelled_exception();
+	}
 
 	return buffer;
 }
 
-vector<uint8_t> SWF::exe2swf(const vector<uint8_t> &exe) {
+/**
+ * Finds the SWF inside a projector EXE, see exportExe for the layout.
+ * Throws if the file is an executable without a SWF.
+ *
+ * Only the last bytes of a PE file, or the headers of an ELF file, are read.
+ * The file is searched for the footer only if the SWF is not where expected.
+ */
+SwfLocation SWF::locateSwf(const uint8_t *exe, size_t size) {
 
-	vector<string> sigs{"FWS", "CWS", "ZWS"};
+	const uint8_t *exeEnd = exe + size;
+	const uint8_t *footer = Projector::footer.data();
+	const size_t footerSize = Projector::footer.size();
+	SwfLocation loc{0, size, 0, false, false};
 	size_t swfStart = 0;
 	size_t swfEnd = 0;
 	uint32_t swfLength = 0;
 
-	if (isPEfile(exe)) {
-		vector<uint8_t>::const_iterator it = exe.begin();
-		while ((it = search(it + 4, exe.end(), this->projector.footer.begin(), this->projector.footer.end())) != exe.end()) {
-			size_t pos = static_cast<size_t>(it - exe.begin());
-			if (exe.size() < pos + 8)
+	auto isSwf = [&](size_t pos) -> bool {
+		return size >= 3 && pos <= size - 3 && (exe[pos] == 'F' || exe[pos] == 'C' || exe[pos] == 'Z') &&
+		       exe[pos + 1] == 'W' && exe[pos + 2] == 'S';
+	};
+
+	if (isPEfile(exe, size)) {
+		// The footer and SWF length are the last 8 bytes of the file.
+		// Only if they are not there, search for the last footer.
+		if (size >= 8 && equal(footer, footer + footerSize, exeEnd - 8)) {
+			swfLength = bytestodec_le<uint32_t>(exeEnd - 4);
+		} else {
+			const uint8_t *last = exeEnd;
+			for (const uint8_t *it = exe + 4; (it = findBytes(it, exeEnd, footer, footerSize)) != exeEnd; ++it) {
+				last = it;
+			}
+			size_t pos = static_cast<size_t>(last - exe);
+			if (last == exeEnd || size < pos + 8)
 				throw swf_exception("SWF not found inside EXE file.");
-			swfLength = bytestodec_le<uint32_t>(exe.data() + pos + 4);
-			if (exe.size() - pos == 8)
-				break;
+			swfLength = bytestodec_le<uint32_t>(exe + pos + 4);
 		}
-		if (it == exe.end())
+		if (swfLength > size - 8)
 			throw swf_exception("SWF not found inside EXE file.");
 
-		swfStart = exe.size() - swfLength - 8;
+		swfStart = size - swfLength - 8;
 		swfEnd = swfStart + swfLength;
 
-		string swfSig{static_cast<char>(exe[swfStart]),
-			      static_cast<char>(exe[swfStart + 1]), static_cast<char>(exe[swfStart + 2])};
-
-		if (find(sigs.begin(), sigs.end(), swfSig) == sigs.end()) {
+		if (!isSwf(swfStart)) {
 			throw swf_exception("SWF not found inside EXE file.");
 		}
 
-		this->projector.buffer = {exe.begin(), exe.begin() + swfStart};
-		this->projector.windows = true;
-	} else if (isELFfile(exe)) {
-		vector<uint8_t>::const_iterator it = exe.begin();
-		size_t pos = 0;
-		while ((it = search(it + 4, exe.end(), this->projector.footer.begin(), this->projector.footer.end())) != exe.end()) {
-			pos = (it - exe.begin());
+		loc.projectorLength = swfStart;
+		loc.windows = true;
+	} else if (isELFfile(exe, size)) {
+		// The SWF length, footer and SWF come right after the ELF image,
+		// whose size is given by its headers. Only if they are not there,
+		// search for a footer followed by a SWF.
+		size_t pos = elfImageSize(exe, size) + 4;
+		if (pos > 4 && size >= pos + 12 && equal(footer, footer + footerSize, exe + pos) && isSwf(pos + 4)) {
+			swfLength = bytestodec_le<uint32_t>(exe + pos - 4);
+			swfStart = pos + 4;
+			swfEnd = swfStart + swfLength;
+		} else {
+			const uint8_t *it = exe + 4;
+			while ((it = findBytes(it, exeEnd, footer, footerSize)) != exeEnd) {
+				pos = static_cast<size_t>(it - exe);
 
-			if (exe.size() < pos + 12) {
-				throw swf_exception("SWF not found inside ELF file.");
+				if (size < pos + 12) {
+					throw swf_exception("SWF not found inside ELF file.");
+				}
+
+				swfLength = bytestodec_le<uint32_t>(exe + pos - 4);
+
+				swfStart = pos + 4;
+				swfEnd = swfStart + swfLength;
+
+				if (isSwf(swfStart))
+					break;
+				++it;
 			}
+			if (it == exeEnd)
+				throw swf_exception("SWF not found inside ELF file.");
+		}
+		if (size < swfEnd)
+			throw swf_exception("SWF not found inside ELF file.");
 
-			swfLength = bytestodec_le<uint32_t>(exe.data() + pos - 4);
+		loc.projectorLength = pos - 4;
+		loc.windows = false;
+	} else {
+		return loc;
+	}
 
-			swfStart = pos + 4;
-			swfEnd = swfStart + swfLength;
+	loc.swfStart = swfStart;
+	loc.swfLength = swfEnd - swfStart;
+	loc.projector = true;
+	return loc;
+}
+
+void SWF::scanFile(const string &path, const TagCallback &callback) {
+	SharedBytes file;
+	try {
+		file = mapFile(path);
+	} catch (const mapped_file_exception &mfe) {
+		throw swf_exception(mfe.what());
+	}
+	scanTags(file, callback);
+}
+
+void SWF::scanTags(const SharedBytes &file, const TagCallback &callback) {
 
-			string swfSig{static_cast<char>(exe[swfStart]),
-				      static_cast<char>(exe[swfStart + 1]), static_cast<char>(exe[swfStart + 2])};
+	SwfLocation loc = locateSwf(file.data(), file.size());
+	SharedBytes swf = file.sub(loc.swfStart, loc.swfLength);
 
-			if (find(sigs.begin(), sigs.end(), swfSig) != sigs.end())
+	if (swf.size() <= 8) {
+		throw swf_exception("Invalid SWF file. File too small.");
+	}
+	string signature{static_cast<char>(swf[0]), static_cast<char>(swf[1]), static_cast<char>(swf[2])};
+	uint32_t length = bytestodec_le<uint32_t>(swf.data() + 4);
+
+	bool headerSkipped = false;
+	bool stopped = false;
+	size_t tagNumber = 1;
+	size_t windowOffset = 8; // position of the current window in the decompressed SWF
+
+	// Emits every complete tag in 'window' and returns the number of bytes consumed.
+	// The window starts where the previous one stopped, at byte 8 for the first one.
+	auto parseWindow = [&](const SharedBytes &window) -> size_t {
+		size_t cur = 0;
+		if (!headerSkipped) {
+			// Frame size (variable length), frame rate and frame count
+			if (window.empty()) return 0;
+			size_t nbits = window[0] >> 3;
+			size_t headerLength = (nbits * 4 + 5 + 7) / 8 + 4;
+			if (window.size() < headerLength) return 0;
+			cur = headerLength;
+			headerSkipped = true;
+		}
+		while (!stopped && window.size() - cur >= 2) {
+			uint16_t tagCodeAndLength = bytestodec_le<uint16_t>(window.data() + cur);
+			if ((tagCodeAndLength & 0x3F) == 0x3F && window.size() - cur < 6) {
 				break;
+			}
+			unique_ptr<Tag> t = makeTag(tagCodeAndLength >> 6);
+			if (!t) {
+				t = make_unique<Tag>();
+			}
+			size_t pos = cur;
+			size_t len = t->parseTagHeader(window.data(), pos);
+			if (window.size() - pos < len) {
+				break; // body not complete yet
+			}
+			t->i = tagNumber++;
+			t->offset += windowOffset;
+			t->data = window.sub(pos, len);
+			readId(*t);
+			if (!t->decoded) {
+				decodeBody(*t);
+			}
+			cur = pos + len;
+			stopped = !callback(*t);
 		}
-		if (it == exe.end() || exe.size() < swfEnd)
-			throw swf_exception("SWF not found inside ELF file.");
-
-		this->projector.buffer = {exe.begin(), exe.begin() + pos - 4};
-		this->projector.windows = false;
+		windowOffset += cur;
+		return cur;
+	};
+
+	size_t decompressedSize = 8;
+	size_t leftover = 0;
+
+	if (signature == "FWS") {
+		SharedBytes body = swf.sub(8, swf.size() - 8);
+		decompressedSize = swf.size();
+		leftover = body.size() - parseWindow(body);
+	} else if (signature == "CWS" || signature == "ZWS") {
+		// Decompressed bytes are appended to the window until at least one tag is
+		// complete. As the emitted tags may keep views into it, the remaining bytes
+		// then move to a new window instead of the old one being modified.
+		auto window = make_shared<vector<uint8_t>>();
+		auto sink = [&](const uint8_t *data, size_t size) -> bool {
+			decompressedSize += size;
+			window->insert(window->end(), data, data + size);
+			size_t consumed = parseWindow(SharedBytes(window, window->data(), window->size()));
+			if (consumed > 0) {
+				window = make_shared<vector<uint8_t>>(window->begin() + static_cast<long>(consumed), window->end());
+			}
+			return !stopped;
+		};
+		try {
+			if (signature == "CWS") {
+				zlib::zlib_decompress(swf.data() + 8, swf.size() - 8, sink);
+			} else {
+				if (swf.size() < 12 + LZMA_PROPS_SIZE) {
+					throw swf_exception("Invalid SWF file. File too small.");
+				}
+				lzmasdk::lzmasdk_decompress(swf.data() + 12, swf.size() - 12, sink);
+			}
+		} catch (const zlib::zlib_exception &ze) {
+			throw swf_exception(ze.what());
+		} catch (const lzmasdk::lzmasdk_exception &le) {
+			throw swf_exception(le.what());
+		}
+		leftover = window->size();
 	} else {
-		return exe;
+		throw swf_exception("Invalid SWF file. Unrecognized header.");
 	}
 
-	vector<uint8_t> swf{exe.begin() + swfStart, exe.begin() + swfEnd};
+	if (stopped) {
+		return;
+	}
+	if (leftover > 0) {
+		throw swf_exception("Invalid SWF file. Tag " + to_string(tagNumber) + " exceeds the file size.");
+	}
+	if (decompressedSize != length) {
+		throw swf_exception("Bytes read and SWF size don't match.");
+	}
+}
 
-	return swf;
+/**
+ * Returns a view of the SWF inside 'file'. If 'file' is a projector EXE,
+ * the projector is kept as a view into 'file', without copying it.
+ */
+SharedBytes SWF::extractSwf(const SharedBytes &file) {
+	SwfLocation loc = locateSwf(file.data(), file.size());
+	if (loc.projector) {
+		this->projector.buffer = file.sub(0, loc.projectorLength);
+		this->projector.windows = loc.windows;
+	}
+	this->original = file.sub(loc.swfStart, loc.swfLength);
+	return this->original;
+}
+
+vector<uint8_t> SWF::exe2swf(const vector<uint8_t> &exe) {
+	SwfLocation loc = locateSwf(exe.data(), exe.size());
+	if (loc.projector) {
+		this->projector.buffer = vector<uint8_t>(exe.begin(), exe.begin() + static_cast<long>(loc.projectorLength));
+		this->projector.windows = loc.windows;
+	}
+	return {exe.begin() + static_cast<long>(loc.swfStart), exe.begin() + static_cast<long>(loc.swfStart + loc.swfLength)};
 }
 
 /**
@@ -591,197 +1413,191 @@ vector<uint8_t> SWF::exportImage(size_t imageId) {
 	vector<Tag *> dbj3_v = this->getTagsOfType(SWF::tagId("DefineBitsJPEG3"));
 	vector<Tag *> dbj4_v = this->getTagsOfType(SWF::tagId("DefineBitsJPEG4"));*/
 
-	vector<Tag *> dbl_v = this->getTagsOfType(SWF::tagId("DefineBitsLossless"));
-	vector<Tag *> dbl2_v = this->getTagsOfType(SWF::tagId("DefineBitsLossless2"));
-	dbl_v.insert(dbl_v.end(), dbl2_v.begin(), dbl2_v.end());
-	for (auto &t : dbl_v) {
+	Tag *t = this->findTag(imageId);
+	if (t && (tagInfo(t->type).decoder == TagDecoder::bitsLossless || tagInfo(t->type).decoder == TagDecoder::bitsLossless2)) {
 		auto dbl = static_cast<Tag_DefineBitsLossless *>(t);
-		if (imageId == dbl->id) {
-
-			vector<uint8_t> png;
-			unsigned error;
-
-			/**
-			 * DefineBitsLossless:
-			 *     COLORMAPDATA for format 3
-			 *     BITMAPDATA for formats 4 and 5
-			 *
-			 * DefineBitsLossless2:
-			 *     ColorTableRGB and ColormapPixelData for format 3
-			 *     ARGB[image data size] for formats 4 and 5
-			 */
-			vector<uint8_t> decompressedImgData = zlib::zlib_decompress(dbl->data);
-
-			if (!dbl->version2) {
-
-				if (dbl->bitmapFormat == 3) {
-					// XXX Untested
-
-					vector<uint8_t> img;
-					img.reserve(dbl->bitmapWidth * dbl->bitmapHeight);
-
-					size_t pixelDataStart = (dbl->bitmapColorTableSize + 1) * 3;
-
-					lodepng::State state;
-
-					//generate palette
-					for (size_t i = 0; i < pixelDataStart; i += 3) {
-						//palette must be added both to input and output color mode, because in this
-						//sample both the raw image and the expected PNG image use that palette.
-						lodepng_palette_add(&state.info_png.color,
-								    decompressedImgData[i], // r
-								    decompressedImgData[i + 1], // g
-								    decompressedImgData[i + 2], // b
-								    0xFF); // a
-						lodepng_palette_add(&state.info_raw,
-								    decompressedImgData[i],
-								    decompressedImgData[i + 1],
-								    decompressedImgData[i + 2],
-								    0xFF);
-					}
 
-					//both the raw image and the encoded image must get colorType 3 (palette)
-					state.info_png.color.colortype = LCT_PALETTE; //if you comment this line, and create the above palette in info_raw instead, then you get the same image in a RGBA PNG.
-					state.info_png.color.bitdepth = 8;
-					state.info_raw.colortype = LCT_PALETTE;
-					state.info_raw.bitdepth = 8;
-					state.encoder.auto_convert = 0; //we specify ourselves exactly what output PNG color mode we want
-
-					int pad = 0;
-					for (size_t i = pixelDataStart; i < decompressedImgData.size(); ++i, ++pad) {
-						/**
-						 * In the DefineBitsLossless COLORMAPDATA structure, every row of pixels must
-						 * have a multiple of 4 number of pixels.
-						 */
-						if (pad == dbl->bitmapWidth) {
-							i += (dbl->bitmapWidth % 4) -1;
-							pad = -1;
-							continue;
-						} else {
-							img.emplace_back(decompressedImgData[i]);
-						}
-					}
+		vector<uint8_t> png;
+		unsigned error;
+
+		/**
+		 * DefineBitsLossless:
+		 *     COLORMAPDATA for format 3
+		 *     BITMAPDATA for formats 4 and 5
+		 *
+		 * DefineBitsLossless2:
+		 *     ColorTableRGB and ColormapPixelData for format 3
+		 *     ARGB[image data size] for formats 4 and 5
+		 */
+		vector<uint8_t> decompressedImgData = zlib::zlib_decompress(dbl->data.data(), dbl->data.size());
+
+		if (!dbl->version2) {
 
-					error = lodepng::encode(png, img, dbl->bitmapWidth, dbl->bitmapHeight, state);
-				} else if (dbl->bitmapFormat == 4) {
-					throw swf_exception("Exporting image for 'DefineBitsLossless' format 4 is not implemented.");
-				} else {
-					// Convert (R)RGB to RGBA - first R means Reserved and is always 0
-					for (size_t i = 0; i < decompressedImgData.size(); i += 4) {
-						iter_swap(decompressedImgData.begin() + i, decompressedImgData.begin() + i + 1);
-						iter_swap(decompressedImgData.begin() + i + 1, decompressedImgData.begin() + i + 2);
-						iter_swap(decompressedImgData.begin() + i + 2, decompressedImgData.begin() + i + 3);
-						decompressedImgData[i+3] = 0xFF;
+			if (dbl->bitmapFormat == 3) {
+				// XXX Untested
+
+				vector<uint8_t> img;
+				img.reserve(dbl->bitmapWidth * dbl->bitmapHeight);
+
+				size_t pixelDataStart = (dbl->bitmapColorTableSize + 1) * 3;
+
+				lodepng::State state;
+
+				//generate palette
+				for (size_t i = 0; i < pixelDataStart; i += 3) {
+					//palette must be added both to input and output color mode, because in this
+					//sample both the raw image and the expected PNG image use that palette.
+					lodepng_palette_add(&state.info_png.color,
+							    decompressedImgData[i], // r
+							    decompressedImgData[i + 1], // g
+							    decompressedImgData[i + 2], // b
+							    0xFF); // a
+					lodepng_palette_add(&state.info_raw,
+							    decompressedImgData[i],
+							    decompressedImgData[i + 1],
+							    decompressedImgData[i + 2],
+							    0xFF);
+				}
+
+				//both the raw image and the encoded image must get colorType 3 (palette)
+				state.info_png.color.colortype = LCT_PALETTE; //if you comment this line, and create the above palette in info_raw instead, then you get the same image in a RGBA PNG.
+				state.info_png.color.bitdepth = 8;
+				state.info_raw.colortype = LCT_PALETTE;
+				state.info_raw.bitdepth = 8;
+				state.encoder.auto_convert = 0; //we specify ourselves exactly what output PNG color mode we want
+
+				int pad = 0;
+				for (size_t i = pixelDataStart; i < decompressedImgData.size(); ++i, ++pad) {
+					/**
+					 * In the DefineBitsLossless COLORMAPDATA structure, every row of pixels must
+					 * have a multiple of 4 number of pixels.
+					 */
+					if (pad == dbl->bitmapWidth) {
+						i += (dbl->bitmapWidth % 4) -1;
+						pad = -1;
+						continue;
+					} else {
+						img.emplace_back(decompressedImgData[i]);
 					}
-					error = lodepng::encode(png, decompressedImgData, dbl->bitmapWidth, dbl->bitmapHeight);
 				}
 
+				error = lodepng::encode(png, img, dbl->bitmapWidth, dbl->bitmapHeight, state);
+			} else if (dbl->bitmapFormat == 4) {
+				throw swf_exception("Exporting image for 'DefineBitsLossless' format 4 is not implemented.");
 			} else {
+				// Convert (R)RGB to RGBA - first R means Reserved and is always 0
+				for (size_t i = 0; i < decompressedImgData.size(); i += 4) {
+					iter_swap(decompressedImgData.begin() + i, decompressedImgData.begin() + i + 1);
+					iter_swap(decompressedImgData.begin() + i + 1, decompressedImgData.begin() + i + 2);
+					iter_swap(decompressedImgData.begin() + i + 2, decompressedImgData.begin() + i + 3);
+					decompressedImgData[i+3] = 0xFF;
+				}
+				error = lodepng::encode(png, decompressedImgData, dbl->bitmapWidth, dbl->bitmapHeight);
+			}
 
-				if (dbl->bitmapFormat == 3) {
+		} else {
+
+			if (dbl->bitmapFormat == 3) {
+				/**
+				 * Field				Type							Comment
+				 *
+				 * ColorTableRGB 		RGBA[color table size]			Defines the mapping from color indices to RGBA values.
+				 * 														Number of RGBA values is BitmapColorTableSize + 1.
+				 *
+				 * ColormapPixelData	UI8[image data size]			Array of color indices. Number of entries is BitmapWidth
+				 * 														BitmapHeight, subject to padding (see note preceding
+				 *														this table).
+				 *
+				 * In the ColorTable we have an array of RGBA possible values.
+				 * The length of ColorTable in bytes is (BitmapColorTableSize + 1) * 4.
+				 *
+				 * The ColormapPixelData is an array of indices to ColorTableRGB whose
+				 * concatenation form the image.
+				 */
+				vector<uint8_t> img;
+				img.reserve(dbl->bitmapWidth * dbl->bitmapHeight);
+
+				size_t pixelDataStart = (dbl->bitmapColorTableSize + 1) * 4;
+
+				lodepng::State state;
+
+				//generate palette
+				for (size_t i = 0; i < pixelDataStart; i += 4) {
+					//palette must be added both to input and output color mode, because in this
+					//sample both the raw image and the expected PNG image use that palette.
+					lodepng_palette_add(&state.info_png.color,
+							    decompressedImgData[i], // r
+							    decompressedImgData[i + 1], // g
+							    decompressedImgData[i + 2], // b
+							    decompressedImgData[i + 3]); // a
+					lodepng_palette_add(&state.info_raw,
+							    decompressedImgData[i],
+							    decompressedImgData[i + 1],
+							    decompressedImgData[i + 2],
+							    decompressedImgData[i + 3]);
+				}
+
+				//both the raw image and the encoded image must get colorType 3 (palette)
+				state.info_png.color.colortype = LCT_PALETTE; //if you comment this line, and create the above palette in info_raw instead, then you get the same image in a RGBA PNG.
+				state.info_png.color.bitdepth = 8;
+				state.info_raw.colortype = LCT_PALETTE;
+				state.info_raw.bitdepth = 8;
+				state.encoder.auto_convert = 0; //we specify ourselves exactly what output PNG color mode we want
+
+				int pad = 0;
+				for (size_t i = pixelDataStart; i < decompressedImgData.size(); ++i, ++pad) {
 					/**
-					 * Field				Type							Comment
-					 *
-					 * ColorTableRGB 		RGBA[color table size]			Defines the mapping from color indices to RGBA values.
-					 * 														Number of RGBA values is BitmapColorTableSize + 1.
-					 *
-					 * ColormapPixelData	UI8[image data size]			Array of color indices. Number of entries is BitmapWidth
-					 * 														BitmapHeight, subject to padding (see note preceding
-					 *														this table).
-					 *
-					 * In the ColorTable we have an array of RGBA possible values.
-					 * The length of ColorTable in bytes is (BitmapColorTableSize + 1) * 4.
-					 *
-					 * The ColormapPixelData is an array of indices to ColorTableRGB whose
-					 * concatenation form the image.
+					 * In the DefineBitsLossless2 ALPHACOLORMAPDATA structure, every row of pixels must
+					 * have a multiple of 4 number of pixels.
 					 */
-					vector<uint8_t> img;
-					img.reserve(dbl->bitmapWidth * dbl->bitmapHeight);
-
-					size_t pixelDataStart = (dbl->bitmapColorTableSize + 1) * 4;
-
-					lodepng::State state;
-
-					//generate palette
-					for (size_t i = 0; i < pixelDataStart; i += 4) {
-						//palette must be added both to input and output color mode, because in this
-						//sample both the raw image and the expected PNG image use that palette.
-						lodepng_palette_add(&state.info_png.color,
-								    decompressedImgData[i], // r
-								    decompressedImgData[i + 1], // g
-								    decompressedImgData[i + 2], // b
-								    decompressedImgData[i + 3]); // a
-						lodepng_palette_add(&state.info_raw,
-								    decompressedImgData[i],
-								    decompressedImgData[i + 1],
-								    decompressedImgData[i + 2],
-								    decompressedImgData[i + 3]);
+					if (pad == dbl->bitmapWidth) {
+						i += (dbl->bitmapWidth % 4) -1;
+						pad = -1;
+						continue;
+					} else {
+						img.emplace_back(decompressedImgData[i]);
 					}
+				}
 
-					//both the raw image and the encoded image must get colorType 3 (palette)
-					state.info_png.color.colortype = LCT_PALETTE; //if you comment this line, and create the above palette in info_raw instead, then you get the same image in a RGBA PNG.
-					state.info_png.color.bitdepth = 8;
-					state.info_raw.colortype = LCT_PALETTE;
-					state.info_raw.bitdepth = 8;
-					state.encoder.auto_convert = 0; //we specify ourselves exactly what output PNG color mode we want
-
-					int pad = 0;
-					for (size_t i = pixelDataStart; i < decompressedImgData.size(); ++i, ++pad) {
-						/**
-						 * In the DefineBitsLossless2 ALPHACOLORMAPDATA structure, every row of pixels must
-						 * have a multiple of 4 number of pixels.
-						 */
-						if (pad == dbl->bitmapWidth) {
-							i += (dbl->bitmapWidth % 4) -1;
-							pad = -1;
-							continue;
-						} else {
-							img.emplace_back(decompressedImgData[i]);
-						}
-					}
+				error = lodepng::encode(png, img, dbl->bitmapWidth, dbl->bitmapHeight, state);
 
-					error = lodepng::encode(png, img, dbl->bitmapWidth, dbl->bitmapHeight, state);
-
-				} else {
-					// Convert ARGB to RGBA
-					for (size_t i = 0; i < decompressedImgData.size(); i += 4) {
-						iter_swap(decompressedImgData.begin() + i, decompressedImgData.begin() + i + 1); // RAGB
-						iter_swap(decompressedImgData.begin() + i + 1, decompressedImgData.begin() + i + 2); // RGAB
-						iter_swap(decompressedImgData.begin() + i + 2, decompressedImgData.begin() + i + 3); // RGBA
-
-						// The RGB data is multiplied by the alpha channel value.
-						float alpha = decompressedImgData[i+3] / 255.0f;
-					DIAGNOSTIC_PUSH()
-					DIAGNOSTIC_IGNORE("-Wfloat-equal")
-						if (alpha != 0) {
-					DIAGNOSTIC_POP()
-							decompressedImgData[i] = static_cast<uint8_t>(decompressedImgData[i] / alpha);
-							decompressedImgData[i+1] = static_cast<uint8_t>(decompressedImgData[i+1] / alpha);
-							decompressedImgData[i+2] = static_cast<uint8_t>(decompressedImgData[i+2] / alpha);
-						}
+			} else {
+				// Convert ARGB to RGBA
+				for (size_t i = 0; i < decompressedImgData.size(); i += 4) {
+					iter_swap(decompressedImgData.begin() + i, decompressedImgData.begin() + i + 1); // RAGB
+					iter_swap(decompressedImgData.begin() + i + 1, decompressedImgData.begin() + i + 2); // RGAB
+					iter_swap(decompressedImgData.begin() + i + 2, decompressedImgData.begin() + i + 3); // RGBA
+
+					// The RGB data is multiplied by the alpha channel value.
+					float alpha = decompressedImgData[i+3] / 255.0f;
+				DIAGNOSTIC_PUSH()
+				DIAGNOSTIC_IGNORE("-Wfloat-equal")
+					if (alpha != 0) {
+				DIAGNOSTIC_POP()
+						decompressedImgData[i] = static_cast<uint8_t>(decompressedImgData[i] / alpha);
+						decompressedImgData[i+1] = static_cast<uint8_t>(decompressedImgData[i+1] / alpha);
+						decompressedImgData[i+2] = static_cast<uint8_t>(decompressedImgData[i+2] / alpha);
 					}
-					error = lodepng::encode(png, decompressedImgData, dbl->bitmapWidth, dbl->bitmapHeight);
 				}
+				error = lodepng::encode(png, decompressedImgData, dbl->bitmapWidth, dbl->bitmapHeight);
 			}
+		}
 
-			if (error) {
-				throw swf_exception("PNG encoder error (" + to_string(error) + "): " + lodepng_error_text(error));
-			}
-			return png;
+		if (error) {
+			throw swf_exception("PNG encoder error (" + to_string(error) + "): " + lodepng_error_text(error));
 		}
+		return png;
 	}
 	throw swf_exception("No such Image ID: " + to_string(imageId));
 }
 
 
-const vector<uint8_t>& SWF::exportBinary(size_t tagId) {
+SharedBytes SWF::exportBinary(size_t tagId) {
 
-	vector<Tag *> tv = this->getTagsOfType(SWF::tagId("DefineBinaryData"));
-	for (auto &t : tv) {
+	Tag *t = this->findTag(tagId);
+	if (t && tagInfo(t->type).decoder == TagDecoder::binaryData) {
 		auto ds = static_cast<Tag_DefineBinaryData *>(t);
-		if (tagId == ds->id) {
-			return ds->data;
-		}
+		return ds->data;
 	}
 	throw swf_exception("No such Tag ID: " + to_string(tagId));
 }
@@ -789,13 +1605,12 @@ const vector<uint8_t>& SWF::exportBinary(size_t tagId) {
 
 void SWF::replaceBinary(const vector<uint8_t> &binBuf, size_t tagId) {
 
-	vector<Tag *> tv = this->getTagsOfType(SWF::tagId("DefineBinaryData"));
-	for (auto &t : tv) {
+	Tag *t = this->findTag(tagId);
+	if (t && tagInfo(t->type).decoder == TagDecoder::binaryData) {
 		auto ds = static_cast<Tag_DefineBinaryData *>(t);
-		if (tagId == ds->id) {
-			ds->data = binBuf;
-			return;
-		}
+		ds->data = binBuf;
+		this->changeTag(*ds);
+		return;
 	}
 	throw swf_exception("No such Tag ID: " + to_string(tagId));
 }
@@ -803,19 +1618,17 @@ void SWF::replaceBinary(const vector<uint8_t> &binBuf, size_t tagId) {
 
 vector<uint8_t> SWF::exportMp3(size_t soundId) {
 
-	vector<Tag *> tv = this->getTagsOfType(SWF::tagId("DefineSound"));
-	for (auto &t : tv) {
+	Tag *t = this->findTag(soundId);
+	if (t && tagInfo(t->type).decoder == TagDecoder::sound) {
 		auto ds = static_cast<Tag_DefineSound *>(t);
-		if (soundId == ds->id) {
-			/**
-			 * In the SWF, MP3 data starts with a SeekSamples fields that
-			 * represents the number of samples to skip. It is usually 0x00 0x00
-			 * and we remove this because it is not part of the MP3 data.
-			 *
-			 * swf-file-format-spec.pdf - page 188
-			 */
-			return {ds->data.begin() + 2, ds->data.end()};
-		}
+		/**
+		 * In the SWF, MP3 data starts with a SeekSamples fields that
+		 * represents the number of samples to skip. It is usually 0x00 0x00
+		 * and we remove this because it is not part of the MP3 data.
+		 *
+		 * swf-file-format-spec.pdf - page 188
+		 */
+		return {ds->data.begin() + 2, ds->data.end()};
 	}
 	throw swf_exception("No such Sound ID: " + to_string(soundId));
 }
@@ -830,130 +1643,125 @@ vector<uint8_t> SWF::exportMp3(size_t soundId) {
  *
  * To-do: detect if it's PNG, JPEG, GIF or something else.
  */
-void SWF::replaceImg(const vector<uint8_t> &imgBuf, size_t imageId) {
+void SWF::replaceImg(const vector<uint8_t> &imgBuf, size_t imageId, const CompressionOptions &options) {
 
 	/*vector<Tag *> db_v = this->getTagsOfType(SWF::tagId("DefineBits"));
 	vector<Tag *> dbj2_v = this->getTagsOfType(SWF::tagId("DefineBitsJPEG2"));
 	vector<Tag *> dbj3_v = this->getTagsOfType(SWF::tagId("DefineBitsJPEG3"));
 	vector<Tag *> dbj4_v = this->getTagsOfType(SWF::tagId("DefineBitsJPEG4"));*/
 
-	vector<Tag *> dbl_v = this->getTagsOfType(SWF::tagId("DefineBitsLossless"));
-	vector<Tag *> dbl2_v = this->getTagsOfType(SWF::tagId("DefineBitsLossless2"));
-	dbl_v.insert(dbl_v.end(), dbl2_v.begin(), dbl2_v.end());
-	for (auto &t : dbl_v) {
+	Tag *t = this->findTag(imageId);
+	if (t && (tagInfo(t->type).decoder == TagDecoder::bitsLossless || tagInfo(t->type).decoder == TagDecoder::bitsLossless2)) {
 		auto dbl = static_cast<Tag_DefineBitsLossless *>(t);
-		if (imageId == dbl->id) {
 
-			vector<uint8_t> argb;
-			unsigned width, height;
+		vector<uint8_t> argb;
+		unsigned width, height;
 
-			if (isPNGfile(imgBuf)) {
-				unsigned error = lodepng::decode(argb, width, height, imgBuf);
-				if (error) {
-					throw swf_exception("PNG decoder error (" + to_string(error) + "): " + lodepng_error_text(error));
-				}
-				// Convert RGBA to ARGB
-				for (size_t i = 0; i < argb.size(); i += 4) {
-					iter_swap(argb.begin() + i, argb.begin() + i + 3);// AGBR
-					iter_swap(argb.begin() + i + 1, argb.begin() + i + 2); // ABGR
-					iter_swap(argb.begin() + i + 1, argb.begin() + i + 3); // ARGB
-
-					// The RGB data must already be multiplied by the alpha channel value.
-					argb[i+1] = static_cast<uint8_t>((argb[i+1] * argb[i]) / 255u);
-					argb[i+2] = static_cast<uint8_t>((argb[i+2] * argb[i]) / 255u);
-					argb[i+3] = static_cast<uint8_t>((argb[i+3] * argb[i]) / 255u);
-
-					if (!dbl->version2) {
-						// Instead of alpha we have reserved which is always 0
-						argb[i] = 0;
-					}
+		if (isPNGfile(imgBuf)) {
+			unsigned error = lodepng::decode(argb, width, height, imgBuf);
+			if (error) {
+				throw swf_exception("PNG decoder error (" + to_string(error) + "): " + lodepng_error_text(error));
+			}
+			// Convert RGBA to ARGB
+			for (size_t i = 0; i < argb.size(); i += 4) {
+				iter_swap(argb.begin() + i, argb.begin() + i + 3);// AGBR
+				iter_swap(argb.begin() + i + 1, argb.begin() + i + 2); // ABGR
+				iter_swap(argb.begin() + i + 1, argb.begin() + i + 3); // ARGB
+
+				// The RGB data must already be multiplied by the alpha channel value.
+				argb[i+1] = static_cast<uint8_t>((argb[i+1] * argb[i]) / 255u);
+				argb[i+2] = static_cast<uint8_t>((argb[i+2] * argb[i]) / 255u);
+				argb[i+3] = static_cast<uint8_t>((argb[i+3] * argb[i]) / 255u);
+
+				if (!dbl->version2) {
+					// Instead of alpha we have reserved which is always 0
+					argb[i] = 0;
 				}
-			} else {
-				throw swf_exception("Only PNG format is implemented.");
-			}/*else if (isJPEGfile(imgBuf)) {
-				throw swf_exception("It is a JPEG file!");
-			} else if (isGIFfile(imgBuf)) {
-				throw swf_exception("It is a GIF file!");
-			} else {
-				throw swf_exception("Only PNG, JPEG and GIF formats are supported.");
-			}*/
-
-			vector<uint8_t> compressed = zlib::zlib_compress(argb, Z_BEST_COMPRESSION);
+			}
+		} else {
+			throw swf_exception("Only PNG format is implemented.");
+		}/*else if (isJPEGfile(imgBuf)) {
+			throw swf_exception("It is a JPEG file!");
+		} else if (isGIFfile(imgBuf)) {
+			throw swf_exception("It is a GIF file!");
+		} else {
+			throw swf_exception("Only PNG, JPEG and GIF formats are supported.");
+		}*/
 
-			dbl->bitmapWidth = static_cast<uint16_t>(width);
-			dbl->bitmapHeight = static_cast<uint16_t>(height);
-			dbl->bitmapFormat = 5;
-			dbl->data = compressed;
+		vector<uint8_t> compressed;
+		deflateInto(argb.data(), argb.size(), compressed, 0, options);
 
-			break;
-		}
+		dbl->bitmapWidth = static_cast<uint16_t>(width);
+		dbl->bitmapHeight = static_cast<uint16_t>(height);
+		dbl->bitmapFormat = 5;
+		dbl->data = move(compressed);
+		this->changeTag(*dbl);
 	}
 }
 
 void SWF::replaceMp3(const vector<uint8_t> &mp3Buf, size_t soundId) {
 
-	vector<Tag *> tv = this->getTagsOfType(SWF::tagId("DefineSound"));
-	for (auto &t : tv) {
+	Tag *t = this->findTag(soundId);
+	if (t && tagInfo(t->type).decoder == TagDecoder::sound) {
 		auto ds = static_cast<Tag_DefineSound *>(t);
-		if (soundId == ds->id) {
 
-			mp3::mp3_info info;
+		mp3::mp3_info info;
 
-			try {
-				info = mp3::get_mp3_info(mp3Buf);
-			} catch (const mp3::mp3_exception &me) {
-				throw swf_exception(me.what());
-			}
+		try {
+			info = mp3::get_mp3_info(mp3Buf);
+		} catch (const mp3::mp3_exception &me) {
+			throw swf_exception(me.what());
+		}
 
-			SWF_DEBUG("MP3 info:");
-			SWF_DEBUG("\tStereo: " << (info.stereo ? "yes" : "no"));
-			SWF_DEBUG("\tSample rate: " << info.hz << " Hz");
-			SWF_DEBUG("\tLayer: " << info.layer);
-			SWF_DEBUG("\tAvg. bitrate: " << info.avg_bitrate_kbps << " kbps");
-			SWF_DEBUG("\tSample count: " << info.total_samples);
-
-			if (info.hz != 5512 && info.hz != 11025
-			    && info.hz != 22050 && info.hz != 44100) {
-				throw swf_exception("MP3 sample rate must be one of the following: "
-					"5512 Hz, 11025 Hz, 22050 Hz, 44100 Hz");
-			}
+		SWF_DEBUG("MP3 info:");
+		SWF_DEBUG("\tStereo: " << (info.stereo ? "yes" : "no"));
+		SWF_DEBUG("\tSample rate: " << info.hz << " Hz");
+		SWF_DEBUG("\tLayer: " << info.layer);
+		SWF_DEBUG("\tAvg. bitrate: " << info.avg_bitrate_kbps << " kbps");
+		SWF_DEBUG("\tSample count: " << info.total_samples);
+
+		if (info.hz != 5512 && info.hz != 11025
+		    && info.hz != 22050 && info.hz != 44100) {
+			throw swf_exception("MP3 sample rate must be one of the following: "
+				"5512 Hz, 11025 Hz, 22050 Hz, 44100 Hz");
+		}
 
-			for (auto sr : Tag_DefineSound::soundRates) {
-				if (sr.second == info.hz) {
-					ds->soundRate = sr.first;
-					SWF_DEBUG("\tSample rate (swf format): " << ds->soundRate.to_ulong());
-					break;
-				}
+		for (auto sr : Tag_DefineSound::soundRates) {
+			if (sr.second == info.hz) {
+				ds->soundRate = sr.first;
+				SWF_DEBUG("\tSample rate (swf format): " << ds->soundRate.to_ulong());
+				break;
 			}
-
-			ds->soundFormat = 2;
-			ds->soundSize = 1;
-			ds->soundType = (info.stereo ? 1 : 0);
-			ds->soundSampleCount = static_cast<uint32_t>(info.total_samples);
-
-			/**
-			 * Get rid of ID3v2 tag at the beginning as it is an MP3 frame and
-			 * get rid of ID3v1 tag at the end as it is not an MP3 frame.
-			 *
-			 * http://mpgedit.org/mpgedit/mpeg_format/MP3Format.html
-			 *
-			 * swf-file-format-spec.pdf - page 188
-			 */
-			//ds->data = { mp3Buf.begin() + info.id3v2size, mp3Buf.begin() + info.id3v1position - info.id3v2size };
-
-			ds->data = { mp3Buf.begin() + info.id3v2size, mp3Buf.end() - info.id3v1size };
-
-			/**
-			 * In the SWF, MP3 data starts with a SeekSamples fields that
-			 * represents the number of samples to skip. It is usually 0x00 0x00.
-			 *
-			 * swf-file-format-spec.pdf - page 188
-			 */
-			ds->data.insert(ds->data.begin(), 0x00);
-			ds->data.insert(ds->data.begin(), 0x00);
-
-			return;
 		}
+
+		ds->soundFormat = 2;
+		ds->soundSize = 1;
+		ds->soundType = (info.stereo ? 1 : 0);
+		ds->soundSampleCount = static_cast<uint32_t>(info.total_samples);
+
+		/**
+		 * Get rid of ID3v2 tag at the beginning as it is an MP3 frame and
+		 * get rid of ID3v1 tag at the end as it is not an MP3 frame.
+		 *
+		 * http://mpgedit.org/mpgedit/mpeg_format/MP3Format.html
+		 *
+		 * swf-file-format-spec.pdf - page 188
+		 */
+		//ds->data = { mp3Buf.begin() + info.id3v2size, mp3Buf.begin() + info.id3v1position - info.id3v2size };
+
+		/**
+		 * In the SWF, MP3 data starts with a SeekSamples fields that
+		 * represents the number of samples to skip. It is usually 0x00 0x00.
+		 *
+		 * swf-file-format-spec.pdf - page 188
+		 */
+		vector<uint8_t> soundData{0x00, 0x00};
+		soundData.insert(soundData.end(), mp3Buf.begin() + info.id3v2size, mp3Buf.end() - info.id3v1size);
+
+		ds->data = move(soundData);
+		this->changeTag(*ds);
+
+		return;
 	}
 	throw swf_exception("No such Sound ID: " + to_string(soundId));
 }
@@ -19,10 +19,19 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <cstdint> //uint8_t, uint32_t
 #include <memory> // unique_ptr
 #include <algorithm> // find_if
+#include <functional> // function
+#include <iterator> // forward_iterator_tag
 #include "tag.hpp"
+#include "tag_info.hpp"
+#include "compression_options.hpp"
+
+namespace zlib {
+	struct reconstruction;
+}
 
 namespace swf {
 
@@ -38,43 +47,289 @@ namespace swf {
 			std::string error_message;
 	};
 
+	/// Thrown when a Progress callback returns false.
+	class swf_cancelled_exception : public swf_exception {
+		public:
+			swf_cancelled_exception() : swf_exception("Cancelled.") {}
+	};
+
 	class Projector {
 	public:
 		Projector() : windows(false), buffer() {};
 		bool windows;
-		std::vector<uint8_t> buffer;
-		const std::array<uint8_t, 4> footer = { 0x56, 0x34, 0x12, 0xFA };
+		/// When the SWF was loaded from an EXE, this is a view into the loaded file.
+		SharedBytes buffer;
+		static constexpr std::array<uint8_t, 4> footer = { 0x56, 0x34, 0x12, 0xFA };
+	};
+
+	/**
+	 * Where the SWF is inside a file. For a plain SWF file, 'projector' is
+	 * false and the SWF spans the whole file.
+	 */
+	struct SwfLocation {
+		size_t swfStart;
+		size_t swfLength;
+		size_t projectorLength;
+		bool projector;
+		bool windows;
 	};
 
 	enum class CompressionChoice {
 		zlib,
 		lzma,
-		uncompressed
+		uncompressed,
+		/// zlib and LZMA at the same time, keeping the smaller output (zlib if they are the same size).
+		smallest
+	};
+
+	/**
+	 * Size of an export, as estimated by SWF::estimateCompressedSize,
+	 * exactly 'size' if low == high. For zlib it is in [low, high] with a
+	 * confidence of about 95%. For LZMA [low, high] is only the spread
+	 * between the sampled blocks: the estimate is biased upward (see
+	 * SWF::estimateCompressedSize), the actual size is usually below
+	 * 'size' and may be below 'low'.
+	 */
+	struct SizeEstimate {
+		size_t size;
+		size_t low;
+		size_t high;
+	};
+
+	/**
+	 * eager: every tag is decoded while parsing.
+	 * lazy: parsing only walks the tag headers (and decodes the SymbolClass
+	 *       tags, for the symbol index). The fields of a tag subclass
+	 *       (e.g. Tag_DefineSound::soundFormat) are decoded the first time the
+	 *       tag is returned by getTagsOfType, getTagWithId, or used by the
+	 *       export/replace functions.
+	 */
+	enum class ParseMode {
+		eager,
+		lazy
+	};
+
+	/**
+	 * What a SWF keeps of the file it was loaded from, to export it as it
+	 * was while it is not modified (see exportSwf).
+	 * keep: the SWF as it was loaded (a view of it, if loaded from a view).
+	 * reconstruct: for a CWS file written by zlib (at any level and
+	 *              strategy), only the parameters that reproduce its zlib
+	 *              stream from the decompressed SWF, a few bytes (see
+	 *              zlib::zlib_find_reconstruction). Finding them compresses
+	 *              the SWF again while loading, which takes about as long as
+	 *              an export at the file's level. The file is kept as with
+	 *              'keep' when deflate stops reproducing it before its last
+	 *              eighth (streams written by other encoders, e.g. Zopfli,
+	 *              7-Zip or pigz), for ZWS and FWS files, and for CWS files
+	 *              that don't serialize back to what they decompress to.
+	 *              Only unmodified exports are reproduced, a modified SWF is
+	 *              compressed again as a whole.
+	 */
+	enum class OriginalMode {
+		keep,
+		reconstruct
+	};
+
+	/**
+	 * Reports the progress of loading and exporting, in bytes of input: of
+	 * the SWF as it is in the file while loading (the compressed bytes
+	 * decompressed, or the tags parsed of an uncompressed SWF), and of the
+	 * uncompressed SWF body while compressing an export. 'callback' is
+	 * called every 'interval' bytes and once everything is done (only then
+	 * when an unmodified SWF is exported as it was loaded), from any of
+	 * the threads doing the work, one at a time. Returning false cancels:
+	 * the work stops, its buffers are released and swf_cancelled_exception
+	 * is thrown. 'done' goes back to 0 if the work starts over, as when a
+	 * CWS file inflated by several threads has to be inflated again by zlib
+	 * (see zlib::zlib_decompress_parallel_into).
+	 */
+	struct Progress {
+		std::function<bool(uint64_t done, uint64_t total)> callback{};
+		uint64_t interval = 1024 * 1024;
 	};
 
 	class SWF {
 	public:
-		explicit SWF(const std::vector<uint8_t> &buffer);
-		std::vector <Tag *> getTagsOfType(int type);
-		Tag * getTagWithId(size_t id); // Every definition tag must specify a unique ID. Duplicate IDs are not allowed.
-		inline static std::string tagName(int id) { return (tagTypeNames.find(id) == tagTypeNames.end()) ? "Unknown" : tagTypeNames[id]; }
-		inline static int tagId(const std::string &name) {
-			auto it = std::find_if(tagTypeNames.begin(), tagTypeNames.end(),
-			             [name](const std::pair<int, std::string> &type) -> bool { return type.second == name; });
-			if (it != tagTypeNames.end()) return it->first; else return -2;
-		}
+		/// 'threads' inflate a CWS file (0 means one per hardware thread, 1 only
+		/// zlib), see zlib::zlib_decompress_parallel_into.
+		explicit SWF(const std::vector<uint8_t> &buffer, ParseMode mode = ParseMode::eager,
+		             OriginalMode originalMode_ = OriginalMode::keep, const Progress &progress = Progress(),
+		             unsigned threads = 0);
+		/// Takes ownership of the buffer, so that an uncompressed SWF is not copied.
+		explicit SWF(std::vector<uint8_t> &&buffer, ParseMode mode = ParseMode::eager,
+		             OriginalMode originalMode_ = OriginalMode::keep, const Progress &progress = Progress(),
+		             unsigned threads = 0);
+		/// Parses a SWF (or EXE) from a view, e.g. a mapped file. An uncompressed
+		/// SWF is parsed in place.
+		explicit SWF(const SharedBytes &buffer, ParseMode mode = ParseMode::eager,
+		             OriginalMode originalMode_ = OriginalMode::keep, const Progress &progress = Progress(),
+		             unsigned threads = 0);
+		/// Memory-maps the SWF or EXE file at 'path' (read-only) and parses it.
+		static SWF open(const std::string &path, ParseMode mode = ParseMode::eager,
+		                OriginalMode originalMode = OriginalMode::keep, const Progress &progress = Progress(),
+		                unsigned threads = 0);
+		SWF(SWF &&);
+		SWF &operator=(SWF &&);
+		~SWF();
+
+		/**
+		 * View of the tags of one type, in file order, as returned by
+		 * getTagsOfType. Nothing is copied: it walks the SWF's type index and
+		 * tags are decoded as they are accessed. A TagRange marks them
+		 * modified (see Tag::modified), a ConstTagRange doesn't. Valid as
+		 * long as the SWF.
+		 */
+		template<class SwfType, class TagType>
+		class BasicTagRange {
+		public:
+			class iterator {
+			public:
+				using iterator_category = std::forward_iterator_tag;
+				using value_type = TagType *;
+				using difference_type = std::ptrdiff_t;
+				using pointer = TagType **;
+				using reference = TagType *;
+
+				iterator(SwfType *swf_, const size_t *pos_) : swf(swf_), pos(pos_) {}
+				iterator(const iterator &) = default;
+				iterator &operator=(const iterator &) = default;
+				inline TagType *operator*() const { return swf->tagAt(*pos); }
+				inline iterator &operator++() { ++pos; return *this; }
+				inline iterator operator++(int) { iterator it = *this; ++pos; return it; }
+				inline bool operator==(const iterator &other) const { return pos == other.pos; }
+				inline bool operator!=(const iterator &other) const { return pos != other.pos; }
+			private:
+				SwfType *swf;
+				const size_t *pos;
+			};
+
+			BasicTagRange() : swf(nullptr), first(nullptr), last(nullptr) {}
+			BasicTagRange(SwfType *swf_, const std::vector<size_t> &indices)
+				: swf(swf_), first(indices.data()), last(indices.data() + indices.size()) {}
+			BasicTagRange(const BasicTagRange &) = default;
+			BasicTagRange &operator=(const BasicTagRange &) = default;
+
+			inline iterator begin() const { return iterator(swf, first); }
+			inline iterator end() const { return iterator(swf, last); }
+			inline size_t size() const { return static_cast<size_t>(last - first); }
+			inline bool empty() const { return first == last; }
+			inline TagType *operator[](size_t n) const { return swf->tagAt(first[n]); }
+		private:
+			SwfType *swf;
+			const size_t *first;
+			const size_t *last;
+		};
+		using TagRange = BasicTagRange<SWF, Tag>;
+		using ConstTagRange = BasicTagRange<const SWF, const Tag>;
+
+		TagRange getTagsOfType(int type);
+		/// Same as getTagsOfType, without marking the tags (e.g. std::as_const(swf).getTagsOfType(type)).
+		ConstTagRange getTagsOfType(int type) const;
+		/// Every definition tag must specify a unique ID. Duplicate IDs are not allowed.
+		/// The tag is marked modified, as it can be changed through the pointer.
+		Tag * getTagWithId(size_t id);
+		/// Same as getTagWithId, without marking the tag (e.g. std::as_const(swf).getTagWithId(id)).
+		const Tag * getTagWithId(size_t id) const;
+		/// True for the tags that define a character, whose body starts with the character ID.
+		inline static bool isDefinitionTag(int type) { return tagInfo(type).definition; }
+		inline static std::string tagName(int id) { return tagInfo(id).name; }
+		/// Code of the tag called 'name', -2 if there is none. Evaluated at compile time for literals.
+		inline static constexpr int tagId(std::string_view name) { return tagType(name); }
+		/// Size of the uncompressed SWF returned by toBytes.
+		size_t serializedSize() const;
+		/// Writes the uncompressed SWF to 'out', which must have room for
+		/// serializedSize() bytes. Returns the position after it.
+		uint8_t *writeTo(uint8_t *out) const;
 		std::vector<uint8_t> toBytes() const;
-		std::vector<uint8_t> zlibCompress(const std::vector<uint8_t> &swf);
-		std::vector<uint8_t> zlibDecompress(const std::vector<uint8_t> &swf);
-		std::vector<uint8_t> lzmaCompress(const std::vector<uint8_t> &swf);
-		std::vector<uint8_t> lzmaDecompress(const std::vector<uint8_t> &swf);
+		/// Compresses the body with 'options.threads' threads, see zlib::zlib_compress_parallel.
+		std::vector<uint8_t> zlibCompress(const std::vector<uint8_t> &swf, const CompressionOptions &options,
+		                                  const Progress &progress = Progress());
+		/// Inflates the body with 'threads' threads, see zlib::zlib_decompress_parallel_into.
+		std::vector<uint8_t> zlibDecompress(const uint8_t *swf, size_t size, const Progress &progress = Progress(),
+		                                    unsigned threads = 0);
+		inline std::vector<uint8_t> zlibDecompress(const std::vector<uint8_t> &swf) { return zlibDecompress(swf.data(), swf.size()); }
+		/// Compresses the body with a threaded match finder if 'options.threads' is not 1.
+		std::vector<uint8_t> lzmaCompress(const std::vector<uint8_t> &swf, const CompressionOptions &options,
+		                                  const Progress &progress = Progress());
+		std::vector<uint8_t> lzmaDecompress(const uint8_t *swf, size_t size, const Progress &progress = Progress());
+		inline std::vector<uint8_t> lzmaDecompress(const std::vector<uint8_t> &swf) { return lzmaDecompress(swf.data(), swf.size()); }
+		/**
+		 * Compresses with zlib (as zlibCompress) and LZMA concurrently and
+		 * returns the smaller SWF. Each compression stops as soon as its
+		 * output is larger than the other one's finished output, except zlib
+		 * with parallel blocks or optimal parsing ('options.threads' not 1,
+		 * or 'options.optimalIterations'), whose size is only known at the
+		 * end. 'progress' follows the compression that is further behind.
+		 */
+		std::vector<uint8_t> smallestCompress(const std::vector<uint8_t> &swf, const CompressionOptions &options,
+		                                      const Progress &progress = Progress());
+		/**
+		 * Size of exportSwf(compression, options), from 16 blocks spread
+		 * evenly over the serialized SWF, compressed by 'options.threads'
+		 * threads, whose ratio is extrapolated (see SizeEstimate). zlib
+		 * blocks get the 32 KB before them as their dictionary, like in the
+		 * whole SWF. LZMA blocks (256 KB) are compressed on their own, without
+		 * the 'options.dictionarySize' bytes before them that the whole SWF
+		 * finds matches in, which makes the LZMA estimate a few percent high,
+		 * more for a SWF that repeats itself further apart than a block.
+		 * SWFs smaller than twice the sampled bytes are compressed whole
+		 * instead.
+		 */
+		SizeEstimate estimateCompressedSize(CompressionChoice compression,
+		                                    const CompressionOptions &options = CompressionOptions());
 		std::vector<uint8_t> exe2swf(const std::vector<uint8_t> &exe);
+		static SwfLocation locateSwf(const uint8_t *file, size_t size);
+
+		/// Called by scanTags for every tag. Returning false stops the scan.
+		using TagCallback = std::function<bool(const Tag &tag)>;
+		/**
+		 * Calls 'callback' for every tag of the SWF (or of the SWF inside an EXE)
+		 * as soon as the tag's bytes are decompressed, without decompressing the
+		 * whole SWF first. Decompression stops as soon as 'callback' returns
+		 * false. Tags are decoded, and their data shares ownership of the chunk
+		 * of decompressed bytes it is in, so it can be kept after the callback.
+		 */
+		static void scanTags(const SharedBytes &file, const TagCallback &callback);
+		/// Same as scanTags, for the file at 'path', which is memory-mapped.
+		static void scanFile(const std::string &path, const TagCallback &callback);
 		std::vector<uint8_t> exportImage(size_t imageId);
 		std::vector<uint8_t> exportMp3(size_t soundId);
-		const std::vector<uint8_t>& exportBinary(size_t tagId);
-		std::vector<uint8_t> exportExe(const std::vector<uint8_t> &proj, CompressionChoice);
-		std::vector<uint8_t> exportSwf(CompressionChoice);
-		void replaceImg(const std::vector<uint8_t> &imgBuf, size_t imageId);
+		SharedBytes exportBinary(size_t tagId);
+		/**
+		 * The EXE made of the projector 'proj' (or the projector the SWF was
+		 * loaded with, if 'proj' is empty) and this SWF, as the pieces it is
+		 * made of, in order: projector, SWF, footer and length, which point into
+		 * 'proj', the compressed SWF and static data. See exportExe for the layout.
+		 */
+		std::vector<SharedBytes> exportExeSegments(const SharedBytes &proj, CompressionChoice,
+		                                           const CompressionOptions &options = CompressionOptions(),
+		                                           const Progress &progress = Progress());
+		/// Same as exportExeSegments, joined in one buffer. 'proj' is not kept.
+		std::vector<uint8_t> exportExe(const std::vector<uint8_t> &proj, CompressionChoice,
+		                               const CompressionOptions &options = CompressionOptions(),
+		                               const Progress &progress = Progress());
+		/// Writes the EXE to the file at 'path', with the projector at 'projectorPath'
+		/// (memory-mapped), or the one the SWF was loaded with if it is empty.
+		void exportExeFile(const std::string &path, const std::string &projectorPath, CompressionChoice,
+		                   const CompressionOptions &options = CompressionOptions(),
+		                   const Progress &progress = Progress());
+		/**
+		 * See CompressionOptions for the presets (CompressionOptions::fast(), max()).
+		 * An unmodified SWF exported with the default options and the compression
+		 * it was loaded with is returned as it was loaded, without compressing
+		 * it again (see isModified), which is a copy of it (exportSwfBytes and
+		 * exportExeSegments return a view of it instead). See Progress for 'progress'.
+		 */
+		std::vector<uint8_t> exportSwf(CompressionChoice, const CompressionOptions &options = CompressionOptions(),
+		                               const Progress &progress = Progress());
+		/// Same as exportSwf, but an unmodified SWF kept as it was loaded is returned
+		/// as a view of it, in O(1).
+		SharedBytes exportSwfBytes(CompressionChoice, const CompressionOptions &options = CompressionOptions(),
+		                           const Progress &progress = Progress());
+		/// The image is compressed with zlib, as configured by 'options'.
+		void replaceImg(const std::vector<uint8_t> &imgBuf, size_t imageId,
+		                const CompressionOptions &options = CompressionOptions());
 		void replaceMp3(const std::vector<uint8_t> &mp3Buf, size_t soundId);
 		void replaceBinary(const std::vector<uint8_t> &binBuf, size_t tagId);
 		inline bool hasProjector() { return ! projector.buffer.empty(); }
@@ -86,20 +341,77 @@ namespace swf {
 		/// no tag for story05 and tags can't have the same ID. Regardless, we return
 		/// all symbols with the given ID, in case there is more than one.
 		std::vector<std::string> getSymbolName(size_t id) const;
+		/// Tag of the symbol called 'name' (first one if there are more), or nullptr.
+		/// Marked modified like with getTagWithId.
+		Tag *findBySymbolName(const std::string &name);
 		inline uint8_t getVersion() const { return this->version; };
-		inline void setVersion(const uint8_t v) { this->version = v; };
+		inline void setVersion(const uint8_t v) { this->modified = this->modified || v != this->version; this->version = v; };
+		/// True if the header or a tag may have changed since the SWF was loaded, see Tag::modified.
+		bool isModified() const;
+		/// Makes the next exports serialize and compress the whole SWF, even with the default
+		/// CompressionOptions or from checkpoints (see CompressionOptions::checkpointInterval).
+		inline void markModified() { this->modified = true; this->firstChangedTag = 0; }
 	private:
-		void parseSwf(const std::vector<uint8_t> &buffer);
-		void fillTagsSymbolName();
-		static std::map<int, std::string> tagTypeNames;
-		std::vector <std::unique_ptr<Tag>> tags;
+		SharedBytes extractSwf(const SharedBytes &file);
+		void parseSwf(SharedBytes swfData, const Progress &progress, unsigned threads);
+		void buildSymbolIndex();
+		static std::unique_ptr<Tag> makeTag(int type);
+		static void readId(Tag &t);
+		static void decodeBody(Tag &t);
+		static Tag *decodeTag(std::unique_ptr<Tag> &t);
+		/// Decodes the tag at 'pos' in 'tags' for a caller that may change it, marking it modified.
+		Tag *editTag(size_t pos);
+		/// The tag at 'pos' in 'tags' for a TagRange (editTag) or a ConstTagRange (decoded, not marked).
+		inline Tag *tagAt(size_t pos) { return this->editTag(pos); }
+		inline const Tag *tagAt(size_t pos) const { return decodeTag(this->tags[pos]); }
+		/// Marks 't', just changed by a replace* function, modified.
+		void changeTag(Tag &t);
+		/// The tag with character ID 'id', decoded, or nullptr. Not marked modified.
+		Tag *findTag(size_t id) const;
+		void buildTagIndex();
+		/// Mutable because in lazy mode tags are decoded on first access,
+		/// also from const functions.
+		mutable std::vector <std::unique_ptr<Tag>> tags;
+		/// Positions in 'tags' of the definition tags by character ID,
+		/// and of the tags of each type.
+		std::unordered_map<size_t, size_t> idIndex;
+		std::unordered_map<int, std::vector<size_t>> typeIndex;
 		uint8_t version; // 1 byte, after signature, followed by 4 bytes representing the SWF file length
 		std::vector<uint8_t> frameSize; // 9 bytes on HF (it is a dynamic size)
 		std::array<uint8_t, 2> frameRate;
 		std::array<uint8_t, 2> frameCount;
-		size_t parseSwfHeader(std::vector<uint8_t> &buffer);
+		size_t parseSwfHeader(SharedBytes &swfData, const Progress &progress, unsigned threads);
 		void debugFrameSize(const std::vector<uint8_t>&bytes, size_t nbits);
 		Projector projector;
+		ParseMode parseMode;
+		/// Every symbol of the SymbolClass tags, in file order, with the
+		/// positions in 'symbols' by ID and the ID by name.
+		std::vector< std::pair<size_t, std::string> > symbols;
+		std::multimap<size_t, size_t> symbolsById;
+		std::unordered_map<std::string, size_t> symbolsByName;
+		/// The SWF (compressed or not) as it was loaded, and whether it changed since.
+		SharedBytes original;
+		bool modified;
+		OriginalMode originalMode;
+		/// Replaces 'original' in OriginalMode::reconstruct, see keepZlibReconstruction.
+		std::unique_ptr<zlib::reconstruction> zlibReconstruction;
+		void keepZlibReconstruction(const SharedBytes &swf);
+		/// The CWS file, reproduced from 'zlibReconstruction'.
+		std::vector<uint8_t> reconstructZlib(const Progress &progress) const;
+		/// True if 'original' (or 'zlibReconstruction') is the export for 'compression' and 'options'.
+		bool unmodifiedAs(CompressionChoice compression, const CompressionOptions &options) const;
+		/// Deflate states kept by exportSwf, see CompressionOptions::checkpointInterval.
+		struct ZlibCheckpoints;
+		std::unique_ptr<ZlibCheckpoints> zlibCheckpoints;
+		/**
+		 * Positions in 'tags' of the first tag changed by changeTag since the
+		 * last export with checkpoints, and of the first tag returned by
+		 * editTag, which may be changed at any time through the pointer.
+		 * Checkpoints after the first of them are not reused.
+		 */
+		size_t firstChangedTag;
+		size_t firstEditedTag;
+		std::vector<uint8_t> zlibCompressFromCheckpoint(const CompressionOptions &options, const Progress &progress);
 	};
 
 } // swf
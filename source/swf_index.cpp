@@ -0,0 +1,315 @@
+/**
+ * libswf - Random access into zlib compressed SWF files
+ */
+
+#include "swf_index.hpp"
+
+#include <algorithm> // min, equal, copy
+#include "tag_info.hpp"
+#include "swf_utils.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+using namespace swf;
+
+namespace {
+
+	constexpr array<uint8_t, 4> magic = { 'S', 'W', 'F', 'I' };
+	constexpr uint8_t formatVersion = 1;
+	constexpr uint32_t noId = 0xFFFFFFFF;
+
+	/**
+	 * Finds the tags in the uncompressed SWF body as it is inflated, chunk
+	 * by chunk. Only the frame header and tag headers (with the character
+	 * ID) are buffered, tag bodies are skipped.
+	 */
+	class TagScanner {
+	public:
+		explicit TagScanner(vector<SWFIndex::TagEntry> &tags_) : tags(tags_), pending(), consumed(8), skip(0), headerSkipped(false) {}
+
+		void feed(const uint8_t *data, size_t size) {
+			while (size > 0) {
+				if (this->skip > 0) {
+					size_t n = static_cast<size_t>(min<uint64_t>(this->skip, size));
+					this->skip -= n;
+					this->consumed += n;
+					data += n;
+					size -= n;
+					continue;
+				}
+				size_t need = this->needed();
+				while (this->pending.size() < need && size > 0) {
+					this->pending.push_back(*data++);
+					--size;
+					++this->consumed;
+					need = this->needed();
+				}
+				if (this->pending.size() == need) {
+					this->process();
+				}
+			}
+		}
+
+		/// Position after the last byte fed, and whether it is the end of a tag.
+		inline uint64_t position() const { return this->consumed; }
+		inline bool complete() const { return this->pending.empty() && this->skip == 0 && this->headerSkipped; }
+
+	private:
+		/// Bytes that 'pending' must have to be processed, as far as it is known.
+		size_t needed() const {
+			if (!this->headerSkipped) {
+				// Frame size (variable length), frame rate and frame count
+				return this->pending.empty() ? 1 : ((this->pending[0] >> 3) * 4u + 5 + 7) / 8 + 4;
+			}
+			if (this->pending.size() < 2) {
+				return 2;
+			}
+			uint16_t tagCodeAndLength = bytestodec_le<uint16_t>(this->pending.data());
+			size_t headerLength = ((tagCodeAndLength & 0x3F) == 0x3F) ? 6 : 2;
+			if (this->pending.size() < headerLength) {
+				return headerLength;
+			}
+			int idOffset = tagInfo(tagCodeAndLength >> 6).idOffset;
+			if (idOffset >= 0 && this->bodyLength(headerLength) >= static_cast<uint64_t>(idOffset) + 2) {
+				return headerLength + static_cast<size_t>(idOffset) + 2;
+			}
+			return headerLength;
+		}
+
+		uint32_t bodyLength(size_t headerLength) const {
+			return headerLength == 6 ? bytestodec_le<uint32_t>(this->pending.data() + 2) : (this->pending[0] & 0x3Fu);
+		}
+
+		void process() {
+			if (!this->headerSkipped) {
+				this->headerSkipped = true;
+				this->pending.clear();
+				return;
+			}
+			uint16_t tagCodeAndLength = bytestodec_le<uint16_t>(this->pending.data());
+			SWFIndex::TagEntry entry;
+			entry.type = tagCodeAndLength >> 6;
+			entry.id = -1;
+			entry.offset = this->consumed - this->pending.size();
+			entry.headerLength = ((tagCodeAndLength & 0x3F) == 0x3F) ? 6 : 2;
+			entry.bodyLength = this->bodyLength(entry.headerLength);
+			int idOffset = tagInfo(entry.type).idOffset;
+			if (idOffset >= 0 && this->pending.size() == entry.headerLength + static_cast<size_t>(idOffset) + 2) {
+				entry.id = bytestodec_le<uint16_t>(this->pending.data() + entry.headerLength + idOffset);
+			}
+			this->skip = entry.bodyLength - (this->pending.size() - entry.headerLength);
+			this->tags.push_back(entry);
+			this->pending.clear();
+		}
+
+		vector<SWFIndex::TagEntry> &tags;
+		vector<uint8_t> pending;
+		uint64_t consumed;
+		uint64_t skip;
+		bool headerSkipped;
+	};
+
+	/// Reads the sidecar file, throwing if it is shorter than expected.
+	class Reader {
+	public:
+		explicit Reader(const SharedBytes &bytes_) : bytes(bytes_), pos(0) {}
+
+		const uint8_t *take(size_t size) {
+			if (this->bytes.size() - this->pos < size) {
+				throw swf_index_exception("Invalid SWF index file. File too small.");
+			}
+			const uint8_t *p = this->bytes.data() + this->pos;
+			this->pos += size;
+			return p;
+		}
+		template<class T>
+		T get() {
+			return bytestodec_le<T>(this->take(sizeof(T)));
+		}
+		inline bool atEnd() const { return this->pos == this->bytes.size(); }
+
+	private:
+		const SharedBytes &bytes;
+		size_t pos;
+	};
+
+	template<class T>
+	void put(vector<uint8_t> &out, T value) {
+		auto bytes = dectobytes_le<T>(value);
+		out.insert(out.end(), bytes.begin(), bytes.end());
+	}
+
+} // anonymous
+
+SWFIndex SWFIndex::build(const SharedBytes &cws, uint64_t span) {
+	if (cws.size() < 8 + 6 || cws[0] != 'C' || cws[1] != 'W' || cws[2] != 'S') {
+		throw swf_index_exception("Only zlib compressed (CWS) files can be indexed.");
+	}
+	if (span == 0) {
+		throw swf_index_exception("The checkpoint span must not be 0.");
+	}
+
+	SWFIndex index;
+	copy(cws.begin(), cws.begin() + 8, index.header.begin());
+	copy(cws.end() - 4, cws.end(), index.adler.begin());
+	index.compressedSize = cws.size();
+	index.span = span;
+
+	TagScanner scanner(index.tags);
+	try {
+		index.points = zlib::zlib_build_index(cws.data() + 8, cws.size() - 8, span, [&](const uint8_t *data, size_t size) {
+			scanner.feed(data, size);
+			return true;
+		});
+	} catch (const zlib::zlib_exception &ze) {
+		throw swf_index_exception(ze.what());
+	}
+
+	index.length = scanner.position();
+	if (!scanner.complete()) {
+		throw swf_index_exception("Invalid SWF file. Tag " + to_string(index.tags.size()) + " exceeds the file size.");
+	}
+	if (index.length != bytestodec_le<uint32_t>(index.header.data() + 4)) {
+		throw swf_index_exception("Bytes read and SWF size don't match.");
+	}
+	return index;
+}
+
+SWFIndex SWFIndex::load(const string &path, const SharedBytes &cws) {
+	SharedBytes file = mapFile(path);
+	Reader reader(file);
+	SWFIndex index;
+
+	if (!equal(magic.begin(), magic.end(), reader.take(magic.size())) || reader.get<uint8_t>() != formatVersion) {
+		throw swf_index_exception("'" + path + "' is not a SWF index file.");
+	}
+	const uint8_t *p = reader.take(8);
+	copy(p, p + 8, index.header.begin());
+	p = reader.take(4);
+	copy(p, p + 4, index.adler.begin());
+	index.compressedSize = reader.get<uint64_t>();
+	index.length = reader.get<uint64_t>();
+	index.span = reader.get<uint64_t>();
+	index.check(cws);
+
+	uint64_t pointCount = reader.get<uint64_t>();
+	for (uint64_t n = 0; n < pointCount; ++n) {
+		zlib::access_point point;
+		point.out = reader.get<uint64_t>();
+		point.in = reader.get<uint64_t>();
+		point.bits = reader.get<uint8_t>();
+		uint16_t windowSize = reader.get<uint16_t>();
+		if (point.in > index.compressedSize - 8 || point.bits > 7) {
+			throw swf_index_exception("Invalid SWF index file. Checkpoint out of bounds.");
+		}
+		p = reader.take(windowSize);
+		point.window.assign(p, p + windowSize);
+		index.points.emplace_back(move(point));
+	}
+
+	uint64_t tagCount = reader.get<uint64_t>();
+	for (uint64_t n = 0; n < tagCount; ++n) {
+		TagEntry entry;
+		entry.type = reader.get<uint16_t>();
+		uint32_t id = reader.get<uint32_t>();
+		entry.id = (id == noId) ? -1 : id;
+		entry.offset = reader.get<uint64_t>();
+		entry.headerLength = reader.get<uint8_t>();
+		entry.bodyLength = reader.get<uint32_t>();
+		if (entry.offset + entry.headerLength + entry.bodyLength > index.length) {
+			throw swf_index_exception("Invalid SWF index file. Tag out of bounds.");
+		}
+		index.tags.push_back(entry);
+	}
+
+	if (!reader.atEnd()) {
+		throw swf_index_exception("Invalid SWF index file. Unexpected data at the end.");
+	}
+	return index;
+}
+
+SWFIndex SWFIndex::open(const string &path, const SharedBytes &cws, uint64_t span) {
+	try {
+		return load(path, cws);
+	} catch (const swf_index_exception &) {
+	} catch (const mapped_file_exception &) {
+	}
+	SWFIndex index = build(cws, span);
+	index.save(path);
+	return index;
+}
+
+void SWFIndex::save(const string &path) const {
+	vector<uint8_t> out(magic.begin(), magic.end());
+	out.push_back(formatVersion);
+	out.insert(out.end(), this->header.begin(), this->header.end());
+	out.insert(out.end(), this->adler.begin(), this->adler.end());
+	put<uint64_t>(out, this->compressedSize);
+	put<uint64_t>(out, this->length);
+	put<uint64_t>(out, this->span);
+
+	put<uint64_t>(out, this->points.size());
+	for (const auto &point : this->points) {
+		put<uint64_t>(out, point.out);
+		put<uint64_t>(out, point.in);
+		out.push_back(static_cast<uint8_t>(point.bits));
+		put<uint16_t>(out, static_cast<uint16_t>(point.window.size()));
+		out.insert(out.end(), point.window.begin(), point.window.end());
+	}
+
+	put<uint64_t>(out, this->tags.size());
+	for (const auto &entry : this->tags) {
+		put<uint16_t>(out, static_cast<uint16_t>(entry.type));
+		put<uint32_t>(out, entry.id < 0 ? noId : static_cast<uint32_t>(entry.id));
+		put<uint64_t>(out, entry.offset);
+		out.push_back(static_cast<uint8_t>(entry.headerLength));
+		put<uint32_t>(out, entry.bodyLength);
+	}
+
+	writeFile(path, { SharedBytes(move(out)) });
+}
+
+const SWFIndex::TagEntry *SWFIndex::findById(int64_t id) const {
+	auto it = find_if(this->tags.begin(), this->tags.end(), [&](const TagEntry &entry) {
+		return entry.id == id && tagInfo(entry.type).definition;
+	});
+	return (it == this->tags.end()) ? nullptr : &*it;
+}
+
+vector<uint8_t> SWFIndex::readTag(const SharedBytes &cws, const TagEntry &tag) const {
+	return this->read(cws, tag.offset + tag.headerLength, tag.bodyLength);
+}
+
+vector<uint8_t> SWFIndex::read(const SharedBytes &cws, uint64_t offset, size_t size) const {
+	if (offset > this->length || size > this->length - offset) {
+		throw swf_index_exception("Range out of bounds of the SWF.");
+	}
+	this->check(cws);
+
+	vector<uint8_t> out(size);
+	size_t headerPart = 0;
+	if (offset < 8) {
+		headerPart = static_cast<size_t>(min<uint64_t>(8 - offset, size));
+		copy(this->header.begin() + static_cast<ptrdiff_t>(offset),
+		     this->header.begin() + static_cast<ptrdiff_t>(offset + headerPart), out.begin());
+		if (offset == 0 && headerPart > 0) {
+			out[0] = 'F'; // as SWF::toBytes
+		}
+	}
+	if (size > headerPart) {
+		try {
+			zlib::zlib_extract(cws.data() + 8, cws.size() - 8, this->points, offset + headerPart - 8,
+			                   out.data() + headerPart, size - headerPart);
+		} catch (const zlib::zlib_exception &ze) {
+			throw swf_index_exception(ze.what());
+		}
+	}
+	return out;
+}
+
+void SWFIndex::check(const SharedBytes &cws) const {
+	if (cws.size() != this->compressedSize || cws.size() < 12 || !equal(this->header.begin(), this->header.end(), cws.begin())
+	    || !equal(this->adler.begin(), this->adler.end(), cws.end() - 4)) {
+		throw swf_index_exception("The SWF index was not built for this file.");
+	}
+}
@@ -0,0 +1,93 @@
+/**
+ * libswf - Random access into zlib compressed SWF files
+ */
+
+#ifndef SWF_INDEX_HPP
+#define SWF_INDEX_HPP
+
+#include <array>     // array
+#include <string>
+#include <vector>    // vector
+#include <cstdint>   // uint8_t, uint32_t, uint64_t
+#include <exception> // exception
+#include "shared_bytes.hpp"
+#include "zlib_wrapper.hpp"
+
+namespace swf {
+
+	class swf_index_exception : public std::exception {
+		public:
+			explicit swf_index_exception(const std::string &message = "swf_index_exception")
+				: std::exception(), error_message(message) {}
+			const char *what() const noexcept
+			{
+				return error_message.c_str();
+			}
+		private:
+			std::string error_message;
+	};
+
+	/**
+	 * Tag directory and inflate checkpoints of a CWS file, so that any tag
+	 * can be read by inflating from the closest checkpoint before it instead
+	 * of from the start of the file. Building the index inflates the file
+	 * once; it can then be saved to a sidecar file and loaded back, e.g.
+	 * next to the SWF as "game.swf.idx".
+	 *
+	 * Offsets are positions in the uncompressed SWF (as written by
+	 * SWF::toBytes), the first tag is at the end of the header.
+	 */
+	class SWFIndex {
+	public:
+		struct TagEntry {
+			int type;
+			/// Character ID of a definition tag, -1 if there is none.
+			int64_t id;
+			uint64_t offset;
+			uint32_t headerLength;
+			uint32_t bodyLength;
+		};
+
+		/// Every 'span' bytes of uncompressed SWF there is a checkpoint, which takes up to 32 KB.
+		static constexpr uint64_t defaultSpan = 1 << 20;
+
+		/// Indexes the CWS file 'cws'. Throws swf_index_exception if it is not a CWS file.
+		static SWFIndex build(const SharedBytes &cws, uint64_t span = defaultSpan);
+		/// Loads the index saved at 'path', checking that it was built for 'cws'.
+		static SWFIndex load(const std::string &path, const SharedBytes &cws);
+		/// Loads the index at 'path' or, if it can't be used, builds it and saves it there.
+		static SWFIndex open(const std::string &path, const SharedBytes &cws, uint64_t span = defaultSpan);
+
+		void save(const std::string &path) const;
+
+		inline const std::vector<TagEntry> &getTags() const { return this->tags; }
+		inline size_t checkpointCount() const { return this->points.size(); }
+		/// Size of the uncompressed SWF.
+		inline uint64_t size() const { return this->length; }
+		/// Definition tag with character ID 'id', or nullptr.
+		const TagEntry *findById(int64_t id) const;
+
+		/// Tag body of 'tag', inflated from 'cws'.
+		std::vector<uint8_t> readTag(const SharedBytes &cws, const TagEntry &tag) const;
+		/// 'size' bytes at 'offset' of the uncompressed SWF, inflated from 'cws'.
+		std::vector<uint8_t> read(const SharedBytes &cws, uint64_t offset, size_t size) const;
+
+	private:
+		SWFIndex() : header(), adler(), compressedSize(0), length(0), span(0), points(), tags() {}
+		/// Throws if the index was not built for 'cws'.
+		void check(const SharedBytes &cws) const;
+
+		/// First 8 bytes of the file, with the signature and uncompressed size.
+		std::array<uint8_t, 8> header;
+		/// Adler-32 at the end of the zlib stream.
+		std::array<uint8_t, 4> adler;
+		uint64_t compressedSize;
+		uint64_t length;
+		uint64_t span;
+		std::vector<zlib::access_point> points;
+		std::vector<TagEntry> tags;
+	};
+
+} // swf
+
+#endif // SWF_INDEX_HPP
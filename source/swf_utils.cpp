@@ -3,16 +3,18 @@
  */
 
 #include <string>     // string
+#include <cstring>    // memchr, memcmp
+#include <algorithm>  // max
 #include "swf_utils.hpp"
 
 using namespace std;
 
-bool isPEfile (const vector<uint8_t> &exe) {
-	if (exe.size() < 0x3C + 4) return false;
+bool isPEfile (const uint8_t *exe, size_t size) {
+	if (size < 0x3C + 4) return false;
 	string exeSig = { static_cast<char>(exe[0]), static_cast<char>(exe[1]) };
 	if (exeSig == "MZ") { // Mark Zbikowski
-		uint32_t pointerPE = bytestodec_le<uint32_t>( exe.data() + 0x3C );
-		if (exe.size() < pointerPE + 4) return false;
+		uint32_t pointerPE = bytestodec_le<uint32_t>( exe + 0x3C );
+		if (size < static_cast<size_t>(pointerPE) + 4) return false;
 		exeSig = { static_cast<char>(exe[pointerPE]), static_cast<char>(exe[pointerPE+1]) };
 		if (exeSig == "PE") {
 			return true;
@@ -24,8 +26,8 @@ bool isPEfile (const vector<uint8_t> &exe) {
 	}
 }
 
-bool isELFfile (const vector<uint8_t> &exe) {
-	if (exe.size() < 4) return false;
+bool isELFfile (const uint8_t *exe, size_t size) {
+	if (size < 4) return false;
 	string exeSig = { static_cast<char>(exe[1]), static_cast<char>(exe[2]), static_cast<char>(exe[3]) };
 	if (exe[0] == 0x7F && exeSig == "ELF") {
 		return true;
@@ -34,6 +36,74 @@ bool isELFfile (const vector<uint8_t> &exe) {
 	}
 }
 
+size_t elfImageSize (const uint8_t *elf, size_t size) {
+	if (!isELFfile(elf, size) || size < 0x34) return 0;
+	bool is64 = (elf[4] == 2);
+	bool bigEndian = (elf[5] == 2);
+	if ((elf[4] != 1 && !is64) || (elf[5] != 1 && !bigEndian)) return 0;
+	if (is64 && size < 0x40) return 0;
+
+	// Reads an address/offset sized field, or a 2 or 4 byte field
+	auto field = [&](size_t pos, size_t width) -> uint64_t {
+		if (width == 8) return bigEndian ? bytestodec_be<uint64_t>(elf + pos) : bytestodec_le<uint64_t>(elf + pos);
+		if (width == 4) return bigEndian ? bytestodec_be<uint32_t>(elf + pos) : bytestodec_le<uint32_t>(elf + pos);
+		return bigEndian ? bytestodec_be<uint16_t>(elf + pos) : bytestodec_le<uint16_t>(elf + pos);
+	};
+	size_t word = is64 ? 8 : 4;
+
+	uint64_t phoff = field(is64 ? 0x20 : 0x1C, word);
+	uint64_t shoff = field(is64 ? 0x28 : 0x20, word);
+	uint64_t phentsize = field(is64 ? 0x36 : 0x2A, 2);
+	uint64_t phnum = field(is64 ? 0x38 : 0x2C, 2);
+	uint64_t shentsize = field(is64 ? 0x3A : 0x2E, 2);
+	uint64_t shnum = field(is64 ? 0x3C : 0x30, 2);
+
+	if ((phnum && phoff > size) || (shnum && shoff > size)) return 0;
+
+	uint64_t end = is64 ? 0x40 : 0x34;
+	uint64_t phEnd = phoff + phentsize * phnum;
+	uint64_t shEnd = shoff + shentsize * shnum;
+	if ((phnum && (phEnd > size || phentsize < (is64 ? 0x38u : 0x20u))) ||
+	    (shnum && (shEnd > size || shentsize < (is64 ? 0x40u : 0x28u)))) {
+		return 0;
+	}
+	if (phnum) end = max(end, phEnd);
+	if (shnum) end = max(end, shEnd);
+
+	// Segments
+	for (uint64_t n = 0; n < phnum; ++n) {
+		size_t ph = static_cast<size_t>(phoff + n * phentsize);
+		uint64_t offset = field(ph + (is64 ? 0x08 : 0x04), word);
+		uint64_t fileSize = field(ph + (is64 ? 0x20 : 0x10), word);
+		if (offset > size || fileSize > size - offset) return 0;
+		end = max(end, offset + fileSize);
+	}
+	// Sections, except SHT_NOBITS (e.g. .bss), which take no space in the file
+	for (uint64_t n = 0; n < shnum; ++n) {
+		size_t sh = static_cast<size_t>(shoff + n * shentsize);
+		if (field(sh + 0x04, 4) == 8) continue;
+		uint64_t offset = field(sh + (is64 ? 0x18 : 0x10), word);
+		uint64_t sectionSize = field(sh + (is64 ? 0x20 : 0x14), word);
+		if (offset > size || sectionSize > size - offset) return 0;
+		end = max(end, offset + sectionSize);
+	}
+
+	return static_cast<size_t>(end);
+}
+
+const uint8_t *findBytes(const uint8_t *begin, const uint8_t *end, const uint8_t *needle, size_t n) {
+	if (n == 0) return begin;
+	const uint8_t *it = begin;
+	while (static_cast<size_t>(end - it) >= n) {
+		const void *first = memchr(it, needle[0], static_cast<size_t>(end - it) - n + 1);
+		if (!first) break;
+		it = static_cast<const uint8_t *>(first);
+		if (memcmp(it + 1, needle + 1, n - 1) == 0) return it;
+		++it;
+	}
+	return end;
+}
+
 /**
  * Image files
  * https://en.wikipedia.org/wiki/Portable_Network_Graphics
@@ -55,8 +55,16 @@ inline int twipsToPx (int twips) { return twips/20; }
 /**
  * Executable files
  */
-bool isPEfile (const std::vector<uint8_t> &exe);
-bool isELFfile (const std::vector<uint8_t> &exe);
+bool isPEfile (const uint8_t *exe, std::size_t size);
+bool isELFfile (const uint8_t *exe, std::size_t size);
+inline bool isPEfile (const std::vector<uint8_t> &exe) { return isPEfile(exe.data(), exe.size()); }
+inline bool isELFfile (const std::vector<uint8_t> &exe) { return isELFfile(exe.data(), exe.size()); }
+/**
+ * Size of an ELF file according to its headers: the end of the furthest
+ * header table, segment or section. Anything after it was appended to the
+ * file. Only the headers are read. Returns 0 if they are not valid.
+ */
+std::size_t elfImageSize (const uint8_t *elf, std::size_t size);
 
 /**
  * Image files
@@ -109,7 +117,7 @@ template<class T>
 T bytestodec_le(const std::uint8_t* bytes) {
 	T d = 0;
 	for (std::size_t i = 0; i < sizeof(d); ++i) {
-		d = static_cast<T>(d|(bytes[i] << (i * 8)));
+		d = static_cast<T>(d|(static_cast<T>(bytes[i]) << (i * 8)));
 	}
 	return d;
 }
@@ -119,7 +127,7 @@ template<class T>
 T bytestodec_be(const std::uint8_t* bytes) {
 	T d = 0;
 	for (std::size_t i = 0; i < sizeof(d); ++i) {
-		d = static_cast<T>(d|(bytes[i] << ((sizeof(d)-i-1) * 8)));
+		d = static_cast<T>(d|(static_cast<T>(bytes[i]) << ((sizeof(d)-i-1) * 8)));
 	}
 	return d;
 }
@@ -139,6 +147,16 @@ std::array<uint8_t, sizeof(T)> dectobytes_le(T d) {
 	return bytes;
 }
 
+/// Writes 'd' in little-endian to 'out', returns the position after it.
+template<class T>
+uint8_t *dectobytes_le(T d, uint8_t *out) {
+	for (std::size_t i = 0; i < sizeof(d); ++i) {
+		out[i] = static_cast<uint8_t>(d);
+		d = static_cast<T>(d >> 8);
+	}
+	return out + sizeof(d);
+}
+
 template<class T>
 std::array<uint8_t, sizeof(T)> dectobytes_be(T d) {
 
@@ -154,6 +172,13 @@ std::array<uint8_t, sizeof(T)> dectobytes_be(T d) {
 	return bytes;
 }
 
+/**
+ * First occurrence of 'needle' (of length 'n') in [begin, end), or 'end' if
+ * there is none. Candidates are found with memchr, which the C libraries
+ * implement with SIMD, so that most of the haystack is skipped in bulk.
+ */
+const uint8_t *findBytes(const uint8_t *begin, const uint8_t *end, const uint8_t *needle, std::size_t n);
+
 /**
  * Inserts second vector at the end of the first.
  */
@@ -4,17 +4,28 @@
 
 #include <vector> // vector
 #include <cstdint> // uint8_t
+#include <stdexcept> // out_of_range
+#include <algorithm> // copy
 #include "tag.hpp"
 #include "swf_utils.hpp"
 
 using namespace std;
 using namespace swf;
 
+namespace {
+	void requireBody(const SharedBytes &body, size_t length) {
+		if (body.size() < length) {
+			throw out_of_range("Tag body is shorter than " + to_string(length) + " bytes.");
+		}
+	}
+}
+
 /**
  * Tag
  */
 
-size_t Tag::parseTagHeader(uint8_t *buffer, size_t &pos) {
+size_t Tag::parseTagHeader(const uint8_t *buffer, size_t &pos) {
+	this->offset = pos;
 	uint16_t tagCodeAndLength = bytestodec_le<uint16_t>(buffer + pos);
 	pos += 2;
 
@@ -28,6 +39,9 @@ size_t Tag::parseTagHeader(uint8_t *buffer, size_t &pos) {
 		this->longTag = true;
 	}
 
+	this->headerLength = pos - this->offset;
+	this->bodyLength = length;
+
 	return length;
 }
 
@@ -46,22 +60,35 @@ array<uint8_t, 2> Tag::makeTagHeader(size_t length) {
 	return dectobytes_le<uint16_t>(tagCodeAndLength);
 }
 
-vector<uint8_t> Tag::toBytes() {
-	vector<uint8_t> buffer;
-	auto header = this->makeTagHeader(this->data.size());
-	buffer.insert(buffer.end(), header.begin(), header.end());
+size_t Tag::serializedSize() const {
+	size_t length = this->bodySize();
+	bool isLong = this->longTag || length >= 63; // see makeTagHeader
+	return (isLong ? 6 : 2) + length;
+}
+
+uint8_t *Tag::writeTo(uint8_t *out) {
+	size_t length = this->bodySize();
+	auto header = this->makeTagHeader(length);
+	out = copy(header.begin(), header.end(), out);
 
 	if (this->longTag) {
 		// Long tag
-		array<uint8_t, 4> len = dectobytes_le<uint32_t>(static_cast<uint32_t>(this->data.size()));
-		buffer.insert(buffer.end(), len.begin(), len.end());
+		out = dectobytes_le<uint32_t>(static_cast<uint32_t>(length), out);
 	}
 
-	buffer.insert(buffer.end(), this->data.begin(), this->data.end());
+	return this->writeBody(out);
+}
 
+vector<uint8_t> Tag::toBytes() {
+	vector<uint8_t> buffer(this->serializedSize());
+	this->writeTo(buffer.data());
 	return buffer;
 }
 
+uint8_t *Tag::writeBody(uint8_t *out) {
+	return copy(this->data.begin(), this->data.end(), out);
+}
+
 /**
  * Tag_DefineSound
  */
@@ -83,36 +110,38 @@ map<int, string> Tag_DefineSound::soundRatesNames = {
 };
 
 
-vector<uint8_t> Tag_DefineSound::toBytes() {
-	vector<uint8_t> buffer;
-	auto length = this->data.size() + 2 + 1 + 4; // sound id + sound info + sample count
-	auto header = this->makeTagHeader(length);
-	buffer.insert(buffer.end(), header.begin(), header.end());
+void Tag_DefineSound::parseBody() {
+	requireBody(this->data, 7);
+	const uint8_t *body = this->data.data();
+	this->id = bytestodec_le<uint16_t>(body);
+	bitset<8> soundInfo{};
+	bytesToBitset(soundInfo, array<uint8_t, 1>{body[2]});
+	subBitset(soundInfo, this->soundFormat, 0);
+	subBitset(soundInfo, this->soundRate, 4);
+	subBitset(soundInfo, this->soundSize, 4 + 2);
+	subBitset(soundInfo, this->soundType, 4 + 2 + 1);
+	this->soundSampleCount = bytestodec_le<uint32_t>(body + 3);
+	this->data = this->data.sub(7, this->data.size() - 7);
+	this->decoded = true;
+}
 
-	if (this->longTag) {
-		// Long tag
-		array<uint8_t, 4> len = dectobytes_le<uint32_t>(static_cast<uint32_t>(length));
-		buffer.insert(buffer.end(), len.begin(), len.end());
-	}
+size_t Tag_DefineSound::bodySize() const {
+	return 2 + 1 + 4 + this->data.size(); // sound id + sound info + sample count
+}
 
-	array<uint8_t, 2> sid = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->id));
-	buffer.insert(buffer.end(), sid.begin(), sid.end());
+uint8_t *Tag_DefineSound::writeBody(uint8_t *out) {
+	out = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->id), out);
 
-	auto soundInfo = static_cast<std::uint8_t>(
+	*out++ = static_cast<std::uint8_t>(
 	    (this->soundFormat.to_ulong() << 4)|
 	    (this->soundRate.to_ulong() << 2)|
 	    (this->soundSize.to_ulong() << 1)|
 	    (this->soundType.to_ulong() << 0)
 	);
 
-	buffer.emplace_back(soundInfo);
+	out = dectobytes_le<uint32_t>(this->soundSampleCount, out);
 
-	array<uint8_t, 4> sc = dectobytes_le<uint32_t>(this->soundSampleCount);
-	buffer.insert(buffer.end(), sc.begin(), sc.end());
-
-	buffer.insert(buffer.end(), this->data.begin(), this->data.end());
-
-	return buffer;
+	return copy(this->data.begin(), this->data.end(), out);
 }
 
 
@@ -121,32 +150,48 @@ vector<uint8_t> Tag_DefineSound::toBytes() {
  * Tag_SymbolClass
  */
 
-vector<uint8_t> Tag_SymbolClass::toBytes() {
-
-	vector<uint8_t> content;
-
-	array<uint8_t, 2> numSym = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->symbolClass.size()));
-	content.insert(content.end(), numSym.begin(), numSym.end());
+void Tag_SymbolClass::parseBody() {
+	requireBody(this->data, 2);
+	const uint8_t *body = this->data.data();
+	const size_t size = this->data.size();
+	size_t cur = 0;
+	this->numSymbols = bytestodec_le<uint16_t>(body + cur);
+	cur += 2;
+	this->symbolClass.reserve(this->numSymbols);
+	for (int n = 0; n < this->numSymbols; ++n) {
+		requireBody(this->data, cur + 2);
+		uint16_t tid = bytestodec_le<uint16_t>(body + cur);
+		cur += 2;
+		size_t nameStart = cur;
+		while (cur < size && body[cur] != 0) {
+			++cur;
+		}
+		requireBody(this->data, cur + 1); // null terminator
+		this->symbolClass.emplace_back(tid, string(reinterpret_cast<const char *>(body) + nameStart, cur - nameStart));
+		++cur;
+	}
+	this->data = SharedBytes();
+	this->decoded = true;
+}
 
-	for (auto p : this->symbolClass) {
-		array<uint8_t, 2> tid = dectobytes_le<uint16_t>( static_cast<uint16_t>(p.first) );
-		content.insert(content.end(), tid.begin(), tid.end());
-		content.insert(content.end(), p.second.begin(), p.second.end());
-		content.emplace_back(0);
+size_t Tag_SymbolClass::bodySize() const {
+	size_t length = 2; // number of symbols
+	for (const auto &p : this->symbolClass) {
+		length += 2 + p.second.size() + 1; // tag id + null terminated name
 	}
+	return length;
+}
 
-	vector<uint8_t> buffer;
-	auto header = this->makeTagHeader(content.size());
-	buffer.insert(buffer.end(), header.begin(), header.end());
+uint8_t *Tag_SymbolClass::writeBody(uint8_t *out) {
+	out = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->symbolClass.size()), out);
 
-	if (this->longTag) {
-		array<uint8_t, 4> len = dectobytes_le<uint32_t>(static_cast<uint32_t>(content.size()));
-		buffer.insert(buffer.end(), len.begin(), len.end());
+	for (const auto &p : this->symbolClass) {
+		out = dectobytes_le<uint16_t>(static_cast<uint16_t>(p.first), out);
+		out = copy(p.second.begin(), p.second.end(), out);
+		*out++ = 0;
 	}
 
-	buffer.insert(buffer.end(), content.begin(), content.end());
-
-	return buffer;
+	return out;
 }
 
 
@@ -155,37 +200,43 @@ vector<uint8_t> Tag_SymbolClass::toBytes() {
  * Tag_DefineBitsLossless
  */
 
-vector<uint8_t> Tag_DefineBitsLossless::toBytes() {
-	vector<uint8_t> buffer;
-	// character id (2) + bitmapFormat (1) + bitmapWidth (2) + bitmapHeight (2) + bitmapColorTableSize (1)
-	auto length = this->data.size() + 2 + 1 + 2 + 2 + (this->bitmapFormat == 3 ? 1 : 0);
-	auto header = this->makeTagHeader(length);
-	buffer.insert(buffer.end(), header.begin(), header.end());
-
-	if (this->longTag) {
-		// Long tag
-		array<uint8_t, 4> len = dectobytes_le<uint32_t>(static_cast<uint32_t>(length));
-		buffer.insert(buffer.end(), len.begin(), len.end());
+void Tag_DefineBitsLossless::parseBody() {
+	requireBody(this->data, 7);
+	const uint8_t *body = this->data.data();
+	size_t cur = 0;
+	this->id = bytestodec_le<uint16_t>(body + cur);
+	cur += 2;
+	this->bitmapFormat = bytestodec_le<uint8_t>(body + cur);
+	++cur;
+	this->bitmapWidth = bytestodec_le<uint16_t>(body + cur);
+	cur += 2;
+	this->bitmapHeight = bytestodec_le<uint16_t>(body + cur);
+	cur += 2;
+	if (this->bitmapFormat == 3) {
+		requireBody(this->data, 8);
+		this->bitmapColorTableSize = bytestodec_le<uint8_t>(body + cur);
+		++cur;
 	}
+	this->data = this->data.sub(cur, this->data.size() - cur);
+	this->decoded = true;
+}
 
-	array<uint8_t, 2> cid = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->id));
-	buffer.insert(buffer.end(), cid.begin(), cid.end());
-
-	buffer.emplace_back(this->bitmapFormat);
-
-	array<uint8_t, 2> bw = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->bitmapWidth));
-	buffer.insert(buffer.end(), bw.begin(), bw.end());
+size_t Tag_DefineBitsLossless::bodySize() const {
+	// character id (2) + bitmapFormat (1) + bitmapWidth (2) + bitmapHeight (2) + bitmapColorTableSize (1)
+	return 2 + 1 + 2 + 2 + (this->bitmapFormat == 3 ? 1 : 0) + this->data.size();
+}
 
-	array<uint8_t, 2> bh = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->bitmapHeight));
-	buffer.insert(buffer.end(), bh.begin(), bh.end());
+uint8_t *Tag_DefineBitsLossless::writeBody(uint8_t *out) {
+	out = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->id), out);
+	*out++ = this->bitmapFormat;
+	out = dectobytes_le<uint16_t>(this->bitmapWidth, out);
+	out = dectobytes_le<uint16_t>(this->bitmapHeight, out);
 
 	if (this->bitmapFormat == 3) {
-		buffer.emplace_back(this->bitmapColorTableSize);
+		*out++ = this->bitmapColorTableSize;
 	}
 
-	buffer.insert(buffer.end(), this->data.begin(), this->data.end());
-
-	return buffer;
+	return copy(this->data.begin(), this->data.end(), out);
 }
 
 
@@ -193,26 +244,20 @@ vector<uint8_t> Tag_DefineBitsLossless::toBytes() {
  * Tag_DefineBinaryData
  */
 
-vector<uint8_t> Tag_DefineBinaryData::toBytes() {
-	vector<uint8_t> buffer;
-	auto length = this->data.size() + 2 + 4;
-	auto header = this->makeTagHeader(length);
-	buffer.insert(buffer.end(), header.begin(), header.end());
-
-	if (this->longTag) {
-		// Long tag
-		// character id (2) + reserved (4)
-		array<uint8_t, 4> len = dectobytes_le<uint32_t>(static_cast<uint32_t>(length));
-		buffer.insert(buffer.end(), len.begin(), len.end());
-	}
-
-	array<uint8_t, 2> cid = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->id));
-	buffer.insert(buffer.end(), cid.begin(), cid.end());
-
-	array<uint8_t, 4> res = dectobytes_le<uint32_t>(this->reserved);
-	buffer.insert(buffer.end(), res.begin(), res.end());
+void Tag_DefineBinaryData::parseBody() {
+	requireBody(this->data, 6);
+	this->id = bytestodec_le<uint16_t>(this->data.data());
+	this->reserved = bytestodec_le<uint32_t>(this->data.data() + 2);
+	this->data = this->data.sub(6, this->data.size() - 6);
+	this->decoded = true;
+}
 
-	buffer.insert(buffer.end(), this->data.begin(), this->data.end());
+size_t Tag_DefineBinaryData::bodySize() const {
+	return 2 + 4 + this->data.size(); // character id (2) + reserved (4)
+}
 
-	return buffer;
+uint8_t *Tag_DefineBinaryData::writeBody(uint8_t *out) {
+	out = dectobytes_le<uint16_t>(static_cast<uint16_t>(this->id), out);
+	out = dectobytes_le<uint32_t>(this->reserved, out);
+	return copy(this->data.begin(), this->data.end(), out);
 }
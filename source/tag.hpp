@@ -10,21 +10,58 @@
 #include <cstdint> // uint8_t
 #include <bitset> // bitset
 #include <map> // map
+#include "shared_bytes.hpp"
 
 namespace swf {
 
 	class Tag {
 	public:
-		Tag() : i(0), id(0), type(), longTag(false), data(), symbolName() {}
+		Tag() : i(0), id(0), type(), longTag(false), offset(0), headerLength(0), bodyLength(0),
+			decoded(true), modified(false), data(), symbolName() {}
 		virtual ~Tag() {};
 		size_t i;
 		size_t id;
 		short type;
 		bool longTag;
-		size_t parseTagHeader(uint8_t *buffer, size_t &pos);
+
+		/// Position of the tag header in the SWF buffer, and the lengths of the
+		/// header and body as they were parsed (0 if the tag was not parsed).
+		size_t offset;
+		size_t headerLength;
+		size_t bodyLength;
+
+		/// False while the fields of the subclass this tag's type maps to have not
+		/// been decoded yet, in which case 'data' holds the whole tag body.
+		bool decoded;
+
+		/// Set by the SWF::replace* functions, and by the SWF functions that
+		/// return a tag which can be changed through the pointer (getTagWithId,
+		/// getTagsOfType, findBySymbolName), as an unmodified SWF is exported
+		/// as the bytes it was loaded from.
+		bool modified;
+
+		size_t parseTagHeader(const uint8_t *buffer, size_t &pos);
 		std::array<uint8_t, 2> makeTagHeader(size_t length);
-		std::vector<uint8_t> data;
-		virtual std::vector<uint8_t> toBytes();
+		/// Tag body (without the fields decoded by the subclasses). Points into
+		/// the SWF buffer until new data is assigned to it.
+		SharedBytes data;
+
+		/// Size of the serialized tag, header included.
+		size_t serializedSize() const;
+		/// Writes the serialized tag to 'out', which must have room for
+		/// serializedSize() bytes. Returns the position after the tag.
+		uint8_t *writeTo(uint8_t *out);
+		std::vector<uint8_t> toBytes();
+
+		/// Size of the serialized body, i.e. the decoded fields and 'data'.
+		virtual size_t bodySize() const { return this->data.size(); }
+		/// Writes the serialized body to 'out', returns the position after it.
+		virtual uint8_t *writeBody(uint8_t *out);
+
+		/// Decodes the fields of the subclass from the whole tag body, which is
+		/// expected in 'data', leaving in 'data' only the remaining bytes.
+		/// Throws std::out_of_range if the body is too short.
+		virtual void parseBody() { this->decoded = true; }
 
 		/// The symbol name is not saved directly in the tag, it is saved
 		/// in the SymbolClass tag, which contains a dictionary of symbols.
@@ -40,7 +77,9 @@ namespace swf {
 		virtual ~Tag_DefineBinaryData() {};
 		// tagId - 2 bytes
 		uint32_t reserved; // must be 0
-		std::vector<uint8_t> toBytes() override;
+		size_t bodySize() const override;
+		uint8_t *writeBody(uint8_t *out) override;
+		void parseBody() override;
 	};
 
 	class Tag_DefineSound : public Tag {
@@ -59,7 +98,9 @@ namespace swf {
 		static std::map<int, int> soundRates;
 		inline static std::string formatName(int f) { return (codingFormats.find(f) == codingFormats.end()) ? "Unknown" : codingFormats[f]; }
 		inline static std::string soundRateName(int f) { return (soundRatesNames.find(f) == soundRatesNames.end()) ? "Unknown" : soundRatesNames[f]; }
-		std::vector<uint8_t> toBytes() override;
+		size_t bodySize() const override;
+		uint8_t *writeBody(uint8_t *out) override;
+		void parseBody() override;
 	};
 
 	/**
@@ -75,7 +116,9 @@ namespace swf {
 		uint16_t bitmapWidth;
 		uint16_t bitmapHeight;
 		uint8_t bitmapColorTableSize; //if bitmapFormat = 3, otherwise absent
-		std::vector<uint8_t> toBytes() override;
+		size_t bodySize() const override;
+		uint8_t *writeBody(uint8_t *out) override;
+		void parseBody() override;
 	};
 
 	class Tag_SymbolClass : public Tag {
@@ -84,7 +127,9 @@ namespace swf {
 		virtual ~Tag_SymbolClass() {};
 		uint16_t numSymbols;
 		std::vector< std::pair<size_t, std::string> > symbolClass;
-		std::vector<uint8_t> toBytes() override;
+		size_t bodySize() const override;
+		uint8_t *writeBody(uint8_t *out) override;
+		void parseBody() override;
 	};
 
 }
@@ -0,0 +1,175 @@
+/**
+ * libswf - Tag type metadata
+ */
+
+#ifndef TAG_INFO_HPP
+#define TAG_INFO_HPP
+
+#include <array>       // array
+#include <cstddef>     // size_t
+#include <cstdint>     // int8_t, uint8_t
+#include <string_view> // string_view
+
+namespace swf {
+
+	/// Tag subclass a tag type is decoded into.
+	enum class TagDecoder : uint8_t {
+		none,
+		binaryData,   // Tag_DefineBinaryData
+		sound,        // Tag_DefineSound
+		bitsLossless, // Tag_DefineBitsLossless
+		bitsLossless2,// Tag_DefineBitsLossless (version2)
+		symbolClass   // Tag_SymbolClass
+	};
+
+	struct TagInfo {
+		const char *name;
+		/// Defines a character, which other tags refer to by its ID.
+		bool definition;
+		/// Position of the character ID in the tag body, -1 if there is none.
+		int8_t idOffset;
+		TagDecoder decoder;
+	};
+
+	namespace tag_info {
+
+		constexpr TagInfo control(const char *name) {
+			return {name, false, -1, TagDecoder::none};
+		}
+		constexpr TagInfo control(const char *name, TagDecoder decoder) {
+			return {name, false, -1, decoder};
+		}
+		constexpr TagInfo definition(const char *name, TagDecoder decoder = TagDecoder::none) {
+			return {name, true, 0, decoder};
+		}
+
+		inline constexpr TagInfo unknown = control("Unknown");
+		inline constexpr TagInfo fileHeader = control("File Header");
+
+		/// Indexed by tag code. Codes with no known tag are "Unknown".
+		inline constexpr std::array<TagInfo, 95> table = {{
+			control("End"),                                       // 0
+			control("ShowFrame"),                                 // 1
+			definition("DefineShape"),                            // 2
+			control("FreeCharacter"),                             // 3
+			control("PlaceObject"),                               // 4
+			control("RemoveObject"),                              // 5
+			definition("DefineBitsJPEG"),                         // 6
+			definition("DefineButton"),                           // 7
+			control("JPEGTables"),                                // 8
+			control("SetBackgroundColor"),                        // 9
+			definition("DefineFont"),                             // 10
+			definition("DefineText"),                             // 11
+			control("DoAction"),                                  // 12
+			control("DefineFontInfo"),                            // 13
+			definition("DefineSound", TagDecoder::sound),         // 14
+			control("StartSound"),                                // 15
+			control("StopSound"),                                 // 16
+			control("DefineButtonSound"),                         // 17
+			control("SoundStreamHead"),                           // 18
+			control("SoundStreamBlock"),                          // 19
+			definition("DefineBitsLossless", TagDecoder::bitsLossless), // 20
+			definition("DefineBitsJPEG2"),                        // 21
+			definition("DefineShape2"),                           // 22
+			control("DefineButtonCxform"),                        // 23
+			control("Protect"),                                   // 24
+			control("PathsArePostscript"),                        // 25
+			control("PlaceObject2"),                              // 26
+			unknown,                                              // 27
+			control("RemoveObject2"),                             // 28
+			control("SyncFrame"),                                 // 29
+			unknown,                                              // 30
+			control("FreeAll"),                                   // 31
+			definition("DefineShape3"),                           // 32
+			definition("DefineText2"),                            // 33
+			definition("DefineButton2"),                          // 34
+			definition("DefineBitsJPEG3"),                        // 35
+			definition("DefineBitsLossless2", TagDecoder::bitsLossless2), // 36
+			definition("DefineEditText"),                         // 37
+			control("DefineVideo"),                               // 38
+			definition("DefineSprite"),                           // 39
+			control("NameCharacter"),                             // 40
+			control("ProductInfo"),                               // 41
+			control("DefineTextFormat"),                          // 42
+			control("FrameLabel"),                                // 43
+			unknown,                                              // 44
+			control("SoundStreamHead2"),                          // 45
+			definition("DefineMorphShape"),                       // 46
+			control("GenerateFrame"),                             // 47
+			definition("DefineFont2"),                            // 48
+			control("GeneratorCommand"),                          // 49
+			control("DefineCommandObject"),                       // 50
+			control("CharacterSet"),                              // 51
+			control("ExternalFont"),                              // 52
+			unknown,                                              // 53
+			unknown,                                              // 54
+			unknown,                                              // 55
+			control("Export"),                                    // 56
+			control("Import"),                                    // 57
+			control("EnableDebugger"),                            // 58
+			control("DoInitAction"),                              // 59
+			definition("DefineVideoStream"),                      // 60
+			control("VideoFrame"),                                // 61
+			control("DefineFontInfo2"),                           // 62
+			control("DebugID"),                                   // 63
+			control("EnableDebugger2"),                           // 64
+			control("ScriptLimits"),                              // 65
+			control("SetTabIndex"),                               // 66
+			unknown,                                              // 67
+			unknown,                                              // 68
+			control("FileAttributes"),                            // 69
+			control("PlaceObject3"),                              // 70
+			control("Import2"),                                   // 71
+			control("DoABCDefine"),                               // 72
+			control("DefineFontAlignZones"),                      // 73
+			control("CSMTextSettings"),                           // 74
+			definition("DefineFont3"),                            // 75
+			control("SymbolClass", TagDecoder::symbolClass),      // 76
+			control("Metadata"),                                  // 77
+			control("DefineScalingGrid"),                         // 78
+			unknown,                                              // 79
+			unknown,                                              // 80
+			unknown,                                              // 81
+			control("DoABC"),                                     // 82
+			definition("DefineShape4"),                           // 83
+			definition("DefineMorphShape2"),                      // 84
+			unknown,                                              // 85
+			control("DefineSceneAndFrameData"),                   // 86
+			definition("DefineBinaryData", TagDecoder::binaryData), // 87
+			control("DefineFontName"),                            // 88
+			control("StartSound2"),                               // 89
+			definition("DefineBitsJPEG4"),                        // 90
+			definition("DefineFont4"),                            // 91
+			unknown,                                              // 92
+			control("EnableTelemetry"),                           // 93
+			control("PlaceObject4")                               // 94
+		}};
+
+	} // tag_info
+
+	/// Metadata of the tag with code 'type' (-1 is the file header).
+	constexpr const TagInfo &tagInfo(int type) {
+		if (type >= 0 && static_cast<size_t>(type) < tag_info::table.size()) {
+			return tag_info::table[static_cast<size_t>(type)];
+		}
+		return (type == -1) ? tag_info::fileHeader : tag_info::unknown;
+	}
+
+	/// Code of the tag called 'name', or -2 if there is none.
+	constexpr int tagType(std::string_view name) {
+		if (name == tag_info::fileHeader.name) {
+			return -1;
+		} else if (name == tag_info::unknown.name) {
+			return -2;
+		}
+		for (size_t n = 0; n < tag_info::table.size(); ++n) {
+			if (name == tag_info::table[n].name) {
+				return static_cast<int>(n);
+			}
+		}
+		return -2;
+	}
+
+} // swf
+
+#endif // TAG_INFO_HPP
@@ -0,0 +1,608 @@
+/**
+ * libswf - Parallel zlib decompression
+ *
+ * The deflate stream is cut in chunks of compressed bytes. Each thread looks
+ * for the first block that starts in its chunk, by trying the bit offsets in
+ * it until one decodes as a block header and the blocks after it decode
+ * without errors, and inflates from there. As the 32 KB before the chunk are
+ * not known yet, back-references into them produce markers with their
+ * position in that window (as rapidgzip and pugz do). Once the thread has
+ * output 32 KB without markers, nothing after can refer to the unknown
+ * window, so it goes on with plain bytes.
+ *
+ * The chunks are then joined in order, the markers being replaced with the
+ * bytes before the chunk. A chunk is used only if it starts where the one
+ * before it ended, otherwise it is inflated again from there with the real
+ * window. The result is checked against the stream's adler32, and anything
+ * unexpected makes it inflate the whole stream with zlib instead.
+ */
+
+#include "zlib_wrapper.hpp"
+
+#include <algorithm> // min, max, fill, copy, none_of
+#include <array>     // array
+#include <atomic>    // atomic
+#include <limits>    // numeric_limits
+#include <mutex>     // mutex, lock_guard
+#include <thread>    // thread
+#include <zlib.h>    // adler32
+
+using namespace std;
+
+namespace zlib {
+
+	namespace {
+
+		const size_t WINDOW_SIZE = 32 * 1024;
+		/// First marker: markers are WINDOW_MARKER + position in the unknown window.
+		const uint16_t WINDOW_MARKER = 256;
+
+		/// The data does not decode as deflate from there.
+		struct bad_data {};
+
+		/// Bits of a deflate stream, least significant first.
+		class bit_reader {
+			public:
+				bit_reader(const uint8_t *data_, const size_t size_) : data(data_), size(size_), pos(0), bits(0), count(0) {}
+
+				void seek(const uint64_t bit) {
+					pos = static_cast<size_t>(bit / 8);
+					bits = 0;
+					count = 0;
+					refill();
+					drop(static_cast<unsigned>(bit % 8));
+				}
+				/// Loads whole bytes until there are at least 56 bits. Past the
+				/// end of the data, a few bytes of zeros are allowed.
+				inline void refill() {
+					if (pos > size + 8) {
+						throw bad_data();
+					}
+					while (count <= 56) {
+						uint64_t byte = pos < size ? data[pos] : 0;
+						bits |= byte << count;
+						++pos;
+						count += 8;
+					}
+				}
+				inline uint32_t peek(const unsigned n) const { return static_cast<uint32_t>(bits & ((uint64_t(1) << n) - 1)); }
+				inline void drop(const unsigned n) { bits >>= n; count -= n; }
+				/// Like get, when 'n' bits are known to be available.
+				inline uint32_t take(const unsigned n) {
+					uint32_t value = peek(n);
+					drop(n);
+					return value;
+				}
+				inline uint32_t get(const unsigned n) {
+					if (count < n) {
+						refill();
+					}
+					uint32_t value = peek(n);
+					drop(n);
+					return value;
+				}
+				inline unsigned available() const { return count; }
+				/// Position of the next bit.
+				inline uint64_t tell() const { return uint64_t(pos) * 8 - count; }
+				inline bool past_end() const { return tell() > uint64_t(size) * 8; }
+
+				const uint8_t *data;
+				size_t size;
+
+			private:
+				size_t pos; // next byte to load
+				uint64_t bits;
+				unsigned count;
+		};
+
+		/// Canonical Huffman code, decoded with one lookup of as many bits as the longest code.
+		class huffman {
+			public:
+				huffman() : table(), bits(0) {}
+
+				/// False if the lengths are not a valid code, as in zlib's inflate_table.
+				bool build(const uint8_t *lengths, const size_t n, const bool code_lengths) {
+					array<uint16_t, 16> counts{};
+					for (size_t s = 0; s < n; ++s) {
+						++counts[lengths[s]];
+					}
+					unsigned max = 15;
+					while (max > 0 && counts[max] == 0) {
+						--max;
+					}
+					int left = 1;
+					for (unsigned len = 1; len <= 15; ++len) {
+						left <<= 1;
+						left -= counts[len];
+						if (left < 0) {
+							return false; // over-subscribed
+						}
+					}
+					if (max == 0 && !code_lengths) {
+						// No codes, which is fine as long as none is read.
+						this->bits = 1;
+						this->table.assign(2, 0);
+						return true;
+					}
+					if (left > 0 && (code_lengths || max != 1)) {
+						return false; // incomplete, only allowed for a single code of one bit
+					}
+
+					this->bits = max > 0 ? max : 1;
+					this->table.assign(size_t(1) << this->bits, 0);
+					array<uint32_t, 16> next{};
+					uint32_t code = 0;
+					counts[0] = 0;
+					for (unsigned len = 1; len <= 15; ++len) {
+						code = (code + counts[len - 1]) << 1;
+						next[len] = code;
+					}
+					for (size_t s = 0; s < n; ++s) {
+						unsigned len = lengths[s];
+						if (len == 0) {
+							continue;
+						}
+						uint32_t reversed = 0;
+						for (uint32_t c = next[len]++, b = 0; b < len; ++b, c >>= 1) {
+							reversed = (reversed << 1) | (c & 1);
+						}
+						uint16_t entry = static_cast<uint16_t>((s << 4) | len);
+						for (size_t i = reversed; i < this->table.size(); i += size_t(1) << len) {
+							this->table[i] = entry;
+						}
+					}
+					return true;
+				}
+
+				/// Needs at least 15 bits available in 'in'.
+				inline unsigned decode(bit_reader &in) const {
+					uint16_t entry = this->table[in.peek(this->bits)];
+					unsigned len = entry & 15u;
+					if (len == 0) {
+						throw bad_data(); // unused code of an incomplete set
+					}
+					in.drop(len);
+					return entry >> 4;
+				}
+
+			private:
+				vector<uint16_t> table;
+				unsigned bits;
+		};
+
+		const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		                                  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+		const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		                                  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+		const uint16_t DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		                                    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+		                                    8193, 12289, 16385, 24577};
+		const uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		                                    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+		const uint8_t CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+		/// Header of a block whose data starts at the reader's position.
+		struct block_header {
+			bool last = false;
+			int type = 0;
+			size_t stored_size = 0;
+			const huffman *literals = nullptr;
+			const huffman *distances = nullptr;
+		};
+
+		class block_decoder {
+			public:
+				block_decoder() : codes(), literals(), distances(), fixed_literals(), fixed_distances() {
+					array<uint8_t, 288 + 32> lengths{};
+					fill(lengths.begin(), lengths.begin() + 144, uint8_t(8));
+					fill(lengths.begin() + 144, lengths.begin() + 256, uint8_t(9));
+					fill(lengths.begin() + 256, lengths.begin() + 280, uint8_t(7));
+					fill(lengths.begin() + 280, lengths.begin() + 288, uint8_t(8));
+					fill(lengths.begin() + 288, lengths.end(), uint8_t(5));
+					fixed_literals.build(lengths.data(), 288, false);
+					fixed_distances.build(lengths.data() + 288, 32, false);
+				}
+				/// Out of line: the five tables make the implicit one too large to inline.
+				~block_decoder();
+
+				/**
+				 * Reads a block header. When looking for a block at an unknown
+				 * offset ('guess'), fixed Huffman blocks, whose headers are only
+				 * three bits, are not taken as a start.
+				 */
+				bool read_header(bit_reader &in, block_header &header, const bool guess) {
+					in.refill();
+					header.last = in.get(1) != 0;
+					header.type = static_cast<int>(in.get(2));
+					if (header.type == 0) {
+						in.drop(in.available() % 8);
+						uint32_t len = in.get(16), nlen = in.get(16);
+						if (len != (~nlen & 0xFFFF)) {
+							return false;
+						}
+						header.stored_size = len;
+						return true;
+					} else if (header.type == 1) {
+						header.literals = &fixed_literals;
+						header.distances = &fixed_distances;
+						return !guess;
+					} else if (header.type == 3) {
+						return false;
+					}
+
+					unsigned nlit = in.get(5) + 257, ndist = in.get(5) + 1, ncode = in.get(4) + 4;
+					if (nlit > 286 || ndist > 30) {
+						return false;
+					}
+					array<uint8_t, 19> code_lengths{};
+					for (unsigned n = 0; n < ncode; ++n) {
+						code_lengths[CODE_LENGTH_ORDER[n]] = static_cast<uint8_t>(in.get(3));
+					}
+					if (!codes.build(code_lengths.data(), code_lengths.size(), true)) {
+						return false;
+					}
+					array<uint8_t, 286 + 30> lengths{};
+					for (unsigned n = 0; n < nlit + ndist;) {
+						in.refill();
+						unsigned symbol = codes.decode(in);
+						if (symbol < 16) {
+							lengths[n++] = static_cast<uint8_t>(symbol);
+							continue;
+						}
+						uint8_t value = 0;
+						unsigned repeat;
+						if (symbol == 16) {
+							if (n == 0) {
+								return false;
+							}
+							value = lengths[n - 1];
+							repeat = 3 + in.get(2);
+						} else if (symbol == 17) {
+							repeat = 3 + in.get(3);
+						} else {
+							repeat = 11 + in.get(7);
+						}
+						if (n + repeat > nlit + ndist) {
+							return false;
+						}
+						fill(lengths.begin() + n, lengths.begin() + n + repeat, value);
+						n += repeat;
+					}
+					if (lengths[256] == 0 || !literals.build(lengths.data(), nlit, false)
+					    || !distances.build(lengths.data() + nlit, ndist, false)) {
+						return false;
+					}
+					header.literals = &literals;
+					header.distances = &distances;
+					return true;
+				}
+
+				/**
+				 * Decodes the data of the block into out[pos...], growing 'out'
+				 * as needed, and returns the end of the output. References
+				 * can't go before the start of 'out'.
+				 */
+				template<class T>
+				size_t decode(bit_reader &in, const block_header &header, vector<T> &out, size_t pos) {
+					if (header.type == 0) {
+						uint64_t start = in.tell() / 8;
+						if (start + header.stored_size > in.size) {
+							throw bad_data();
+						}
+						if (out.size() < pos + header.stored_size) {
+							out.resize(max(out.size() * 2, pos + header.stored_size));
+						}
+						copy(in.data + start, in.data + start + header.stored_size, out.begin() + static_cast<ptrdiff_t>(pos));
+						in.seek((start + header.stored_size) * 8);
+						return pos + header.stored_size;
+					}
+
+					const huffman &lit = *header.literals;
+					const huffman &dist = *header.distances;
+					while (true) {
+						if (out.size() < pos + 258) {
+							out.resize(max(out.size() * 2, pos + 64 * 1024));
+						}
+						// A length and distance take at most 15 + 5 + 15 + 13 bits.
+						if (in.available() < 48) {
+							in.refill();
+						}
+						unsigned symbol = lit.decode(in);
+						if (symbol < 256) {
+							out[pos++] = static_cast<T>(symbol);
+							continue;
+						} else if (symbol == 256) {
+							break;
+						}
+						symbol -= 257;
+						if (symbol >= 29) {
+							throw bad_data();
+						}
+						size_t length = LENGTH_BASE[symbol] + in.take(LENGTH_EXTRA[symbol]);
+						unsigned code = dist.decode(in);
+						if (code >= 30) {
+							throw bad_data();
+						}
+						size_t distance = DISTANCE_BASE[code] + in.take(DISTANCE_EXTRA[code]);
+						if (distance > pos) {
+							throw bad_data();
+						}
+						T *to = out.data() + pos;
+						const T *from = to - distance;
+						if (distance >= length) {
+							copy(from, from + length, to);
+						} else {
+							for (size_t n = 0; n < length; ++n) {
+								to[n] = from[n];
+							}
+						}
+						pos += length;
+					}
+					return pos;
+				}
+
+			private:
+				huffman codes, literals, distances, fixed_literals, fixed_distances;
+		};
+
+		block_decoder::~block_decoder() = default;
+
+		/// Output of one chunk: a part with markers, then one with plain bytes.
+		struct chunk {
+			uint64_t begin = 0;      // bit offset of the first block
+			uint64_t end = 0;        // bit offset after the last block
+			bool found = false;
+			bool last = false;       // ends with the final block
+			vector<uint16_t> marked{};
+			size_t marked_size = 0;  // after the window of markers in front
+			vector<uint8_t> plain{};
+			size_t plain_start = 0;  // 'plain' starts with the 32 KB before it
+			size_t plain_size = 0;
+		};
+
+		/**
+		 * Inflates from the block at bit 'start' up to the first block that
+		 * starts at or after 'stop', or the final block. With no 'window'
+		 * the 32 KB before 'start' are unknown and produce markers.
+		 */
+		void inflate_chunk(block_decoder &decoder, bit_reader &in, chunk &c, const uint64_t start, const uint64_t stop,
+		                   const uint8_t *window, const size_t window_size, const bool guess) {
+			in.seek(start);
+			c.begin = start;
+			bool with_markers = (window == nullptr);
+			size_t pos;
+			if (with_markers) {
+				c.marked.resize(WINDOW_SIZE + 256 * 1024);
+				for (size_t n = 0; n < WINDOW_SIZE; ++n) {
+					c.marked[n] = static_cast<uint16_t>(WINDOW_MARKER + n);
+				}
+				pos = WINDOW_SIZE;
+			} else {
+				c.plain.resize(window_size + 256 * 1024);
+				copy(window, window + window_size, c.plain.begin());
+				c.plain_start = window_size;
+				pos = window_size;
+			}
+
+			block_header header;
+			bool first = true;
+			while (true) {
+				uint64_t block = in.tell();
+				if (!first && block >= stop) {
+					break;
+				}
+				if (!decoder.read_header(in, header, guess && first)) {
+					throw bad_data();
+				}
+				first = false;
+				if (with_markers) {
+					pos = decoder.decode(in, header, c.marked, pos);
+					// Nothing can refer to the unknown window once 32 KB are free of markers.
+					if (pos >= 2 * WINDOW_SIZE && none_of(c.marked.begin() + static_cast<ptrdiff_t>(pos - WINDOW_SIZE),
+					                                      c.marked.begin() + static_cast<ptrdiff_t>(pos),
+					                                      [](uint16_t s) { return s >= WINDOW_MARKER; })) {
+						c.marked_size = pos - WINDOW_SIZE;
+						c.plain.resize(WINDOW_SIZE + 256 * 1024);
+						copy(c.marked.begin() + static_cast<ptrdiff_t>(pos - WINDOW_SIZE), c.marked.begin() + static_cast<ptrdiff_t>(pos),
+						     c.plain.begin());
+						c.marked.resize(pos);
+						c.marked.shrink_to_fit();
+						c.plain_start = WINDOW_SIZE;
+						pos = WINDOW_SIZE;
+						with_markers = false;
+					}
+				} else {
+					pos = decoder.decode(in, header, c.plain, pos);
+				}
+				if (in.past_end()) {
+					throw bad_data();
+				}
+				if (header.last) {
+					c.last = true;
+					break;
+				}
+			}
+			c.end = in.tell();
+			if (with_markers) {
+				c.marked_size = pos - WINDOW_SIZE;
+				c.marked.resize(pos);
+			} else {
+				c.plain_size = pos - c.plain_start;
+				c.plain.resize(pos);
+			}
+			c.found = true;
+		}
+
+		/// Inflates the chunk from the first offset in [from, to) where a block decodes.
+		void guess_chunk(block_decoder &decoder, bit_reader &in, chunk &c, const uint64_t from, const uint64_t to,
+		                 const uint64_t stop) {
+			for (uint64_t bit = from; bit < to; ++bit) {
+				// Stored or dynamic block
+				size_t byte = static_cast<size_t>(bit / 8);
+				unsigned bits = in.data[byte] | (byte + 1 < in.size ? unsigned(in.data[byte + 1]) << 8 : 0u);
+				unsigned type = (bits >> (bit % 8 + 1)) & 3u;
+				if (type != 0 && type != 2) {
+					continue;
+				}
+				try {
+					// Most offsets are ruled out by the header alone.
+					block_header header;
+					in.seek(bit);
+					if (!decoder.read_header(in, header, true)) {
+						continue;
+					}
+					c = chunk();
+					inflate_chunk(decoder, in, c, bit, stop, nullptr, 0, true);
+					return;
+				} catch (const bad_data &) {
+				}
+			}
+			c = chunk();
+		}
+
+	} // anonymous
+
+	bool zlib_decompress_parallel_into(const uint8_t* in_data, const size_t in_data_size, vector<uint8_t> &out,
+	                                   const size_t offset, unsigned threads, const size_t chunk_size,
+	                                   const progress_callback &progress)
+	{
+		if (threads == 0) {
+			threads = max(1u, thread::hardware_concurrency());
+		}
+		// Deflate with a 32 KB window and no preset dictionary, as written by zlib.
+		bool plain_header = in_data_size >= 6 && (in_data[0] & 0x0F) == 8 && (in_data[0] >> 4) <= 7
+		                    && (in_data[0] * 256 + in_data[1]) % 31 == 0 && !(in_data[1] & 0x20);
+		size_t chunks = chunk_size == 0 ? 0 : in_data_size / chunk_size;
+		if (threads == 1 || chunks < 2 || !plain_header) {
+			return zlib_decompress_into(in_data, in_data_size, out, offset, progress);
+		}
+		threads = static_cast<unsigned>(min<size_t>(threads, chunks));
+
+		vector<chunk> parts(chunks);
+		const uint64_t end_bit = uint64_t(in_data_size) * 8;
+		auto chunk_start = [&](size_t n) { return n == 0 ? uint64_t(16) : uint64_t(n) * chunk_size * 8; };
+		auto chunk_stop = [&](size_t n) { return n + 1 == chunks ? end_bit : chunk_start(n + 1); };
+
+		atomic<size_t> next(0);
+		atomic<bool> stopped(false);
+		mutex progress_lock;
+		uint64_t reported = 0;
+		exception_ptr error;
+		auto worker = [&]() {
+			block_decoder decoder;
+			bit_reader in(in_data, in_data_size);
+			size_t n;
+			while (!stopped && (n = next++) < chunks) {
+				try {
+					if (n == 0) {
+						inflate_chunk(decoder, in, parts[n], chunk_start(n), chunk_stop(n), in_data, 0, false);
+					} else {
+						guess_chunk(decoder, in, parts[n], chunk_start(n), chunk_stop(n), chunk_stop(n));
+					}
+				} catch (...) {
+					parts[n] = chunk();
+				}
+				if (progress) {
+					lock_guard<mutex> lock(progress_lock);
+					reported += (chunk_stop(n) - chunk_start(n)) / 8;
+					try {
+						if (!progress(reported, in_data_size)) {
+							stopped = true;
+						}
+					} catch (...) {
+						error = current_exception();
+						stopped = true;
+					}
+				}
+			}
+		};
+		vector<thread> pool;
+		for (unsigned t = 1; t < threads; ++t) {
+			pool.emplace_back(worker);
+		}
+		worker();
+		for (auto &t : pool) {
+			t.join();
+		}
+		if (error) {
+			rethrow_exception(error);
+		} else if (stopped) {
+			out.resize(offset);
+			return false;
+		}
+
+		// Join the chunks, replacing the markers with the bytes before each chunk.
+		try {
+			block_decoder decoder;
+			bit_reader in(in_data, in_data_size);
+			size_t pos = offset;
+			uint64_t expected = chunk_start(0);
+			bool last = false;
+			for (size_t n = 0; n < chunks && !last; ++n) {
+				chunk &c = parts[n];
+				if (!c.found || c.begin != expected) {
+					// Wrong guess, or none: inflate it again from where the previous one ended.
+					size_t window = min(pos - offset, WINDOW_SIZE);
+					c = chunk();
+					inflate_chunk(decoder, in, c, expected, chunk_stop(n), out.data() + pos - window, window, false);
+				}
+				if (out.size() < pos + c.marked_size + c.plain_size) {
+					out.resize(pos + c.marked_size + c.plain_size);
+				}
+				size_t chunk_pos = pos;
+				for (size_t i = WINDOW_SIZE; i < WINDOW_SIZE + c.marked_size; ++i) {
+					uint16_t s = c.marked[i];
+					if (s < WINDOW_MARKER) {
+						out[pos++] = static_cast<uint8_t>(s);
+					} else if (chunk_pos - offset >= WINDOW_SIZE - (s - WINDOW_MARKER)) {
+						out[pos++] = out[chunk_pos - WINDOW_SIZE + (s - WINDOW_MARKER)];
+					} else {
+						throw bad_data(); // before the start of the stream
+					}
+				}
+				copy(c.plain.begin() + static_cast<ptrdiff_t>(c.plain_start),
+				     c.plain.begin() + static_cast<ptrdiff_t>(c.plain_start + c.plain_size),
+				     out.begin() + static_cast<ptrdiff_t>(pos));
+				pos += c.plain_size;
+				expected = c.end;
+				last = c.last;
+				c = chunk();
+			}
+			if (!last) {
+				throw bad_data();
+			}
+
+			size_t trailer = static_cast<size_t>((expected + 7) / 8);
+			if (trailer + 4 > in_data_size) {
+				throw bad_data();
+			}
+			uLong checksum = adler32(0L, nullptr, 0);
+			for (size_t done = offset; done < pos;) {
+				uInt n = static_cast<uInt>(min<size_t>(pos - done, numeric_limits<uInt>::max()));
+				checksum = adler32(checksum, out.data() + done, n);
+				done += n;
+			}
+			uLong expected_checksum = 0;
+			for (size_t i = 0; i < 4; ++i) {
+				expected_checksum = (expected_checksum << 8) | in_data[trailer + i];
+			}
+			if (checksum != expected_checksum) {
+				throw bad_data();
+			}
+			out.resize(pos);
+		} catch (const bad_data &) {
+			// Start over, and let zlib report the error if there is one.
+			return zlib_decompress_into(in_data, in_data_size, out, offset, progress);
+		}
+		return true;
+	}
+
+	vector<uint8_t> zlib_decompress_parallel(const uint8_t* in_data, const size_t in_data_size, unsigned threads,
+	                                         const size_t chunk_size)
+	{
+		vector<uint8_t> out;
+		zlib_decompress_parallel_into(in_data, in_data_size, out, 0, threads, chunk_size);
+		return out;
+	}
+
+} // zlib
@@ -0,0 +1,773 @@
+/**
+ * libswf - Optimal parsing deflate encoder
+ *
+ * Zopfli-style: the input is cut in segments which are compressed by
+ * separate threads, each one with the 32 KB before it as its window.
+ * Every match of a segment is found once, with hash chains, keeping for each
+ * position the shortest distance of every match length. The segment is then
+ * parsed as a shortest path, where the cost of each literal, length and
+ * distance is its size in bits under a cost model, and split in deflate
+ * blocks where that makes it smaller. Each block is parsed again with the
+ * statistics of its previous parse as the cost model, for a number of
+ * iterations, and the smallest parse is written as a dynamic, fixed or
+ * stored block, whichever is smallest.
+ */
+
+#include "zlib_wrapper.hpp"
+
+#include <algorithm> // min, max, sort, fill
+#include <array>     // array
+#include <atomic>    // atomic
+#include <cmath>     // log2
+#include <limits>    // numeric_limits
+#include <mutex>     // mutex, lock_guard
+#include <queue>     // priority_queue
+#include <thread>    // thread
+#include <zlib.h>    // adler32
+
+using namespace std;
+
+namespace zlib {
+
+	namespace {
+
+		const size_t WINDOW_SIZE = 32 * 1024;
+		const unsigned MIN_MATCH = 3;
+		const unsigned MAX_MATCH = 258;
+		const unsigned MAX_CHAIN = 4096;
+		const unsigned HASH_BITS = 16;
+
+		const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		                                  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+		const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		                                  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+		const uint16_t DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		                                    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+		                                    8193, 12289, 16385, 24577};
+		const uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		                                    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+		const uint8_t CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+		/// Length symbol (0-28, to add to 257) of each match length.
+		const array<uint8_t, MAX_MATCH + 1> length_codes = []() {
+			array<uint8_t, MAX_MATCH + 1> codes{};
+			for (unsigned code = 0; code < 29; ++code) {
+				unsigned end = code == 28 ? MAX_MATCH + 1 : LENGTH_BASE[code + 1];
+				for (unsigned len = LENGTH_BASE[code]; len < end && len <= MAX_MATCH; ++len) {
+					codes[len] = static_cast<uint8_t>(code);
+				}
+			}
+			codes[MAX_MATCH] = 28;
+			return codes;
+		}();
+
+		inline unsigned distance_code(const unsigned distance) {
+			unsigned code = 0;
+			while (code < 29 && DISTANCE_BASE[code + 1] <= distance) {
+				++code;
+			}
+			return code;
+		}
+
+		/// Literal (length 0) or match.
+		struct symbol {
+			uint16_t length;
+			uint16_t value; // literal, or distance
+		};
+
+		/// Bits written least significant first, as deflate does.
+		class bit_writer {
+			public:
+				bit_writer() : bytes(), buffer(0), count(0) {}
+
+				inline void put(const uint32_t value, const unsigned bits) {
+					buffer |= uint64_t(value) << count;
+					count += bits;
+					if (count >= 8) {
+						flush();
+					}
+				}
+				/// Huffman codes go most significant bit first.
+				inline void put_code(const uint32_t code, const unsigned bits) {
+					uint32_t reversed = 0;
+					for (unsigned b = 0; b < bits; ++b) {
+						reversed |= ((code >> b) & 1u) << (bits - 1 - b);
+					}
+					put(reversed, bits);
+				}
+				void align() {
+					if (count > 0) {
+						put(0, 8 - count);
+					}
+				}
+				/// Appends the bits of 'other', which is written from a byte boundary.
+				void append(const bit_writer &other) {
+					bytes.insert(bytes.end(), other.bytes.begin(), other.bytes.end());
+					put(static_cast<uint32_t>(other.buffer), other.count);
+				}
+				inline uint64_t size() const { return uint64_t(bytes.size()) * 8 + count; }
+
+				vector<uint8_t> bytes;
+			private:
+				/// Moves the whole bytes of 'buffer' to 'bytes'. Out of line, to keep put() small.
+				void flush();
+
+				uint64_t buffer;
+				unsigned count;
+		};
+
+		void bit_writer::flush() {
+			while (count >= 8) {
+				bytes.push_back(static_cast<uint8_t>(buffer));
+				buffer >>= 8;
+				count -= 8;
+			}
+		}
+
+		/**
+		 * Huffman code lengths of at most 'max_bits' for the frequencies, with
+		 * the overflow moved to shorter codes as in JPEG (ITU T.81, K.3).
+		 */
+		void huffman_lengths(const uint32_t *freqs, const size_t n, const unsigned max_bits, uint8_t *lengths) {
+			fill(lengths, lengths + n, uint8_t(0));
+			vector<size_t> used;
+			for (size_t s = 0; s < n; ++s) {
+				if (freqs[s] > 0) {
+					used.push_back(s);
+				}
+			}
+			if (used.empty()) {
+				return;
+			} else if (used.size() == 1) {
+				lengths[used[0]] = 1;
+				return;
+			}
+
+			struct node {
+				uint64_t weight;
+				int parent;
+			};
+			vector<node> nodes;
+			using entry = pair<uint64_t, int>;
+			priority_queue<entry, vector<entry>, greater<entry>> heap;
+			for (size_t s : used) {
+				heap.emplace(freqs[s], static_cast<int>(nodes.size()));
+				nodes.push_back({freqs[s], -1});
+			}
+			while (heap.size() > 1) {
+				entry a = heap.top();
+				heap.pop();
+				entry b = heap.top();
+				heap.pop();
+				int parent = static_cast<int>(nodes.size());
+				nodes.push_back({a.first + b.first, -1});
+				nodes[static_cast<size_t>(a.second)].parent = parent;
+				nodes[static_cast<size_t>(b.second)].parent = parent;
+				heap.emplace(a.first + b.first, parent);
+			}
+
+			vector<unsigned> counts(64, 0);
+			for (size_t leaf = 0; leaf < used.size(); ++leaf) {
+				unsigned depth = 0;
+				for (int p = nodes[leaf].parent; p >= 0; p = nodes[static_cast<size_t>(p)].parent) {
+					++depth;
+				}
+				++counts[depth];
+			}
+			for (size_t i = counts.size() - 1; i > max_bits; --i) {
+				while (counts[i] > 0) {
+					size_t j = i - 2;
+					while (counts[j] == 0) {
+						--j;
+					}
+					counts[i] -= 2;
+					counts[i - 1] += 1;
+					counts[j + 1] += 2;
+					counts[j] -= 1;
+				}
+			}
+
+			// The most frequent symbols get the shortest codes.
+			stable_sort(used.begin(), used.end(), [&](size_t a, size_t b) { return freqs[a] > freqs[b]; });
+			size_t next = 0;
+			for (unsigned len = 1; len <= max_bits; ++len) {
+				for (unsigned c = 0; c < counts[len]; ++c) {
+					lengths[used[next++]] = static_cast<uint8_t>(len);
+				}
+			}
+		}
+
+		/// Code length code lengths: at most 7 bits, and never a single code, which zlib rejects.
+		void code_length_code_lengths(const uint32_t *freqs, uint8_t *lengths) {
+			huffman_lengths(freqs, 19, 7, lengths);
+			unsigned used = 0;
+			for (unsigned s = 0; s < 19; ++s) {
+				used += lengths[s] ? 1 : 0;
+			}
+			if (used == 1) {
+				lengths[lengths[0] ? 1 : 0] = 1;
+			}
+		}
+
+		/// Canonical codes of the lengths.
+		void canonical_codes(const uint8_t *lengths, const size_t n, uint16_t *codes) {
+			array<uint16_t, 16> counts{};
+			for (size_t s = 0; s < n; ++s) {
+				++counts[lengths[s]];
+			}
+			counts[0] = 0;
+			array<uint16_t, 16> next{};
+			uint32_t code = 0;
+			for (unsigned len = 1; len < 16; ++len) {
+				code = (code + counts[len - 1]) << 1;
+				next[len] = static_cast<uint16_t>(code);
+			}
+			for (size_t s = 0; s < n; ++s) {
+				codes[s] = lengths[s] ? next[lengths[s]]++ : 0;
+			}
+		}
+
+		/// Symbol frequencies of a run of symbols.
+		struct statistics {
+			array<uint32_t, 288> literals{};
+			array<uint32_t, 32> distances{};
+
+			statistics(const symbol *begin, const symbol *end) {
+				for (const symbol *s = begin; s != end; ++s) {
+					if (s->length == 0) {
+						++literals[s->value];
+					} else {
+						++literals[257 + length_codes[s->length]];
+						++distances[distance_code(s->value)];
+					}
+				}
+				literals[256] = 1;
+			}
+		};
+
+		/// Code lengths and the tree of a dynamic block, as written in its header.
+		struct dynamic_tree {
+			array<uint8_t, 288> literal_lengths{};
+			array<uint8_t, 32> distance_lengths{};
+			unsigned nlit = 257, ndist = 1, ncode = 4;
+			array<uint8_t, 19> code_lengths{};
+			vector<pair<uint8_t, uint8_t>> rle{}; // code length symbol, extra bits value
+
+			explicit dynamic_tree(const statistics &stats) {
+				code_lengths_for(stats);
+				encode();
+			}
+
+			void code_lengths_for(const statistics &stats) {
+				huffman_lengths(stats.literals.data(), 286, 15, literal_lengths.data());
+				huffman_lengths(stats.distances.data(), 30, 15, distance_lengths.data());
+				// At least two distance codes, for old decoders (zlib 1.2.1)
+				// that reject a single one or none.
+				unsigned used = 0;
+				for (unsigned d = 0; d < 30; ++d) {
+					used += distance_lengths[d] ? 1 : 0;
+				}
+				if (used == 0) {
+					distance_lengths[0] = distance_lengths[1] = 1;
+				} else if (used == 1) {
+					distance_lengths[distance_lengths[0] ? 1 : 0] = 1;
+				}
+			}
+
+			void encode() {
+				nlit = 286;
+				while (nlit > 257 && literal_lengths[nlit - 1] == 0) {
+					--nlit;
+				}
+				ndist = 30;
+				while (ndist > 1 && distance_lengths[ndist - 1] == 0) {
+					--ndist;
+				}
+				vector<uint8_t> all(literal_lengths.begin(), literal_lengths.begin() + nlit);
+				all.insert(all.end(), distance_lengths.begin(), distance_lengths.begin() + ndist);
+
+				rle.clear();
+				for (size_t i = 0; i < all.size();) {
+					size_t run = 1;
+					while (i + run < all.size() && all[i + run] == all[i]) {
+						++run;
+					}
+					if (all[i] == 0 && run >= 3) {
+						size_t n = min<size_t>(run, 138);
+						rle.emplace_back(n >= 11 ? 18 : 17, static_cast<uint8_t>(n >= 11 ? n - 11 : n - 3));
+						i += n;
+						continue;
+					}
+					rle.emplace_back(all[i], 0);
+					++i;
+					--run;
+					while (all[i - 1] != 0 && run >= 3) {
+						size_t n = min<size_t>(run, 6);
+						rle.emplace_back(16, static_cast<uint8_t>(n - 3));
+						i += n;
+						run -= n;
+					}
+				}
+
+				array<uint32_t, 19> freqs{};
+				for (const auto &r : rle) {
+					++freqs[r.first];
+				}
+				code_length_code_lengths(freqs.data(), code_lengths.data());
+				ncode = 19;
+				while (ncode > 4 && code_lengths[CODE_LENGTH_ORDER[ncode - 1]] == 0) {
+					--ncode;
+				}
+			}
+
+			/// Size of the header after the 3 bits of block type.
+			uint64_t header_bits() const {
+				uint64_t bits = 5 + 5 + 4 + 3 * uint64_t(ncode);
+				for (const auto &r : rle) {
+					bits += code_lengths[r.first] + (r.first == 16 ? 2u : r.first == 17 ? 3u : r.first == 18 ? 7u : 0u);
+				}
+				return bits;
+			}
+		};
+
+		/// Cost in bits of each symbol, for the shortest path.
+		struct cost_model {
+			array<float, MAX_MATCH + 1> lengths{};
+			array<float, 256> literals{};
+			array<float, 30> distances{};
+
+			/// Fixed Huffman code lengths, for the first parse.
+			static cost_model fixed() {
+				cost_model m;
+				for (unsigned c = 0; c < 256; ++c) {
+					m.literals[c] = c < 144 ? 8.0f : 9.0f;
+				}
+				for (unsigned len = MIN_MATCH; len <= MAX_MATCH; ++len) {
+					unsigned code = length_codes[len];
+					m.lengths[len] = (code < 23 ? 7.0f : 8.0f) + LENGTH_EXTRA[code];
+				}
+				for (unsigned d = 0; d < 30; ++d) {
+					m.distances[d] = 5.0f + DISTANCE_EXTRA[d];
+				}
+				return m;
+			}
+
+			/// Entropy of the symbols in 'stats', an unused symbol costs as much as a single one.
+			static cost_model from(const statistics &stats) {
+				auto entropy = [](const uint32_t *freqs, size_t n, float *out) {
+					uint64_t total = 0;
+					for (size_t s = 0; s < n; ++s) {
+						total += freqs[s];
+					}
+					float log_total = total > 0 ? static_cast<float>(log2(static_cast<double>(total))) : 0.0f;
+					for (size_t s = 0; s < n; ++s) {
+						out[s] = freqs[s] ? log_total - static_cast<float>(log2(static_cast<double>(freqs[s]))) : log_total;
+						out[s] = max(out[s], 1.0f);
+					}
+				};
+				array<float, 288> literal_costs{};
+				array<float, 32> distance_costs{};
+				entropy(stats.literals.data(), 286, literal_costs.data());
+				entropy(stats.distances.data(), 30, distance_costs.data());
+
+				cost_model m;
+				copy(literal_costs.begin(), literal_costs.begin() + 256, m.literals.begin());
+				for (unsigned len = MIN_MATCH; len <= MAX_MATCH; ++len) {
+					unsigned code = length_codes[len];
+					m.lengths[len] = literal_costs[257 + code] + LENGTH_EXTRA[code];
+				}
+				for (unsigned d = 0; d < 30; ++d) {
+					m.distances[d] = distance_costs[d] + DISTANCE_EXTRA[d];
+				}
+				return m;
+			}
+		};
+
+		/**
+		 * Matches of every position of a segment: for each one, the matches
+		 * that are longer than the ones at shorter distances, so that the
+		 * shortest distance of any length is the first one at least as long.
+		 */
+		struct match_finder {
+			vector<uint32_t> first{};   // index in 'matches' of each position's matches, one more at the end
+			vector<uint32_t> matches{}; // length << 16 | (distance - 1)
+
+			match_finder(const uint8_t *data, const size_t start, const size_t end) {
+				size_t window = start > WINDOW_SIZE ? start - WINDOW_SIZE : 0;
+				vector<int32_t> head(size_t(1) << HASH_BITS, -1);
+				vector<int32_t> prev(end - window, -1);
+				auto hash = [&](size_t p) {
+					uint32_t h = (uint32_t(data[p]) << 16) | (uint32_t(data[p + 1]) << 8) | data[p + 2];
+					return (h * 2654435761u) >> (32 - HASH_BITS);
+				};
+				auto insert = [&](size_t p) {
+					if (p + MIN_MATCH <= end) {
+						uint32_t h = hash(p);
+						prev[p - window] = head[h];
+						head[h] = static_cast<int32_t>(p - window);
+					}
+				};
+				for (size_t p = window; p < start; ++p) {
+					insert(p);
+				}
+
+				first.reserve(end - start + 1);
+				for (size_t p = start; p < end; ++p) {
+					first.push_back(static_cast<uint32_t>(matches.size()));
+					size_t max_length = min<size_t>(MAX_MATCH, end - p);
+					if (max_length >= MIN_MATCH) {
+						size_t best = MIN_MATCH - 1;
+						unsigned chain = 0;
+						const uint8_t *cur = data + p;
+						for (int32_t c = head[hash(p)]; c >= 0 && chain < MAX_CHAIN; c = prev[static_cast<size_t>(c)], ++chain) {
+							size_t candidate = window + static_cast<size_t>(c);
+							if (p - candidate > WINDOW_SIZE) {
+								break;
+							}
+							const uint8_t *old = data + candidate;
+							if (old[best] != cur[best]) {
+								continue;
+							}
+							size_t len = 0;
+							while (len < max_length && old[len] == cur[len]) {
+								++len;
+							}
+							if (len > best) {
+								best = len;
+								matches.push_back(static_cast<uint32_t>((len << 16) | (p - candidate - 1)));
+								if (len == max_length) {
+									break;
+								}
+							}
+						}
+					}
+					insert(p);
+				}
+				first.push_back(static_cast<uint32_t>(matches.size()));
+			}
+		};
+
+		/// Shortest path through [start, end) of the segment that begins at 'segment'.
+		vector<symbol> optimal_parse(const uint8_t *data, const size_t segment, const size_t start, const size_t end,
+		                             const match_finder &finder, const cost_model &model) {
+			const size_t n = end - start;
+			vector<float> cost(n + 1, numeric_limits<float>::infinity());
+			vector<symbol> step(n + 1);
+			cost[0] = 0;
+			// Bytes equal to each one from it on, for the long runs.
+			vector<uint32_t> same(n);
+			for (size_t i = n; i-- > 0;) {
+				same[i] = (i + 1 < n && data[start + i + 1] == data[start + i]) ? same[i + 1] + 1 : 1;
+			}
+
+			for (size_t i = 0; i < n; ++i) {
+				const float here = cost[i];
+				const size_t p = start + i;
+				if (p > 0 && data[p - 1] == data[p] && same[i] > 2 * MAX_MATCH) {
+					// Inside a long run of one byte, as Zopfli does, only take its longest matches.
+					cost[i + MAX_MATCH] = here + model.lengths[MAX_MATCH] + model.distances[0];
+					step[i + MAX_MATCH] = {static_cast<uint16_t>(MAX_MATCH), 1};
+					i += MAX_MATCH - 1;
+					continue;
+				}
+				float c = here + model.literals[data[p]];
+				if (c < cost[i + 1]) {
+					cost[i + 1] = c;
+					step[i + 1] = {0, data[p]};
+				}
+				size_t done = MIN_MATCH - 1;
+				size_t left = n - i;
+				for (uint32_t m = finder.first[p - segment]; m < finder.first[p - segment + 1]; ++m) {
+					size_t len = min<size_t>(finder.matches[m] >> 16, left);
+					unsigned distance = (finder.matches[m] & 0xFFFF) + 1;
+					float dcost = here + model.distances[distance_code(distance)];
+					for (size_t l = done + 1; l <= len; ++l) {
+						c = dcost + model.lengths[l];
+						if (c < cost[i + l]) {
+							cost[i + l] = c;
+							step[i + l] = {static_cast<uint16_t>(l), static_cast<uint16_t>(distance)};
+						}
+					}
+					done = max(done, len);
+				}
+			}
+
+			vector<symbol> symbols;
+			for (size_t i = n; i > 0;) {
+				symbol s = step[i];
+				symbols.push_back(s);
+				i -= s.length ? s.length : 1;
+			}
+			reverse(symbols.begin(), symbols.end());
+			return symbols;
+		}
+
+		/// Size in bits of the symbols as a dynamic block, header included.
+		uint64_t dynamic_size(const symbol *begin, const symbol *end) {
+			statistics stats(begin, end);
+			dynamic_tree tree(stats);
+			uint64_t bits = 3 + tree.header_bits();
+			for (unsigned s = 0; s < 286; ++s) {
+				bits += uint64_t(stats.literals[s]) * (tree.literal_lengths[s] + (s > 256 ? LENGTH_EXTRA[s - 257] : 0u));
+			}
+			for (unsigned d = 0; d < 30; ++d) {
+				bits += uint64_t(stats.distances[d]) * (tree.distance_lengths[d] + DISTANCE_EXTRA[d]);
+			}
+			return bits;
+		}
+
+		/// Splits the symbols where two blocks are smaller than one, recursively (at most 'depth' times).
+		void split(const symbol *begin, const symbol *end, vector<const symbol *> &points, const unsigned depth) {
+			const size_t n = static_cast<size_t>(end - begin);
+			if (depth == 0 || n < 2048) {
+				return;
+			}
+			uint64_t whole = dynamic_size(begin, end);
+			uint64_t best = whole;
+			const symbol *at = nullptr;
+			for (unsigned k = 1; k < 16; ++k) {
+				const symbol *mid = begin + n * k / 16;
+				uint64_t size = dynamic_size(begin, mid) + dynamic_size(mid, end);
+				if (size < best) {
+					best = size;
+					at = mid;
+				}
+			}
+			if (at == nullptr) {
+				return;
+			}
+			split(begin, at, points, depth - 1);
+			points.push_back(at);
+			split(at, end, points, depth - 1);
+		}
+
+		void write_symbols(bit_writer &out, const symbol *begin, const symbol *end, const uint8_t *literal_lengths,
+		                   const uint16_t *literal_codes, const uint8_t *distance_lengths, const uint16_t *distance_codes) {
+			for (const symbol *s = begin; s != end; ++s) {
+				if (s->length == 0) {
+					out.put_code(literal_codes[s->value], literal_lengths[s->value]);
+					continue;
+				}
+				unsigned lc = length_codes[s->length];
+				out.put_code(literal_codes[257 + lc], literal_lengths[257 + lc]);
+				out.put(s->length - LENGTH_BASE[lc], LENGTH_EXTRA[lc]);
+				unsigned dc = distance_code(s->value);
+				out.put_code(distance_codes[dc], distance_lengths[dc]);
+				out.put(s->value - DISTANCE_BASE[dc], DISTANCE_EXTRA[dc]);
+			}
+			out.put_code(literal_codes[256], literal_lengths[256]);
+		}
+
+		/// Writes the block as the smallest of dynamic, fixed and stored.
+		void write_block(bit_writer &out, const uint8_t *data, const size_t start, const size_t end,
+		                 const vector<symbol> &symbols, const bool last) {
+			const symbol *begin = symbols.data(), *finish = symbols.data() + symbols.size();
+			statistics stats(begin, finish);
+			dynamic_tree tree(stats);
+
+			array<uint8_t, 288> fixed_literals{};
+			array<uint8_t, 32> fixed_distances{};
+			fill(fixed_literals.begin(), fixed_literals.begin() + 144, uint8_t(8));
+			fill(fixed_literals.begin() + 144, fixed_literals.begin() + 256, uint8_t(9));
+			fill(fixed_literals.begin() + 256, fixed_literals.begin() + 280, uint8_t(7));
+			fill(fixed_literals.begin() + 280, fixed_literals.end(), uint8_t(8));
+			fill(fixed_distances.begin(), fixed_distances.end(), uint8_t(5));
+
+			uint64_t dynamic_bits = dynamic_size(begin, finish);
+			uint64_t fixed_bits = 3;
+			for (unsigned s = 0; s < 286; ++s) {
+				fixed_bits += uint64_t(stats.literals[s]) * (fixed_literals[s] + (s > 256 ? LENGTH_EXTRA[s - 257] : 0u));
+			}
+			for (unsigned d = 0; d < 30; ++d) {
+				fixed_bits += uint64_t(stats.distances[d]) * (5u + DISTANCE_EXTRA[d]);
+			}
+			size_t stored_blocks = max<size_t>(1, (end - start + 65534) / 65535);
+			uint64_t stored_bits = uint64_t(end - start) * 8 + stored_blocks * (3 + 7 + 32);
+
+			if (stored_bits < dynamic_bits && stored_bits < fixed_bits) {
+				for (size_t p = start, b = 0; b < stored_blocks; ++b) {
+					size_t size = min<size_t>(65535, end - p);
+					out.put((last && b + 1 == stored_blocks) ? 1 : 0, 1);
+					out.put(0, 2);
+					out.align();
+					out.put(static_cast<uint32_t>(size), 16);
+					out.put(static_cast<uint32_t>(~size & 0xFFFF), 16);
+					for (size_t i = 0; i < size; ++i) {
+						out.put(data[p + i], 8);
+					}
+					p += size;
+				}
+				return;
+			}
+
+			out.put(last ? 1 : 0, 1);
+			array<uint16_t, 288> literal_codes{};
+			array<uint16_t, 32> distance_codes{};
+			if (fixed_bits <= dynamic_bits) {
+				out.put(1, 2);
+				canonical_codes(fixed_literals.data(), 288, literal_codes.data());
+				canonical_codes(fixed_distances.data(), 32, distance_codes.data());
+				write_symbols(out, begin, finish, fixed_literals.data(), literal_codes.data(),
+				              fixed_distances.data(), distance_codes.data());
+				return;
+			}
+
+			out.put(2, 2);
+			out.put(tree.nlit - 257, 5);
+			out.put(tree.ndist - 1, 5);
+			out.put(tree.ncode - 4, 4);
+			for (unsigned i = 0; i < tree.ncode; ++i) {
+				out.put(tree.code_lengths[CODE_LENGTH_ORDER[i]], 3);
+			}
+			array<uint16_t, 19> length_code_codes{};
+			canonical_codes(tree.code_lengths.data(), 19, length_code_codes.data());
+			for (const auto &r : tree.rle) {
+				out.put_code(length_code_codes[r.first], tree.code_lengths[r.first]);
+				if (r.first >= 16) {
+					out.put(r.second, r.first == 16 ? 2 : r.first == 17 ? 3 : 7);
+				}
+			}
+			canonical_codes(tree.literal_lengths.data(), 288, literal_codes.data());
+			canonical_codes(tree.distance_lengths.data(), 32, distance_codes.data());
+			write_symbols(out, begin, finish, tree.literal_lengths.data(), literal_codes.data(),
+			              tree.distance_lengths.data(), distance_codes.data());
+		}
+
+		/// Compresses [start, end) as deflate blocks, the last one final if 'last'.
+		bit_writer compress_segment(const uint8_t *data, const size_t start, const size_t end, const int iterations,
+		                            const bool last) {
+			match_finder finder(data, start, end);
+
+			// Block boundaries from a first parse with the fixed code lengths.
+			vector<symbol> first = optimal_parse(data, start, start, end, finder, cost_model::fixed());
+			vector<const symbol *> points;
+			split(first.data(), first.data() + first.size(), points, 6);
+			vector<size_t> bounds{start};
+			size_t pos = start;
+			const symbol *s = first.data();
+			for (const symbol *point : points) {
+				for (; s != point; ++s) {
+					pos += s->length ? s->length : 1;
+				}
+				bounds.push_back(pos);
+			}
+			bounds.push_back(end);
+
+			bit_writer out;
+			for (size_t b = 0; b + 1 < bounds.size(); ++b) {
+				// Each iteration parses with the statistics of the previous one.
+				vector<symbol> best;
+				uint64_t best_size = numeric_limits<uint64_t>::max();
+				cost_model model = cost_model::fixed();
+				for (int i = 0; i < max(iterations, 1); ++i) {
+					vector<symbol> parse = optimal_parse(data, start, bounds[b], bounds[b + 1], finder, model);
+					uint64_t size = dynamic_size(parse.data(), parse.data() + parse.size());
+					if (size < best_size) {
+						best_size = size;
+						best = parse;
+					}
+					model = cost_model::from(statistics(parse.data(), parse.data() + parse.size()));
+				}
+				write_block(out, data, bounds[b], bounds[b + 1], best, last && b + 2 == bounds.size());
+			}
+			if (!last) {
+				// An empty stored block, as pigz does, so that the next segment
+				// starts on a byte boundary, where its own stored blocks expect it.
+				out.put(0, 3);
+				out.align();
+				out.put(0xFFFF0000, 32);
+			}
+			return out;
+		}
+
+	} // anonymous
+
+	bool zlib_compress_optimal_into(const uint8_t* in_data, const size_t in_data_size, vector<uint8_t> &out,
+	                                const size_t offset, const int iterations, unsigned threads, const size_t segment_size,
+	                                const progress_callback &progress)
+	{
+		if (in_data_size == 0) {
+			return zlib_compress_into(in_data, in_data_size, out, offset, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, progress);
+		}
+		if (threads == 0) {
+			threads = max(1u, thread::hardware_concurrency());
+		}
+		size_t segments = segment_size == 0 ? 1 : (in_data_size + segment_size - 1) / segment_size;
+		size_t size = (in_data_size + segments - 1) / segments;
+		threads = static_cast<unsigned>(min<size_t>(threads, segments));
+
+		vector<bit_writer> parts(segments);
+		atomic<size_t> next(0);
+		exception_ptr error;
+		atomic<bool> failed(false);
+		atomic<bool> stopped(false);
+		mutex progress_lock;
+		uint64_t reported = 0;
+		auto worker = [&]() {
+			try {
+				size_t n;
+				while (!failed && (n = next++) < segments) {
+					size_t start = n * size;
+					size_t end = min(start + size, in_data_size);
+					parts[n] = compress_segment(in_data, start, end, iterations, n + 1 == segments);
+					if (progress) {
+						lock_guard<mutex> lock(progress_lock);
+						reported += end - start;
+						if (!progress(reported, in_data_size)) {
+							stopped = true;
+							failed = true;
+						}
+					}
+				}
+			} catch (...) {
+				if (!failed.exchange(true)) {
+					error = current_exception();
+				}
+			}
+		};
+		vector<thread> pool;
+		for (unsigned t = 1; t < threads; ++t) {
+			pool.emplace_back(worker);
+		}
+		worker();
+		for (auto &t : pool) {
+			t.join();
+		}
+		if (error) {
+			rethrow_exception(error);
+		} else if (stopped) {
+			out.resize(offset);
+			return false;
+		}
+
+		bit_writer stream;
+		stream.put(0x78, 8); // deflate, 32 KB window
+		stream.put(0xDA, 8); // maximum compression, no dictionary
+		for (const auto &part : parts) {
+			stream.append(part);
+		}
+		stream.align();
+		uLong checksum = adler32(0L, nullptr, 0);
+		for (size_t done = 0; done < in_data_size;) {
+			uInt n = static_cast<uInt>(min<size_t>(in_data_size - done, numeric_limits<uInt>::max()));
+			checksum = adler32(checksum, in_data + done, n);
+			done += n;
+		}
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			stream.put(static_cast<uint32_t>(checksum >> shift) & 0xFF, 8);
+		}
+
+		out.resize(offset);
+		out.insert(out.end(), stream.bytes.begin(), stream.bytes.end());
+		return true;
+	}
+
+	vector<uint8_t> zlib_compress_optimal(const uint8_t* in_data, const size_t in_data_size, const int iterations,
+	                                      unsigned threads, const size_t segment_size)
+	{
+		vector<uint8_t> out;
+		zlib_compress_optimal_into(in_data, in_data_size, out, 0, iterations, threads, segment_size);
+		return out;
+	}
+
+} // zlib
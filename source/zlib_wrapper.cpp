@@ -7,26 +7,21 @@
 
 #include "zlib_wrapper.hpp"
 #include <zlib.h>
+#include <thread>    // thread, hardware_concurrency
+#include <atomic>    // atomic
+#include <exception> // exception_ptr
+#include <algorithm> // min, max
+#include <limits>    // numeric_limits
+#include <mutex>     // mutex, lock_guard
 
 using namespace std;
 
 namespace zlib {
 
-	struct zlib_helper_deflate {
-		z_stream stream;
-		zlib_helper_deflate() : stream() {}
-		~zlib_helper_deflate() {
-			(void)deflateEnd(&stream);
-		}
-	};
-
-	struct zlib_helper_inflate {
-		z_stream stream;
-		zlib_helper_inflate() : stream() {}
-		~zlib_helper_inflate() {
-			(void)inflateEnd(&stream);
-		}
-	};
+	namespace {
+		/// Bytes between two calls of a progress_callback.
+		const size_t PROGRESS_STEP = 256 * 1024;
+	}
 
 	void zerr(int ret, const string &func) {
 	    switch (ret) {
@@ -51,118 +46,766 @@ namespace zlib {
 		}
 	}
 
+	struct deflater::state {
+		state() : stream(), buffer(), next(nullptr), left(0), finished(false) {}
+		state(const state &) = delete;
+		state &operator=(const state &) = delete;
+		~state() {
+			(void)deflateEnd(&stream);
+		}
+		/// Moves input to the stream, whose avail_in is only a uInt.
+		void load() {
+			if (stream.avail_in == 0 && left > 0) {
+				uInt n = static_cast<uInt>(min<size_t>(left, numeric_limits<uInt>::max()));
+				stream.next_in = next;
+				stream.avail_in = n;
+				next += n;
+				left -= n;
+			}
+		}
+		z_stream stream;
+		vector<uint8_t> buffer; // push mode output, allocated on first use
+		const uint8_t *next;    // input not given to the stream yet
+		size_t left;
+		bool finished;
+	};
+
+	deflater::deflater(const int level, const int strategy, const int window_bits, const size_t buffer_size_)
+		: impl(new state()), buffer_size(buffer_size_)
+	{
+		int ret = deflateInit2(&impl->stream, level, Z_DEFLATED, window_bits, 8, strategy);
+		if (ret != Z_OK) {
+			throw zlib_exception("zlib: deflateInit2() failed with code: " + to_string(ret));
+		}
+	}
+
+	deflater::deflater(const deflater &other)
+		: impl(new state()), buffer_size(other.buffer_size)
+	{
+		if (other.pending_input() > 0) {
+			throw zlib_exception("zlib: Can't copy a stream with input left.");
+		}
+		// deflateCopy does not modify the source.
+		int ret = deflateCopy(&impl->stream, const_cast<z_stream *>(&other.impl->stream));
+		if (ret != Z_OK) {
+			impl->stream = z_stream(); // it may still point to the state of 'other'
+			zerr(ret, "deflateCopy()");
+		}
+		impl->finished = other.impl->finished;
+	}
+
+	deflater::~deflater() = default;
+
+	size_t deflater::bound(const size_t size)
+	{
+		return deflateBound(&impl->stream, static_cast<uLong>(size));
+	}
+
+	void deflater::set_dictionary(const uint8_t *data, const size_t size)
+	{
+		int ret = deflateSetDictionary(&impl->stream, data, static_cast<uInt>(size));
+		if (ret != Z_OK) {
+			zerr(ret, "deflateSetDictionary()");
+		}
+	}
+
+	void deflater::input(const uint8_t *data, const size_t size)
+	{
+		if (pending_input() > 0) {
+			throw zlib_exception("zlib: The previous input was not consumed.");
+		}
+		impl->next = data;
+		impl->left = size;
+	}
+
+	size_t deflater::read(uint8_t *out, const size_t size, const int flush)
+	{
+		z_stream &strm = impl->stream;
+		size_t produced = 0;
+		while (produced < size && !impl->finished) {
+			impl->load();
+			uInt avail_out = static_cast<uInt>(min<size_t>(size - produced, numeric_limits<uInt>::max()));
+			strm.next_out = out + produced;
+			strm.avail_out = avail_out;
+			// Only flush once the last of the input is in the stream.
+			int ret = deflate(&strm, impl->left > 0 ? Z_NO_FLUSH : flush);
+			produced += avail_out - strm.avail_out;
+			if (ret == Z_STREAM_END) {
+				impl->finished = true;
+			} else if (ret == Z_BUF_ERROR) {
+				break; // nothing left to compress or flush
+			} else if (ret != Z_OK) {
+				zerr(ret, "deflate()");
+			} else if (strm.avail_out != 0 && strm.avail_in == 0 && impl->left == 0) {
+				break;
+			}
+		}
+		return produced;
+	}
+
+	bool deflater::drain(const int flush, const chunk_sink &sink)
+	{
+		impl->buffer.resize(buffer_size);
+		size_t n;
+		do {
+			n = read(impl->buffer.data(), impl->buffer.size(), flush);
+			if (n > 0 && !sink(impl->buffer.data(), n)) {
+				return false;
+			}
+		} while (n == impl->buffer.size());
+		return true;
+	}
+
+	bool deflater::feed(const uint8_t *data, const size_t size, const chunk_sink &sink)
+	{
+		input(data, size);
+		return drain(Z_NO_FLUSH, sink);
+	}
+
+	bool deflater::flush(const chunk_sink &sink)
+	{
+		return drain(Z_SYNC_FLUSH, sink);
+	}
+
+	bool deflater::finish(const chunk_sink &sink)
+	{
+		return drain(Z_FINISH, sink);
+	}
+
+	size_t deflater::pending_input() const
+	{
+		return impl->stream.avail_in + impl->left;
+	}
+
+	bool deflater::finished() const
+	{
+		return impl->finished;
+	}
+
+	void deflater::reset()
+	{
+		int ret = deflateReset(&impl->stream);
+		if (ret != Z_OK) {
+			zerr(ret, "deflateReset()");
+		}
+		impl->stream.avail_in = 0;
+		impl->next = nullptr;
+		impl->left = 0;
+		impl->finished = false;
+	}
+
+
+	struct inflater::state {
+		state() : stream(), buffer(), next(nullptr), left(0), finished(false) {}
+		state(const state &) = delete;
+		state &operator=(const state &) = delete;
+		~state() {
+			(void)inflateEnd(&stream);
+		}
+		/// Moves input to the stream, whose avail_in is only a uInt.
+		void load() {
+			if (stream.avail_in == 0 && left > 0) {
+				uInt n = static_cast<uInt>(min<size_t>(left, numeric_limits<uInt>::max()));
+				stream.next_in = next;
+				stream.avail_in = n;
+				next += n;
+				left -= n;
+			}
+		}
+		z_stream stream;
+		vector<uint8_t> buffer; // push mode output, allocated on first use
+		const uint8_t *next;    // input not given to the stream yet
+		size_t left;
+		bool finished;
+	};
+
+	inflater::inflater(const int window_bits, const size_t buffer_size_)
+		: impl(new state()), buffer_size(buffer_size_)
+	{
+		int ret = inflateInit2(&impl->stream, window_bits);
+		if (ret != Z_OK) {
+			throw zlib_exception("zlib: inflateInit2() failed with code: " + to_string(ret));
+		}
+	}
+
+	inflater::~inflater() = default;
+
+	void inflater::set_dictionary(const uint8_t *data, const size_t size)
+	{
+		int ret = inflateSetDictionary(&impl->stream, data, static_cast<uInt>(size));
+		if (ret != Z_OK) {
+			zerr(ret, "inflateSetDictionary()");
+		}
+	}
+
+	void inflater::prime(const int bits, const int value)
+	{
+		int ret = inflatePrime(&impl->stream, bits, value);
+		if (ret != Z_OK) {
+			zerr(ret, "inflatePrime()");
+		}
+	}
+
+	void inflater::input(const uint8_t *data, const size_t size)
+	{
+		if (pending_input() > 0) {
+			throw zlib_exception("zlib: The previous input was not consumed.");
+		}
+		impl->next = data;
+		impl->left = size;
+	}
+
+	size_t inflater::read(uint8_t *out, const size_t size)
+	{
+		z_stream &strm = impl->stream;
+		size_t produced = 0;
+		while (produced < size && !impl->finished) {
+			impl->load();
+			uInt avail_out = static_cast<uInt>(min<size_t>(size - produced, numeric_limits<uInt>::max()));
+			strm.next_out = out + produced;
+			strm.avail_out = avail_out;
+			int ret = inflate(&strm, Z_NO_FLUSH);
+			produced += avail_out - strm.avail_out;
+			if (ret == Z_STREAM_END) {
+				impl->finished = true;
+			} else if (ret == Z_BUF_ERROR) {
+				break; // needs more input
+			} else if (ret != Z_OK) {
+				zerr(ret, "inflate()");
+			} else if (strm.avail_out != 0 && strm.avail_in == 0 && impl->left == 0) {
+				break;
+			}
+		}
+		return produced;
+	}
+
+	bool inflater::feed(const uint8_t *data, const size_t size, const chunk_sink &sink)
+	{
+		input(data, size);
+		impl->buffer.resize(buffer_size);
+		size_t n;
+		do {
+			n = read(impl->buffer.data(), impl->buffer.size());
+			if (n > 0 && !sink(impl->buffer.data(), n)) {
+				return false;
+			}
+		} while (n == impl->buffer.size());
+		return true;
+	}
+
+	size_t inflater::pending_input() const
+	{
+		return impl->stream.avail_in + impl->left;
+	}
+
+	bool inflater::finished() const
+	{
+		return impl->finished;
+	}
+
+	void inflater::reset()
+	{
+		int ret = inflateReset(&impl->stream);
+		if (ret != Z_OK) {
+			zerr(ret, "inflateReset()");
+		}
+		impl->stream.avail_in = 0;
+		impl->next = nullptr;
+		impl->left = 0;
+		impl->finished = false;
+	}
+
 	/**
 	 * zlib C tutorial: http://zlib.net/zlib_how.html
 	 * StackOverflow C++ tutorial: https://stackoverflow.com/questions/4538586/how-to-compress-a-buffer-with-zlib
 	 */
-	vector<uint8_t> zlib_compress(const uint8_t* in_data, const size_t in_data_size, const int level)
+	bool zlib_compress_into(const uint8_t* in_data, const size_t in_data_size, vector<uint8_t> &out,
+	                        const size_t offset, const int level, const int strategy, const progress_callback &progress)
+	{
+		deflater compressor(level, strategy);
+
+		// deflateBound is an upper bound of the compressed size, so one
+		// read compresses everything and 'out' is only shrunk afterwards.
+		// With 'progress', the input is given to it one step at a time.
+		out.resize(offset + compressor.bound(in_data_size));
+		size_t step = progress ? PROGRESS_STEP : in_data_size;
+		size_t done = 0, size = 0;
+		do {
+			size_t n = min(step, in_data_size - done);
+			compressor.input(in_data + done, n);
+			done += n;
+			size += compressor.read(out.data() + offset + size, out.size() - offset - size,
+			                        done == in_data_size ? Z_FINISH : Z_NO_FLUSH);
+			if (progress && !progress(done, in_data_size)) {
+				out.resize(offset);
+				return false;
+			}
+		} while (done < in_data_size);
+		if (!compressor.finished()) {
+			throw zlib_exception("zlib: Stream is not complete.");
+		}
+
+		out.resize(offset + size);
+		return true;
+	}
+
+	vector<uint8_t> zlib_compress(const uint8_t* in_data, const size_t in_data_size, const int level,
+	                              const int strategy)
 	{
 		vector<uint8_t> out_data;
+		zlib_compress_into(in_data, in_data_size, out_data, 0, level, strategy);
+		return out_data;
+	}
 
-		const size_t BUFSIZE = 128 * 1024;
-		uint8_t temp_buffer[BUFSIZE];
 
-		zlib_helper_deflate helper;
-		z_stream *strm = &helper.stream;
-		strm->zalloc = nullptr;
-		strm->zfree = nullptr;
-		strm->opaque = nullptr;
-		strm->next_in = in_data; // Can be const if #define ZLIB_CONST
-		strm->avail_in = static_cast<uInt>(in_data_size);
-		strm->next_out = temp_buffer;
-		strm->avail_out = BUFSIZE;
+	namespace {
 
-		int ret = deflateInit(strm, level);
-		if (ret != Z_OK) {
-			throw zlib_exception("zlib: deflateInit() failed with code: " + to_string(ret));
-		}
+		const size_t DICT_SIZE = 32 * 1024; // deflate window
 
-		while (strm->avail_in != 0) {
-			ret = deflate(strm, Z_NO_FLUSH);
-			if (ret != Z_OK && ret != Z_STREAM_END) {
-				zerr(ret, "deflate()");
+		/**
+		 * Compresses one block as raw deflate data, with the bytes before it
+		 * as the dictionary. Every block but the last ends with a sync flush
+		 * (an empty stored block), so that it ends on a byte boundary and the
+		 * blocks can be concatenated.
+		 */
+		vector<uint8_t> deflate_block(const uint8_t *dict, size_t dict_size, const uint8_t *in, size_t in_size,
+		                              int level, int strategy, bool last)
+		{
+			deflater compressor(level, strategy, -15);
+			if (dict_size > 0) {
+				compressor.set_dictionary(dict, dict_size);
 			}
-			if (strm->avail_out == 0) {
-				out_data.insert(out_data.end(), temp_buffer, temp_buffer + BUFSIZE);
-				strm->next_out = temp_buffer;
-				strm->avail_out = BUFSIZE;
+
+			// deflateBound does not count the sync flush marker.
+			vector<uint8_t> out(compressor.bound(in_size) + 16);
+			compressor.input(in, in_size);
+
+			int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+			size_t used = 0;
+			while (true) {
+				size_t space = out.size() - used;
+				size_t size = compressor.read(out.data() + used, space, flush);
+				used += size;
+				if (last ? compressor.finished() : size < space) {
+					break;
+				}
+				out.resize(out.size() * 2);
 			}
+
+			out.resize(used);
+			return out;
 		}
 
-		ret = Z_OK;
-		while (ret == Z_OK) {
-			if (strm->avail_out == 0) {
-				out_data.insert(out_data.end(), temp_buffer, temp_buffer + BUFSIZE);
-				strm->next_out = temp_buffer;
-				strm->avail_out = BUFSIZE;
+	} // anonymous
+
+	bool zlib_compress_parallel_into(const uint8_t* in_data, const size_t in_data_size, vector<uint8_t> &out,
+	                                 const size_t offset, const int level, unsigned threads,
+	                                 const size_t block_size, const int strategy, const progress_callback &progress)
+	{
+		if (threads == 0) {
+			threads = max(1u, thread::hardware_concurrency());
+		}
+		size_t blocks = block_size == 0 ? 0 : (in_data_size + block_size - 1) / block_size;
+		if (threads == 1 || blocks <= 1) {
+			return zlib_compress_into(in_data, in_data_size, out, offset, level, strategy, progress);
+		}
+		threads = static_cast<unsigned>(min<size_t>(threads, blocks));
+
+		vector<vector<uint8_t>> compressed(blocks);
+		vector<uLong> checksums(blocks);
+		atomic<size_t> next(0);
+		exception_ptr error;
+		atomic<bool> failed(false);
+		atomic<bool> stopped(false);
+		mutex progress_lock;
+		uint64_t done = 0;
+
+		auto worker = [&]() {
+			try {
+				size_t b;
+				while (!failed && (b = next++) < blocks) {
+					size_t start = b * block_size;
+					size_t size = min(block_size, in_data_size - start);
+					size_t dict_size = min(start, DICT_SIZE);
+					compressed[b] = deflate_block(in_data + start - dict_size, dict_size, in_data + start, size,
+					                              level, strategy, b == blocks - 1);
+					checksums[b] = adler32(adler32(0L, nullptr, 0), in_data + start, static_cast<uInt>(size));
+					if (progress) {
+						lock_guard<mutex> lock(progress_lock);
+						done += size;
+						if (!progress(done, in_data_size)) {
+							stopped = true;
+							failed = true;
+						}
+					}
+				}
+			} catch (...) {
+				if (!failed.exchange(true)) {
+					error = current_exception();
+				}
 			}
-			ret = deflate(strm, Z_FINISH);
+		};
+
+		vector<thread> pool;
+		for (unsigned t = 1; t < threads; ++t) {
+			pool.emplace_back(worker);
+		}
+		worker();
+		for (auto &t : pool) {
+			t.join();
+		}
+		if (error) {
+			rethrow_exception(error);
+		} else if (stopped) {
+			out.resize(offset);
+			return false;
 		}
 
-		if (ret != Z_STREAM_END){
-			throw zlib_exception("zlib: Stream is not complete.");
+		// zlib header (RFC 1950): deflate with a 32 KB window, no preset
+		// dictionary, and the level the stream was compressed with.
+		uint8_t cmf = 0x78;
+		uint8_t flevel = (level == 1 || level == 0) ? 0 : (level >= 2 && level <= 5) ? 1 : (level == 6 || level < 0) ? 2 : 3;
+		uint8_t flg = static_cast<uint8_t>(flevel << 6);
+		flg = static_cast<uint8_t>(flg + (31 - (cmf * 256 + flg) % 31));
+
+		size_t out_size = 2 + 4;
+		for (const auto &c : compressed) {
+			out_size += c.size();
 		}
+		out.resize(offset + out_size);
+		uint8_t *pos = out.data() + offset;
+		*pos++ = cmf;
+		*pos++ = flg;
 
-		out_data.insert(out_data.end(), temp_buffer, temp_buffer + BUFSIZE - strm->avail_out);
+		uLong checksum = checksums[0];
+		for (size_t b = 0; b < blocks; ++b) {
+			pos = copy(compressed[b].begin(), compressed[b].end(), pos);
+			if (b > 0) {
+				size_t size = min(block_size, in_data_size - b * block_size);
+				checksum = adler32_combine(checksum, checksums[b], static_cast<z_off_t>(size));
+			}
+		}
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			*pos++ = static_cast<uint8_t>(checksum >> shift);
+		}
+		return true;
+	}
 
+	vector<uint8_t> zlib_compress_parallel(const uint8_t* in_data, const size_t in_data_size, const int level,
+	                                       unsigned threads, const size_t block_size, const int strategy)
+	{
+		vector<uint8_t> out_data;
+		zlib_compress_parallel_into(in_data, in_data_size, out_data, 0, level, threads, block_size, strategy);
 		return out_data;
 	}
 
 
+	size_t zlib_parallel_thread_memory(const size_t block_size)
+	{
+		// deflate state (see zconf.h): (1 << (windowBits+2)) + (1 << (memLevel+9)),
+		// plus about deflateBound(block_size) for the compressed block.
+		return (size_t(1) << 17) + (size_t(1) << 17) + 6 * 1024 + block_size + block_size / 1000 + 64;
+	}
+
+
+	vector<uint8_t> zlib_decompress(const uint8_t* in_data, const size_t in_data_size)
+	{
+		vector<uint8_t> out_data;
+		zlib_decompress(in_data, in_data_size, [&out_data](const uint8_t *data, size_t size) {
+			out_data.insert(out_data.end(), data, data + size);
+			return true;
+		});
+		return out_data;
+	}
+
+	bool zlib_decompress_into(const uint8_t* in_data, const size_t in_data_size, vector<uint8_t> &out,
+	                          const size_t offset, const progress_callback &progress)
+	{
+		inflater decompressor;
+		decompressor.input(in_data, in_data_size);
+
+		size_t pos = offset;
+		while (!decompressor.finished()) {
+			if (pos == out.size()) {
+				// More data than expected, the only case that reallocates.
+				out.resize(max<size_t>(out.size() * 2, 64 * 1024));
+			}
+			// With 'progress', one step at a time.
+			size_t space = progress ? min(out.size() - pos, PROGRESS_STEP) : out.size() - pos;
+			size_t size = decompressor.read(out.data() + pos, space);
+			pos += size;
+			if (!decompressor.finished() && size < space) {
+				throw zlib_exception("zlib: Stream is not complete.");
+			}
+			if (progress && !progress(in_data_size - decompressor.pending_input(), in_data_size)) {
+				out.resize(offset);
+				return false;
+			}
+		}
+		out.resize(pos);
+		return true;
+	}
+
 	/**
 	 * zlib C tutorial: http://zlib.net/zlib_how.html
 	 */
-	vector<uint8_t> zlib_decompress(const vector<uint8_t> &in_data)
+	bool zlib_decompress(const uint8_t* in_data, const size_t in_data_size, const chunk_sink &sink,
+	                     const size_t chunk_size)
 	{
-		vector<uint8_t> out_data;
+		inflater decompressor(15, chunk_size);
+		if (!decompressor.feed(in_data, in_data_size, sink)) {
+			return false;
+		}
+		if (!decompressor.finished()) {
+			throw zlib_exception("zlib: Stream is not complete.");
+		}
+		return true;
+	}
 
-		const size_t BUFSIZE = 128 * 1024;
-		uint8_t temp_buffer[BUFSIZE];
 
-		zlib_helper_inflate helper;
-		z_stream *strm = &helper.stream;
-		strm->zalloc = nullptr;
-		strm->zfree = nullptr;
-		strm->opaque = nullptr;
-		strm->next_in = in_data.data(); // Can be const if #define ZLIB_CONST
-		strm->avail_in = static_cast<uInt>(in_data.size());
-		strm->next_out = temp_buffer;
-		strm->avail_out = BUFSIZE;
+	/**
+	 * zran.c: http://www.zlib.net/zlib_faq.html#faq28
+	 */
+	vector<access_point> zlib_build_index(const uint8_t* in_data, const size_t in_data_size, const uint64_t span,
+	                                      const chunk_sink &sink)
+	{
+		const size_t WINDOW_SIZE = 32 * 1024;
 
-		int ret = inflateInit(strm);
+		z_stream strm = z_stream();
+		int ret = inflateInit(&strm);
 		if (ret != Z_OK) {
 			throw zlib_exception("zlib: inflateInit() failed with code: " + to_string(ret));
 		}
+		struct end_guard {
+			z_stream &s;
+			~end_guard() { (void)inflateEnd(&s); }
+		} guard{strm};
 
-		while (strm->avail_in != 0) {
-			ret = inflate(strm, Z_NO_FLUSH);
-			if (ret != Z_OK && ret != Z_STREAM_END) {
+		// The output goes round a window of the last 32 KB, which is what an
+		// access point needs to resume from.
+		vector<uint8_t> window(WINDOW_SIZE);
+		vector<access_point> index;
+		const uint8_t *next = in_data;
+		size_t left = in_data_size;
+		uint64_t total_in = 0, total_out = 0, last = 0;
+		strm.avail_out = 0;
+
+		while (true) {
+			if (strm.avail_in == 0) {
+				if (left == 0) {
+					throw zlib_exception("zlib: Stream is not complete.");
+				}
+				strm.next_in = next;
+				strm.avail_in = static_cast<uInt>(min<size_t>(left, numeric_limits<uInt>::max()));
+				next += strm.avail_in;
+				left -= strm.avail_in;
+			}
+			if (strm.avail_out == 0) {
+				strm.next_out = window.data();
+				strm.avail_out = static_cast<uInt>(window.size());
+			}
+			uInt avail_in = strm.avail_in, avail_out = strm.avail_out;
+			uint8_t *out = strm.next_out;
+
+			// Z_BLOCK stops at the end of each deflate block.
+			ret = inflate(&strm, Z_BLOCK);
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
 				zerr(ret, "inflate()");
 			}
-			if (strm->avail_out == 0) {
-				out_data.insert(out_data.end(), temp_buffer, temp_buffer + BUFSIZE);
-				strm->next_out = temp_buffer;
-				strm->avail_out = BUFSIZE;
+			total_in += avail_in - strm.avail_in;
+			total_out += avail_out - strm.avail_out;
+			if (sink && avail_out != strm.avail_out && !sink(out, avail_out - strm.avail_out)) {
+				break;
+			}
+			if (ret == Z_STREAM_END) {
+				break;
+			}
+
+			// Bit 128 of data_type: at the end of a block header, bit 64: after the last block.
+			if ((strm.data_type & 128) && !(strm.data_type & 64) && (total_out == 0 || total_out - last > span)) {
+				access_point point;
+				point.out = total_out;
+				point.in = total_in;
+				point.bits = strm.data_type & 7;
+				size_t size = static_cast<size_t>(min<uint64_t>(total_out, WINDOW_SIZE));
+				size_t end = WINDOW_SIZE - strm.avail_out;
+				point.window.resize(size);
+				if (size <= end) {
+					copy(window.begin() + static_cast<ptrdiff_t>(end - size), window.begin() + static_cast<ptrdiff_t>(end),
+					     point.window.begin());
+				} else {
+					auto middle = copy(window.end() - static_cast<ptrdiff_t>(size - end), window.end(), point.window.begin());
+					copy(window.begin(), window.begin() + static_cast<ptrdiff_t>(end), middle);
+				}
+				index.emplace_back(move(point));
+				last = total_out;
+			}
+		}
+
+		return index;
+	}
+
+	void zlib_extract(const uint8_t* in_data, const size_t in_data_size, const vector<access_point> &index,
+	                  const uint64_t offset, uint8_t *out, const size_t size)
+	{
+		// Last access point at or before 'offset'.
+		auto point = upper_bound(index.begin(), index.end(), offset, [](uint64_t o, const access_point &p) {
+			return o < p.out;
+		});
+		if (point == index.begin()) {
+			throw zlib_exception("zlib: No access point before offset " + to_string(offset) + ".");
+		}
+		--point;
+		if (point->in > in_data_size || (point->bits > 0 && point->in == 0)) {
+			throw zlib_exception("zlib: Access point is past the end of the stream.");
+		}
+
+		inflater decompressor(-15);
+		if (point->bits > 0) {
+			decompressor.prime(point->bits, in_data[point->in - 1] >> (8 - point->bits));
+		}
+		if (!point->window.empty()) {
+			decompressor.set_dictionary(point->window.data(), point->window.size());
+		}
+		decompressor.input(in_data + point->in, in_data_size - point->in);
+
+		// Inflate and drop what comes before 'offset'.
+		uint64_t skip = offset - point->out;
+		vector<uint8_t> discard(static_cast<size_t>(min<uint64_t>(skip, 64 * 1024)));
+		while (skip > 0) {
+			size_t n = static_cast<size_t>(min<uint64_t>(skip, discard.size()));
+			if (decompressor.read(discard.data(), n) != n) {
+				throw zlib_exception("zlib: Offset is past the end of the stream.");
 			}
+			skip -= n;
+		}
+		if (decompressor.read(out, size) != size) {
+			throw zlib_exception("zlib: Offset is past the end of the stream.");
 		}
+	}
+
+	namespace {
 
-		ret = Z_OK;
-		while (ret == Z_OK) {
-			if (strm->avail_out == 0) {
-				out_data.insert(out_data.end(), temp_buffer, temp_buffer + BUFSIZE);
-				strm->next_out = temp_buffer;
-				strm->avail_out = BUFSIZE;
+		uLong adler32_of(const uint8_t *data, size_t size) {
+			uLong checksum = adler32(0L, nullptr, 0);
+			while (size > 0) {
+				uInt n = static_cast<uInt>(min<size_t>(size, numeric_limits<uInt>::max()));
+				checksum = adler32(checksum, data, n);
+				data += n;
+				size -= n;
 			}
-			ret = inflate(strm, Z_FINISH);
+			return checksum;
 		}
 
-		if (ret != Z_STREAM_END){
-			throw zlib_exception("zlib: Stream is not complete.");
+	} // anonymous
+
+	reconstruction zlib_find_reconstruction(const uint8_t* in_data, const size_t in_data_size, const uint8_t *data,
+	                                        const size_t size)
+	{
+		reconstruction best;
+		best.adler = static_cast<uint32_t>(adler32_of(data, size));
+		uint32_t trailer = 0;
+		for (size_t i = in_data_size >= 4 ? in_data_size - 4 : 0; i < in_data_size; ++i) {
+			trailer = (trailer << 8) | in_data[i];
+		}
+		if (in_data_size < 6 || trailer != best.adler) {
+			throw zlib_exception("zlib: The data is not what the stream decompresses to.");
 		}
 
-		out_data.insert(out_data.end(), temp_buffer, temp_buffer + BUFSIZE - strm->avail_out);
+		// deflate writes FLEVEL 0 for levels 0 and 1, 1 for 2 to 5, 2 for 6 and 3 for 7 to 9.
+		const vector<int> flevels[4] = {{1, 0}, {5, 4, 3, 2}, {6}, {9, 8, 7}};
+		int flevel = in_data[1] >> 6;
+		vector<int> levels = flevels[flevel];
+		for (int f = 3; f >= 0; --f) {
+			if (f != flevel) {
+				levels.insert(levels.end(), flevels[f].begin(), flevels[f].end());
+			}
+		}
+		int window_bits = max(9, (in_data[0] >> 4) + 8);
+		if ((in_data[0] & 0x0F) != Z_DEFLATED || window_bits > 15 || (in_data[1] & 0x20)) {
+			best.tail.assign(in_data, in_data + in_data_size);
+			return best;
+		}
 
-		return out_data;
+		for (int level : levels) {
+			for (int strategy : {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, Z_HUFFMAN_ONLY, Z_FIXED}) {
+				// Huffman only and RLE don't depend on the level, and only levels 4 to 9 filter.
+				bool first = level == levels.front();
+				if (((strategy == Z_RLE || strategy == Z_HUFFMAN_ONLY) && !first) || (strategy == Z_FILTERED && level < 4)) {
+					continue;
+				}
+				// Small output buffers, so that a try stops soon after it differs.
+				deflater compressor(level, strategy, window_bits, 4 * 1024);
+				uint64_t matched = 0;
+				auto compare = [&](const uint8_t *out, size_t n) {
+					size_t same = 0;
+					size_t left = static_cast<size_t>(min<uint64_t>(n, in_data_size - matched));
+					while (same < left && out[same] == in_data[matched + same]) {
+						++same;
+					}
+					matched += same;
+					return same == n;
+				};
+				bool whole = compressor.feed(data, size, compare) && compressor.finish(compare) && matched == in_data_size;
+				if (whole) {
+					best.level = level;
+					best.strategy = strategy;
+					best.window_bits = window_bits;
+					best.prefix = matched;
+					return best;
+				} else if (matched > best.prefix) {
+					best.level = level;
+					best.strategy = strategy;
+					best.window_bits = window_bits;
+					best.prefix = matched;
+				}
+			}
+		}
+		best.tail.assign(in_data + best.prefix, in_data + in_data_size);
+		return best;
+	}
+
+	bool zlib_reconstruct_into(const uint8_t *data, const size_t size, const reconstruction &r,
+	                           vector<uint8_t> &out, const size_t offset, const progress_callback &progress)
+	{
+		if (adler32_of(data, size) != r.adler) {
+			throw zlib_exception("zlib: The data is not the one the stream was made of.");
+		}
+		out.resize(offset);
+		out.reserve(offset + static_cast<size_t>(r.prefix) + r.tail.size());
+		if (r.prefix > 0) {
+			deflater compressor(r.level, r.strategy, r.window_bits);
+			auto keep = [&](const uint8_t *chunk, size_t n) {
+				uint64_t left = r.prefix - (out.size() - offset);
+				out.insert(out.end(), chunk, chunk + static_cast<size_t>(min<uint64_t>(n, left)));
+				return n < left;
+			};
+			// With 'progress', the input is given to it one step at a time.
+			size_t step = progress ? PROGRESS_STEP : size;
+			size_t done = 0;
+			bool more;
+			do {
+				size_t n = min(step, size - done);
+				more = compressor.feed(data + done, n, keep);
+				done += n;
+				if (progress && done < size && !progress(done, size)) {
+					out.resize(offset);
+					return false;
+				}
+			} while (more && done < size);
+			if (more) {
+				compressor.finish(keep);
+			}
+			if (out.size() - offset != r.prefix) {
+				throw zlib_exception("zlib: The stream is shorter than the reconstruction.");
+			}
+		}
+		out.insert(out.end(), r.tail.begin(), r.tail.end());
+		if (progress && !progress(size, size)) {
+			out.resize(offset);
+			return false;
+		}
+		return true;
 	}
 
 } // zlib
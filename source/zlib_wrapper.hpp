@@ -10,15 +10,263 @@
 #include <cstdint> // uint8_t
 #include <string>
 #include <exception> // exception
-#include <zlib.h> // Z_BEST_COMPRESSION
+#include <functional> // function
+#include <memory> // unique_ptr
+#include <zlib.h> // Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY
 
 namespace zlib {
 
-	std::vector<uint8_t> zlib_compress(const uint8_t* in_data, const size_t in_data_size, const int level);
-	inline std::vector<uint8_t> zlib_compress(const std::vector<uint8_t> &in_data, const int level) {
-		return zlib_compress(in_data.data(), in_data.size(), level);
+	/// Receives decompressed data. Returning false stops the decompression.
+	using chunk_sink = std::function<bool(const uint8_t *data, size_t size)>;
+	/**
+	 * Called as the work goes on with the bytes of input done so far and
+	 * their total. Returning false stops it: the function returns false.
+	 * With several threads it is called by any of them, one at a time.
+	 */
+	using progress_callback = std::function<bool(uint64_t done, uint64_t total)>;
+
+	/**
+	 * Compresses into 'out' from 'offset' on, keeping the bytes before it
+	 * (e.g. a file header). 'out' is sized once with deflateBound and then
+	 * shrunk to the end of the stream.
+	 * 'strategy' is passed to deflateInit2 (Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, ...).
+	 * 'progress' is called every 256 KB of input. When it stops the
+	 * compression, 'out' is resized to 'offset' and false is returned.
+	 */
+	bool zlib_compress_into(const uint8_t* in_data, const size_t in_data_size, std::vector<uint8_t> &out,
+	                        const size_t offset, const int level, const int strategy = Z_DEFAULT_STRATEGY,
+	                        const progress_callback &progress = progress_callback());
+	std::vector<uint8_t> zlib_compress(const uint8_t* in_data, const size_t in_data_size, const int level,
+	                                   const int strategy = Z_DEFAULT_STRATEGY);
+	inline std::vector<uint8_t> zlib_compress(const std::vector<uint8_t> &in_data, const int level,
+	                                          const int strategy = Z_DEFAULT_STRATEGY) {
+		return zlib_compress(in_data.data(), in_data.size(), level, strategy);
+	}
+	/**
+	 * Compresses like zlib_compress, pigz-style: the input is split in blocks
+	 * of 'block_size' bytes which are compressed by 'threads' threads (0 means
+	 * one per hardware thread). Each block is primed with the last 32 KB of
+	 * the one before it as its dictionary, so the ratio stays close to a
+	 * single stream's, and the blocks are joined in one zlib stream whose
+	 * adler32 is combined from theirs. 'progress' is called after every
+	 * block, see zlib_compress_into.
+	 */
+	bool zlib_compress_parallel_into(const uint8_t* in_data, const size_t in_data_size, std::vector<uint8_t> &out,
+	                                 const size_t offset, const int level, unsigned threads,
+	                                 const size_t block_size = 128 * 1024, const int strategy = Z_DEFAULT_STRATEGY,
+	                                 const progress_callback &progress = progress_callback());
+	std::vector<uint8_t> zlib_compress_parallel(const uint8_t* in_data, const size_t in_data_size, const int level,
+	                                            unsigned threads, const size_t block_size = 128 * 1024,
+	                                            const int strategy = Z_DEFAULT_STRATEGY);
+	inline std::vector<uint8_t> zlib_compress_parallel(const std::vector<uint8_t> &in_data, const int level,
+	                                                   unsigned threads, const size_t block_size = 128 * 1024,
+	                                                   const int strategy = Z_DEFAULT_STRATEGY) {
+		return zlib_compress_parallel(in_data.data(), in_data.size(), level, threads, block_size, strategy);
+	}
+	/**
+	 * Compresses into a standard zlib stream with optimal parsing, like
+	 * Zopfli (see zlib_optimal.cpp): every block is parsed 'iterations'
+	 * times as a shortest path under the statistics of the parse before.
+	 * The input is split in segments of 'segment_size' bytes, compressed by
+	 * 'threads' threads (0 means one per hardware thread) with the 32 KB
+	 * before them as their window. A few percent smaller than level 9, and
+	 * about a hundred times slower. 'progress' is called after every
+	 * segment, see zlib_compress_into.
+	 */
+	bool zlib_compress_optimal_into(const uint8_t* in_data, const size_t in_data_size, std::vector<uint8_t> &out,
+	                                const size_t offset, const int iterations, unsigned threads,
+	                                const size_t segment_size = 1024 * 1024,
+	                                const progress_callback &progress = progress_callback());
+	std::vector<uint8_t> zlib_compress_optimal(const uint8_t* in_data, const size_t in_data_size, const int iterations,
+	                                           unsigned threads, const size_t segment_size = 1024 * 1024);
+	/// Approximate memory each zlib_compress_parallel thread allocates, to fit a thread count under a limit.
+	size_t zlib_parallel_thread_memory(const size_t block_size = 128 * 1024);
+	std::vector<uint8_t> zlib_decompress(const uint8_t* in_data, const size_t in_data_size);
+	inline std::vector<uint8_t> zlib_decompress(const std::vector<uint8_t> &in_data) {
+		return zlib_decompress(in_data.data(), in_data.size());
 	}
-	std::vector<uint8_t> zlib_decompress(const std::vector<uint8_t> &in_data);
+	/**
+	 * Decompresses into 'out' from 'offset' on, with no intermediate buffer.
+	 * 'out' should already have room for the whole output, it is only grown
+	 * if the data turns out to be larger. It is resized to the end of the output.
+	 * 'progress' is called every 256 KB of output with the compressed bytes
+	 * consumed. When it stops the decompression, 'out' is resized to
+	 * 'offset' and false is returned.
+	 */
+	bool zlib_decompress_into(const uint8_t* in_data, const size_t in_data_size, std::vector<uint8_t> &out,
+	                          const size_t offset = 0, const progress_callback &progress = progress_callback());
+	/**
+	 * zlib_decompress_into with 'threads' threads (0 means one per hardware
+	 * thread), for large inputs: the stream is cut in chunks of 'chunk_size'
+	 * compressed bytes, which are inflated from their first block while the
+	 * 32 KB before them are not known yet (see zlib_inflate_parallel.cpp).
+	 * The output is the same as zlib's, which is used instead for inputs
+	 * under two chunks and streams with a preset dictionary. 'progress' is
+	 * called after every chunk, see zlib_decompress_into. When the chunks
+	 * can't be joined (normally only for a corrupt stream), zlib inflates
+	 * the whole stream again: the work is done twice, and 'progress' starts
+	 * over from 0.
+	 */
+	bool zlib_decompress_parallel_into(const uint8_t* in_data, const size_t in_data_size, std::vector<uint8_t> &out,
+	                                   const size_t offset, unsigned threads, const size_t chunk_size = 4 * 1024 * 1024,
+	                                   const progress_callback &progress = progress_callback());
+	std::vector<uint8_t> zlib_decompress_parallel(const uint8_t* in_data, const size_t in_data_size, unsigned threads,
+	                                              const size_t chunk_size = 4 * 1024 * 1024);
+	/**
+	 * Decompresses in chunks of up to 'chunk_size' bytes, passing each one to
+	 * 'sink' as soon as it is ready. Returns false if 'sink' stopped the
+	 * decompression, true if the whole stream was decompressed.
+	 */
+	bool zlib_decompress(const uint8_t* in_data, const size_t in_data_size, const chunk_sink &sink,
+	                     const size_t chunk_size = 128 * 1024);
+
+	/**
+	 * Streaming compressor, for data that is not all in memory at once.
+	 * Push: feed() the input as it comes and get the output through a sink,
+	 * in chunks of up to 'buffer_size' bytes, then finish(). Pull: give it
+	 * input() and read() the output into your own buffer. reset() starts a
+	 * new stream with the same settings, reusing the allocated state.
+	 */
+	class deflater {
+		public:
+			/// 'window_bits' as in deflateInit2: 9..15 for a zlib stream, -9..-15 for raw deflate.
+			explicit deflater(const int level = Z_BEST_COMPRESSION, const int strategy = Z_DEFAULT_STRATEGY,
+			                  const int window_bits = 15, const size_t buffer_size_ = 128 * 1024);
+			/**
+			 * Copy of the stream state (deflateCopy), which continues the same
+			 * stream independently. 'other' must have consumed its input.
+			 */
+			deflater(const deflater &other);
+			deflater &operator=(const deflater &) = delete;
+			~deflater();
+
+			/// Upper bound of the output for 'size' bytes of input, see deflateBound.
+			size_t bound(const size_t size);
+			/// Preset dictionary, see deflateSetDictionary.
+			void set_dictionary(const uint8_t *data, const size_t size);
+
+			/// Returns false if 'sink' stopped the compression.
+			bool feed(const uint8_t *data, const size_t size, const chunk_sink &sink);
+			/// Outputs everything fed so far, up to a byte boundary (Z_SYNC_FLUSH).
+			bool flush(const chunk_sink &sink);
+			/// Ends the stream.
+			bool finish(const chunk_sink &sink);
+
+			/// Input for read(), which must stay valid until it is consumed.
+			void input(const uint8_t *data, const size_t size);
+			/**
+			 * Compresses the input into 'out', with 'flush' (Z_NO_FLUSH,
+			 * Z_SYNC_FLUSH or Z_FINISH) once all of it is consumed. Returns the
+			 * number of bytes written, which is less than 'size' only when
+			 * the input is consumed and flushed as asked.
+			 */
+			size_t read(uint8_t *out, const size_t size, const int flush = Z_NO_FLUSH);
+			size_t pending_input() const;
+			/// True once the stream was ended with Z_FINISH.
+			bool finished() const;
+			void reset();
+
+		private:
+			struct state;
+			std::unique_ptr<state> impl;
+			size_t buffer_size;
+			bool drain(const int flush, const chunk_sink &sink);
+	};
+
+	/// Streaming decompressor, used like deflater.
+	class inflater {
+		public:
+			/// 'window_bits' as in inflateInit2: 15 for a zlib stream, -15 for raw deflate.
+			explicit inflater(const int window_bits = 15, const size_t buffer_size_ = 128 * 1024);
+			inflater(const inflater &) = delete;
+			inflater &operator=(const inflater &) = delete;
+			~inflater();
+
+			/// Preset dictionary, see inflateSetDictionary.
+			void set_dictionary(const uint8_t *data, const size_t size);
+			/// Inserts 'bits' bits of 'value' in the input, see inflatePrime.
+			void prime(const int bits, const int value);
+
+			/// Returns false if 'sink' stopped the decompression.
+			bool feed(const uint8_t *data, const size_t size, const chunk_sink &sink);
+
+			/// Input for read(), which must stay valid until it is consumed.
+			void input(const uint8_t *data, const size_t size);
+			/**
+			 * Decompresses the input into 'out'. Returns the number of bytes
+			 * written, which is less than 'size' only when the input is
+			 * consumed or the stream has ended.
+			 */
+			size_t read(uint8_t *out, const size_t size);
+			/// Input left, after the end of the stream if finished.
+			size_t pending_input() const;
+			/// True once the end of the stream was reached.
+			bool finished() const;
+			void reset();
+
+		private:
+			struct state;
+			std::unique_ptr<state> impl;
+			size_t buffer_size;
+	};
+
+	/// Point of a zlib stream where inflating can start, see zlib_build_index.
+	struct access_point {
+		uint64_t out = 0;              // offset in the uncompressed data
+		uint64_t in = 0;               // offset in the stream of the first whole byte after the point
+		int bits = 0;                  // bits of the byte before 'in' that come after the point, 0 to 7
+		std::vector<uint8_t> window{}; // uncompressed bytes before 'out', up to 32 KB
+	};
+
+	/**
+	 * Inflates the zlib stream once and returns an access point at the
+	 * first deflate block boundary every 'span' bytes of output (zran.c
+	 * from the zlib examples). The output is passed to 'sink', if any.
+	 */
+	std::vector<access_point> zlib_build_index(const uint8_t* in_data, const size_t in_data_size, const uint64_t span,
+	                                           const chunk_sink &sink = chunk_sink());
+	/**
+	 * Decompresses 'size' bytes at 'offset' of the uncompressed data into
+	 * 'out', inflating only from the closest access point before 'offset'.
+	 */
+	void zlib_extract(const uint8_t* in_data, const size_t in_data_size, const std::vector<access_point> &index,
+	                  const uint64_t offset, uint8_t *out, const size_t size);
+
+	/**
+	 * What reproduces a zlib stream from its uncompressed data, see
+	 * zlib_find_reconstruction: the deflateInit2 parameters it was written
+	 * with, and the end of the stream that they don't reproduce, if any.
+	 */
+	struct reconstruction {
+		int level = Z_DEFAULT_COMPRESSION;
+		int strategy = Z_DEFAULT_STRATEGY;
+		int window_bits = 15;
+		uint32_t adler = 0;          // of the uncompressed data
+		uint64_t prefix = 0;         // bytes of the stream that deflate with these parameters reproduces
+		std::vector<uint8_t> tail{}; // the rest of the stream
+	};
+	/**
+	 * Looks for the zlib level, strategy and window size that compress
+	 * 'data' into the stream 'in_data' (memLevel 8, the default), the
+	 * levels that the stream's header stands for first. Each try stops at
+	 * the first byte that differs, so streams that zlib did not write are
+	 * given up on quickly, while the one that matches costs a deflate of
+	 * 'data'. When none reproduces the whole stream, the one that goes
+	 * furthest is kept, with the rest of the stream as its tail, which is
+	 * most of the stream for other encoders. Throws if 'data' is not what
+	 * the stream decompresses to.
+	 */
+	reconstruction zlib_find_reconstruction(const uint8_t* in_data, const size_t in_data_size, const uint8_t *data,
+	                                        const size_t size);
+	/**
+	 * Writes the stream 'r' was made for into 'out' from 'offset' on, 'data'
+	 * being its uncompressed data. 'progress' is called every 256 KB of
+	 * 'data' deflated and at the end. When it stops the reconstruction,
+	 * 'out' is resized to 'offset' and false is returned.
+	 */
+	bool zlib_reconstruct_into(const uint8_t *data, const size_t size, const reconstruction &r,
+	                           std::vector<uint8_t> &out, const size_t offset,
+	                           const progress_callback &progress = progress_callback());
 
 	class zlib_exception : public std::exception {
 		public:
@@ -0,0 +1,116 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "../source/lzmasdk_wrapper.hpp"
+
+#include <vector>       // std::vector
+#include <cstdint>      // uint8_t, uint32_t
+#include <algorithm>    // std::min, std::copy
+
+namespace {
+
+	/// Letters from a small alphabet, with a repeated run every 16 KB.
+	std::vector<uint8_t> sampleData(const size_t size) {
+		std::vector<uint8_t> data(size);
+		uint32_t x = 3;
+		for (size_t i = 0; i < size; ++i) {
+			x = x * 1103515245 + 12345;
+			data[i] = (i % 16384 < 1000) ? uint8_t('A' + i % 26) : uint8_t((x >> 16) % 9 + 'a');
+		}
+		return data;
+	}
+
+	/// Compresses 'data' with an encoder that pulls it 'step' bytes at a time.
+	std::vector<uint8_t> encode(lzmasdk::encoder &encoder, const std::vector<uint8_t> &data, size_t step,
+	                            uint64_t size = lzmasdk::unknown_size) {
+		size_t done = 0;
+		std::vector<uint8_t> stream;
+		bool ok = encoder.encode([&](uint8_t *out, size_t space) {
+			size_t n = std::min({step, space, data.size() - done});
+			std::copy(data.begin() + static_cast<std::ptrdiff_t>(done),
+			          data.begin() + static_cast<std::ptrdiff_t>(done + n), out);
+			done += n;
+			return n;
+		}, [&stream](const uint8_t *chunk, size_t n) {
+			stream.insert(stream.end(), chunk, chunk + n);
+			return true;
+		}, size);
+		REQUIRE( ok );
+		REQUIRE( done == data.size() );
+		return stream;
+	}
+
+}
+
+TEST_CASE( "encoder and decoder stream in small chunks", "[lzma]" ) {
+	const std::vector<uint8_t> data = sampleData(300 * 1024);
+	lzmasdk::encoder encoder;
+	const std::vector<uint8_t> stream = encode(encoder, data, 1000);
+	REQUIRE( lzmasdk::lzmasdk_decompress(stream) == data );
+	// The encoder can be used again.
+	REQUIRE( encode(encoder, data, 100000) == stream );
+
+	// Push: small feeds, through a small output buffer.
+	lzmasdk::decoder pushed(stream.data(), LZMA_PROPS_SIZE, 0, lzmasdk::unknown_size, 100);
+	std::vector<uint8_t> out;
+	for (size_t done = LZMA_PROPS_SIZE; done < stream.size(); done += 333) {
+		REQUIRE( pushed.feed(stream.data() + done, std::min<size_t>(333, stream.size() - done),
+		                     [&out](const uint8_t *chunk, size_t size) {
+			REQUIRE( size <= 100 );
+			out.insert(out.end(), chunk, chunk + size);
+			return true;
+		}) );
+	}
+	REQUIRE( pushed.finished() );
+	REQUIRE( out == data );
+
+	// Pull: input in small pieces, read into a small buffer.
+	lzmasdk::decoder pulled(stream.data(), LZMA_PROPS_SIZE);
+	out.clear();
+	uint8_t buffer[64];
+	for (size_t done = LZMA_PROPS_SIZE; done < stream.size(); done += 50) {
+		pulled.input(stream.data() + done, std::min<size_t>(50, stream.size() - done));
+		size_t got;
+		do {
+			got = pulled.read(buffer, sizeof(buffer));
+			out.insert(out.end(), buffer, buffer + got);
+		} while (got == sizeof(buffer));
+	}
+	REQUIRE( pulled.finished() );
+	REQUIRE( pulled.pending_input() == 0 );
+	REQUIRE( out == data );
+}
+
+TEST_CASE( "decoder ends a stream without end marker at its size", "[lzma]" ) {
+	const std::vector<uint8_t> data = sampleData(200 * 1024);
+	lzmasdk::encoder_options options;
+	options.end_mark = false;
+	lzmasdk::encoder encoder(options);
+	const std::vector<uint8_t> stream = encode(encoder, data, 4096, data.size());
+	REQUIRE( stream.size() < encode(encoder, data, 4096).size() ); // with the marker, as the size is unknown
+
+	lzmasdk::decoder pushed(stream.data(), LZMA_PROPS_SIZE, 0, data.size(), 1000);
+	std::vector<uint8_t> out;
+	REQUIRE( pushed.feed(stream.data() + LZMA_PROPS_SIZE, stream.size() - LZMA_PROPS_SIZE,
+	                     [&out](const uint8_t *chunk, size_t size) {
+		out.insert(out.end(), chunk, chunk + size);
+		return true;
+	}) );
+	REQUIRE( pushed.finished() );
+	REQUIRE( out == data );
+
+	// Read past the end: it stops at 'size'.
+	lzmasdk::decoder pulled(stream.data(), LZMA_PROPS_SIZE, 0, data.size());
+	pulled.input(stream.data() + LZMA_PROPS_SIZE, stream.size() - LZMA_PROPS_SIZE);
+	out.assign(data.size() + 100, 0);
+	REQUIRE( pulled.read(out.data(), out.size()) == data.size() );
+	REQUIRE( pulled.finished() );
+	out.resize(data.size());
+	REQUIRE( out == data );
+
+	// Without the size, it needs the marker.
+	std::vector<uint8_t> grown;
+	CHECK_THROWS_AS( lzmasdk::lzmasdk_decompress(stream.data(), stream.size(), [&grown](const uint8_t *chunk, size_t size) {
+		grown.insert(grown.end(), chunk, chunk + size);
+		return true;
+	}), lzmasdk::lzmasdk_exception );
+}
@@ -0,0 +1,415 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "../source/swf.hpp"
+#include "../source/tag.hpp"
+#include "../source/swf_index.hpp"
+#include "../source/mapped_file.hpp"
+#include "../source/zlib_wrapper.hpp"
+
+#include <vector>       // std::vector
+#include <cstdint>      // uint8_t, uint32_t
+#include <algorithm>    // std::fill, std::copy
+#include <utility>      // std::as_const
+#include <cstddef>      // std::ptrdiff_t
+#include <string>       // std::string
+#include <filesystem>   // std::filesystem::temp_directory_path
+
+using namespace swf;
+
+namespace {
+
+	void putLE(std::vector<uint8_t> &out, uint32_t value, size_t bytes) {
+		for (size_t i = 0; i < bytes; ++i) {
+			out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+		}
+	}
+
+	void putTag(std::vector<uint8_t> &out, int type, const std::vector<uint8_t> &body) {
+		if (body.size() < 63) {
+			putLE(out, static_cast<uint32_t>(type << 6 | static_cast<int>(body.size())), 2);
+		} else {
+			putLE(out, static_cast<uint32_t>(type << 6 | 0x3F), 2);
+			putLE(out, static_cast<uint32_t>(body.size()), 4);
+		}
+		out.insert(out.end(), body.begin(), body.end());
+	}
+
+	/// Letters from a small alphabet, which deflate to about half.
+	std::vector<uint8_t> sampleData(size_t size, uint32_t seed) {
+		std::vector<uint8_t> data(size);
+		for (auto &c : data) {
+			seed = seed * 1103515245 + 12345;
+			c = static_cast<uint8_t>((seed >> 16) % 7 + 'a');
+		}
+		return data;
+	}
+
+	/// An uncompressed SWF with 'binaries' DefineBinaryData tags (IDs 1...) of 'size' bytes.
+	std::vector<uint8_t> makeSwf(size_t binaries, size_t size) {
+		std::vector<uint8_t> tags;
+		putTag(tags, 69, {0x08, 0, 0, 0}); // FileAttributes
+		for (size_t id = 1; id <= binaries; ++id) {
+			std::vector<uint8_t> body;
+			putLE(body, static_cast<uint32_t>(id), 2);
+			putLE(body, 0, 4);
+			std::vector<uint8_t> data = sampleData(size, static_cast<uint32_t>(id));
+			body.insert(body.end(), data.begin(), data.end());
+			putTag(tags, 87, body);
+		}
+		putTag(tags, 1, {}); // ShowFrame
+		putTag(tags, 0, {}); // End
+
+		const std::vector<uint8_t> frameSize = {0x78, 0x00, 0x05, 0x5F, 0x00, 0x00, 0x0F, 0xA0, 0x00};
+		std::vector<uint8_t> swf = {'F', 'W', 'S', 10};
+		putLE(swf, static_cast<uint32_t>(8 + frameSize.size() + 4 + tags.size()), 4);
+		swf.insert(swf.end(), frameSize.begin(), frameSize.end());
+		putLE(swf, 24 << 8, 2); // frame rate
+		putLE(swf, 1, 2);       // frame count
+		swf.insert(swf.end(), tags.begin(), tags.end());
+		return swf;
+	}
+
+	/// A PE projector stand-in: an MZ header pointing to a PE signature, with a stray footer.
+	std::vector<uint8_t> makePE(size_t size) {
+		std::vector<uint8_t> pe(size, 0x90);
+		pe[0] = 'M';
+		pe[1] = 'Z';
+		std::fill(pe.begin() + 0x3C, pe.begin() + 0x40, uint8_t(0));
+		pe[0x3C] = 0x80;
+		pe[0x80] = 'P';
+		pe[0x81] = 'E';
+		std::copy(Projector::footer.begin(), Projector::footer.end(), pe.begin() + 1000);
+		return pe;
+	}
+
+	/**
+	 * A 64-bit little-endian ELF projector stand-in, whose only segment
+	 * spans the file. Inside it, a length, footer and SWF signature that a
+	 * search for the footer would stop at.
+	 */
+	std::vector<uint8_t> makeELF(size_t size) {
+		std::vector<uint8_t> elf(size, 0x90);
+		std::fill(elf.begin(), elf.begin() + 0x78, uint8_t(0));
+		const std::vector<uint8_t> ident = {0x7F, 'E', 'L', 'F', 2, 1, 1};
+		std::copy(ident.begin(), ident.end(), elf.begin());
+		elf[0x20] = 0x40; // program headers
+		elf[0x36] = 0x38; // size of a program header
+		elf[0x38] = 1;    // number of program headers
+		std::vector<uint8_t> fileSize;
+		putLE(fileSize, static_cast<uint32_t>(size), 4);
+		std::copy(fileSize.begin(), fileSize.end(), elf.begin() + 0x40 + 0x20);
+		const std::vector<uint8_t> fake = {100, 0, 0, 0, 0x56, 0x34, 0x12, 0xFA, 'F', 'W', 'S'};
+		std::copy(fake.begin(), fake.end(), elf.begin() + 2000);
+		return elf;
+	}
+
+	/// The body of a SWF, after its 8 byte header.
+	std::vector<uint8_t> body(const std::vector<uint8_t> &swf) {
+		return std::vector<uint8_t>(swf.begin() + 8, swf.end());
+	}
+
+}
+
+TEST_CASE( "exportSwf from checkpoints matches a full compression", "[swf]" ) {
+	SWF swf(makeSwf(40, 20000));
+	CompressionOptions options;
+	options.checkpointInterval = 64 * 1024;
+
+	std::vector<uint8_t> first = swf.exportSwf(CompressionChoice::zlib, options);
+	REQUIRE( body(first) == zlib::zlib_compress(body(swf.toBytes()), options.level) );
+
+	// Replaced near the end, so that most of the stream is resumed.
+	swf.replaceBinary(sampleData(5000, 99), 35);
+	std::vector<uint8_t> resumed = swf.exportSwf(CompressionChoice::zlib, options);
+	REQUIRE( body(resumed) == zlib::zlib_compress(body(swf.toBytes()), options.level) );
+	REQUIRE( SWF(resumed).toBytes() == swf.toBytes() );
+
+	// Changed through the pointer returned by getTagWithId, after the export.
+	Tag *tag = swf.getTagWithId(30);
+	REQUIRE( tag != nullptr );
+	swf.exportSwf(CompressionChoice::zlib, options);
+	tag->data = SharedBytes(std::vector<uint8_t>{1, 2, 3});
+	std::vector<uint8_t> edited = swf.exportSwf(CompressionChoice::zlib, options);
+	REQUIRE( body(edited) == zlib::zlib_compress(body(swf.toBytes()), options.level) );
+	REQUIRE( SWF(edited).exportBinary(30).size() == 3 );
+}
+
+TEST_CASE( "OriginalMode::reconstruct reproduces a CWS written by zlib", "[swf]" ) {
+	const std::vector<uint8_t> fws = makeSwf(20, 10000);
+	const std::vector<uint8_t> payload = body(fws);
+	// zlib levels and strategies other than exportSwf's
+	const std::vector<std::vector<uint8_t>> streams = {
+		zlib::zlib_compress(payload, 1),
+		zlib::zlib_compress(payload.data(), payload.size(), 5, Z_FILTERED),
+		zlib::zlib_compress(payload.data(), payload.size(), 6, Z_RLE)
+	};
+	for (const auto &stream : streams) {
+		std::vector<uint8_t> cws = {'C', 'W', 'S'};
+		cws.insert(cws.end(), fws.begin() + 3, fws.begin() + 8);
+		cws.insert(cws.end(), stream.begin(), stream.end());
+
+		SWF swf(cws, ParseMode::eager, OriginalMode::reconstruct);
+		REQUIRE( swf.exportSwf(CompressionChoice::zlib) == cws );
+		REQUIRE( swf.exportSwf(CompressionChoice::uncompressed) == fws );
+
+		swf.replaceBinary(sampleData(100, 7), 3);
+		std::vector<uint8_t> modified = swf.exportSwf(CompressionChoice::zlib);
+		REQUIRE( modified != cws );
+		REQUIRE( SWF(modified).toBytes() == swf.toBytes() );
+	}
+}
+
+TEST_CASE( "locateSwf finds the SWF in a PE projector", "[swf]" ) {
+	SWF swf(makeSwf(5, 1000));
+	const std::vector<uint8_t> pe = makePE(8192);
+	const std::vector<uint8_t> cws = swf.exportSwf(CompressionChoice::zlib);
+	const std::vector<uint8_t> exe = swf.exportExe(pe, CompressionChoice::zlib);
+
+	SwfLocation location = SWF::locateSwf(exe.data(), exe.size());
+	REQUIRE( location.projector );
+	REQUIRE( location.windows );
+	REQUIRE( location.projectorLength == pe.size() );
+	REQUIRE( location.swfStart == pe.size() );
+	REQUIRE( location.swfLength == cws.size() );
+	REQUIRE( SWF(exe).toBytes() == swf.toBytes() );
+
+	CHECK_THROWS_AS( SWF::locateSwf(pe.data(), pe.size()), swf_exception );
+}
+
+TEST_CASE( "locateSwf finds the SWF in an ELF projector", "[swf]" ) {
+	SWF swf(makeSwf(5, 1000));
+	const std::vector<uint8_t> elf = makeELF(8192);
+	const std::vector<uint8_t> zws = swf.exportSwf(CompressionChoice::lzma);
+	const std::vector<uint8_t> exe = swf.exportExe(elf, CompressionChoice::lzma);
+
+	// After the ELF image, not at the footer inside it.
+	SwfLocation location = SWF::locateSwf(exe.data(), exe.size());
+	REQUIRE( location.projector );
+	REQUIRE( !location.windows );
+	REQUIRE( location.projectorLength == elf.size() );
+	REQUIRE( location.swfStart == elf.size() + 8 );
+	REQUIRE( location.swfLength == zws.size() );
+	REQUIRE( SWF(exe).toBytes() == SWF(zws).toBytes() ); // ZWS needs version 13
+}
+
+TEST_CASE( "Lazy parsing gives the same SWF as eager parsing", "[swf]" ) {
+	const std::vector<uint8_t> fws = makeSwf(10, 2000);
+	const std::vector<uint8_t> cws = SWF(fws).exportSwf(CompressionChoice::zlib);
+	for (const auto &file : {fws, cws}) {
+		SWF eager(file, ParseMode::eager);
+		SWF lazy(file, ParseMode::lazy);
+		REQUIRE( lazy.toBytes() == eager.toBytes() );
+		REQUIRE( lazy.toBytes() == fws );
+
+		for (size_t id = 1; id <= 10; ++id) {
+			const Tag *eagerTag = std::as_const(eager).getTagWithId(id);
+			const Tag *lazyTag = std::as_const(lazy).getTagWithId(id);
+			REQUIRE( lazyTag != nullptr );
+			REQUIRE( lazyTag->decoded );
+			REQUIRE( lazyTag->id == eagerTag->id );
+			REQUIRE( lazyTag->type == eagerTag->type );
+			REQUIRE( lazyTag->data.toVector() == eagerTag->data.toVector() );
+			REQUIRE( lazy.exportBinary(id).toVector() == eager.exportBinary(id).toVector() );
+		}
+		// Decoding on access is not a change.
+		REQUIRE( !lazy.isModified() );
+		REQUIRE( lazy.exportSwf(file[0] == 'F' ? CompressionChoice::uncompressed : CompressionChoice::zlib) == file );
+
+		REQUIRE( lazy.getTagsOfType(87).size() == 10 );
+		lazy.replaceBinary(sampleData(10, 5), 4);
+		eager.replaceBinary(sampleData(10, 5), 4);
+		REQUIRE( lazy.toBytes() == eager.toBytes() );
+	}
+}
+
+TEST_CASE( "SWFIndex reads tags back from a saved sidecar file", "[swf]" ) {
+	SWF swf(makeSwf(30, 20000));
+	const SharedBytes cws(swf.exportSwf(CompressionChoice::zlib));
+	const std::string path = (std::filesystem::temp_directory_path() / "libswf_test.swf.idx").string();
+
+	SWFIndex::build(cws, 64 * 1024).save(path);
+	SWFIndex index = SWFIndex::load(path, cws);
+	const std::vector<uint8_t> fws = swf.toBytes();
+	REQUIRE( index.size() == fws.size() );
+	REQUIRE( index.checkpointCount() > 1 );
+	for (size_t id = 1; id <= 30; ++id) {
+		const SWFIndex::TagEntry *entry = index.findById(static_cast<int64_t>(id));
+		REQUIRE( entry != nullptr );
+		std::vector<uint8_t> tagBody = index.readTag(cws, *entry);
+		// Character ID and reserved, then the data
+		REQUIRE( std::vector<uint8_t>(tagBody.begin() + 6, tagBody.end()) == swf.exportBinary(id).toVector() );
+	}
+	REQUIRE( index.read(cws, 0, 8) == std::vector<uint8_t>(fws.begin(), fws.begin() + 8) );
+	REQUIRE( index.read(cws, 3, 0).empty() );
+
+	// Another CWS
+	swf.replaceBinary(sampleData(100, 7), 3);
+	const SharedBytes other(swf.exportSwf(CompressionChoice::zlib));
+	CHECK_THROWS_AS( SWFIndex::load(path, other), swf_index_exception );
+
+	// A truncated sidecar file
+	const std::vector<uint8_t> saved = mapFile(path).toVector();
+	writeFile(path, { SharedBytes(std::vector<uint8_t>(saved.begin(), saved.end() - 10)) });
+	CHECK_THROWS_AS( SWFIndex::load(path, cws), swf_index_exception );
+
+	std::filesystem::remove(path);
+}
+
+TEST_CASE( "Reading tags through a const SWF keeps it unmodified", "[swf]" ) {
+	const SharedBytes cws(SWF(makeSwf(10, 2000)).exportSwf(CompressionChoice::zlib));
+	for (ParseMode mode : {ParseMode::eager, ParseMode::lazy}) {
+		SWF swf(cws, mode);
+		size_t size = 0;
+		for (const Tag *tag : std::as_const(swf).getTagsOfType(87)) {
+			size += tag->data.size();
+		}
+		REQUIRE( size == 10 * 2000 );
+		REQUIRE( std::as_const(swf).getTagsOfType(87)[3]->id == 4 );
+		REQUIRE( !swf.isModified() );
+		// The SWF as it was loaded, not a copy.
+		REQUIRE( swf.exportSwfBytes(CompressionChoice::zlib).data() == cws.data() );
+
+		(void)swf.getTagsOfType(87)[3]; // may be changed through the pointer
+		REQUIRE( swf.isModified() );
+		REQUIRE( swf.exportSwfBytes(CompressionChoice::zlib).data() != cws.data() );
+	}
+}
+
+TEST_CASE( "Progress can cancel loading and exporting", "[swf]" ) {
+	const std::vector<uint8_t> fws = makeSwf(40, 20000);
+	const std::vector<uint8_t> cws = SWF(fws).exportSwf(CompressionChoice::zlib);
+	size_t calls = 0;
+	Progress cancel;
+	cancel.interval = 64 * 1024;
+	cancel.callback = [&calls](uint64_t done, uint64_t total) {
+		++calls;
+		REQUIRE( done <= total );
+		return done < total / 2;
+	};
+
+	CHECK_THROWS_AS( SWF(cws, ParseMode::eager, OriginalMode::keep, cancel, 1), swf_cancelled_exception );
+	REQUIRE( calls > 1 );
+
+	SWF swf(cws);
+	swf.replaceBinary(sampleData(100, 7), 3);
+	calls = 0;
+	CHECK_THROWS_AS( swf.exportSwf(CompressionChoice::lzma, CompressionOptions(), cancel), swf_cancelled_exception );
+	REQUIRE( calls > 1 );
+	const std::vector<uint8_t> zws = swf.exportSwf(CompressionChoice::lzma);
+	REQUIRE( body(SWF(zws).toBytes()) == body(swf.toBytes()) ); // ZWS needs version 13
+}
+
+TEST_CASE( "Progress is reported by unmodified exports", "[swf]" ) {
+	const std::vector<uint8_t> fws = makeSwf(40, 20000);
+	const std::vector<uint8_t> cws = SWF(fws).exportSwf(CompressionChoice::zlib);
+	std::vector<uint64_t> reported;
+	Progress progress;
+	progress.interval = 64 * 1024;
+	const uint64_t body = fws.size() - 8;
+	progress.callback = [&reported, body](uint64_t done, uint64_t total) {
+		REQUIRE( total == body );
+		reported.push_back(done);
+		return true;
+	};
+
+	SWF kept(cws);
+	REQUIRE( kept.exportSwf(CompressionChoice::zlib, CompressionOptions(), progress) == cws );
+	REQUIRE( reported == std::vector<uint64_t>{body} );
+	reported.clear();
+	kept.exportExeSegments(SharedBytes(makePE(8192)), CompressionChoice::zlib, CompressionOptions(), progress);
+	REQUIRE( reported == std::vector<uint64_t>{body} );
+
+	SWF reconstructed(cws, ParseMode::eager, OriginalMode::reconstruct);
+	reported.clear();
+	REQUIRE( reconstructed.exportSwf(CompressionChoice::zlib, CompressionOptions(), progress) == cws );
+	REQUIRE( reported.size() > 1 );
+	REQUIRE( reported.back() == body );
+
+	// Cancelled partway, then exported again.
+	progress.callback = [](uint64_t done, uint64_t total) { return done < total / 2; };
+	CHECK_THROWS_AS( reconstructed.exportSwf(CompressionChoice::zlib, CompressionOptions(), progress),
+	                 swf_cancelled_exception );
+	REQUIRE( reconstructed.exportSwf(CompressionChoice::zlib) == cws );
+}
+
+TEST_CASE( "CompressionChoice::smallest keeps the smaller of zlib and LZMA", "[swf]" ) {
+	// Letters, which LZMA compresses better, and noise, which LZMA grows more than deflate.
+	SWF letters(makeSwf(20, 20000));
+	SWF noise(makeSwf(20, 20000));
+	uint32_t x = 5;
+	for (size_t id = 1; id <= 20; ++id) {
+		std::vector<uint8_t> data(20000);
+		for (auto &c : data) {
+			x = x * 1103515245 + 12345;
+			c = static_cast<uint8_t>(x >> 24);
+		}
+		noise.replaceBinary(data, id);
+	}
+
+	for (unsigned threads : {1u, 2u}) {
+		CompressionOptions options;
+		options.threads = threads;
+		for (SWF *swf : {&letters, &noise}) {
+			const std::vector<uint8_t> zlib = swf->exportSwf(CompressionChoice::zlib, options);
+			const std::vector<uint8_t> lzma = swf->exportSwf(CompressionChoice::lzma, options);
+			const std::vector<uint8_t> smallest = swf->exportSwf(CompressionChoice::smallest, options);
+			REQUIRE( smallest == (swf == &letters ? lzma : zlib) );
+			REQUIRE( smallest.size() == std::min(zlib.size(), lzma.size()) );
+			REQUIRE( body(SWF(smallest).toBytes()) == body(swf->toBytes()) );
+		}
+	}
+
+	// A SWF that both compress to the same size goes to zlib.
+	bool tie = false;
+	for (size_t size = 2700; size < 3000 && !tie; ++size) {
+		SWF swf(makeSwf(1, size));
+		const std::vector<uint8_t> zlib = swf.exportSwf(CompressionChoice::zlib);
+		if (zlib.size() == swf.exportSwf(CompressionChoice::lzma).size()) {
+			tie = true;
+			REQUIRE( swf.exportSwf(CompressionChoice::smallest) == zlib );
+		}
+	}
+	REQUIRE( tie );
+}
+
+TEST_CASE( "scanTags finds the tags of FWS, CWS and ZWS files", "[swf]" ) {
+	// The 250 KB tag spans several chunks of decompressed bytes.
+	SWF source(makeSwf(3, 1000));
+	source.replaceBinary(sampleData(250 * 1024, 9), 2);
+	const std::vector<uint8_t> fws = source.toBytes();
+	const std::vector<std::vector<uint8_t>> files = {
+		fws, source.exportSwf(CompressionChoice::zlib), source.exportSwf(CompressionChoice::lzma)
+	};
+	for (const auto &file : files) {
+		const SWF swf(file);
+		size_t count = 0;
+		SWF::scanTags(SharedBytes(file), [&](const Tag &tag) {
+			++count;
+			REQUIRE( tag.i == count );
+			const Tag *parsed = nullptr;
+			for (const Tag *t : swf.getTagsOfType(tag.type)) {
+				parsed = (t->i == tag.i) ? t : parsed;
+			}
+			REQUIRE( parsed != nullptr );
+			REQUIRE( tag.id == parsed->id );
+			REQUIRE( tag.offset == parsed->offset );
+			REQUIRE( tag.headerLength == parsed->headerLength );
+			REQUIRE( tag.bodyLength == parsed->bodyLength );
+			REQUIRE( tag.data.toVector() == parsed->data.toVector() );
+			return true;
+		});
+		REQUIRE( count == 6 ); // FileAttributes, 3 DefineBinaryData, ShowFrame and End
+
+		// Stopped at the first DefineBinaryData, before the broken end of the file.
+		std::vector<uint8_t> truncated(file.begin(), file.end() - static_cast<std::ptrdiff_t>(file.size() / 2));
+		count = 0;
+		SWF::scanTags(SharedBytes(truncated), [&count](const Tag &tag) {
+			++count;
+			return tag.type != 87;
+		});
+		REQUIRE( count == 2 );
+		if (file[0] != 'F') {
+			CHECK_THROWS_AS( SWF::scanTags(SharedBytes(truncated), [](const Tag &) { return true; }), swf_exception );
+		}
+	}
+}
@@ -0,0 +1,178 @@
+#include <catch2/catch_test_macros.hpp>
+
+#include "../source/zlib_wrapper.hpp"
+
+#include <vector>       // std::vector
+#include <cstdint>      // uint8_t, uint32_t
+#include <algorithm>    // std::fill, std::min
+#include <cstddef>      // std::ptrdiff_t
+
+namespace {
+
+	/// Runs of letters, which deflate well, between runs of noise, which don't.
+	std::vector<uint8_t> sampleData(const size_t size) {
+		std::vector<uint8_t> data(size);
+		uint32_t x = 11;
+		for (size_t i = 0; i < size; ++i) {
+			x = x * 1103515245 + 12345;
+			data[i] = (i / 50000) % 3 == 2 ? uint8_t(x >> 24) : uint8_t((x >> 16) % 11 + 'a');
+		}
+		return data;
+	}
+
+}
+
+TEST_CASE( "zlib_decompress_parallel matches zlib_decompress", "[zlib]" ) {
+	const std::vector<uint8_t> data = sampleData(600 * 1024);
+	const std::vector<std::vector<uint8_t>> streams = {
+		zlib::zlib_compress(data, 9),
+		zlib::zlib_compress(data.data(), data.size(), 6, Z_FIXED),   // fixed Huffman blocks
+		zlib::zlib_compress(data.data(), data.size(), 6, Z_RLE),
+		zlib::zlib_compress(data.data(), data.size(), 0),            // stored blocks
+		zlib::zlib_compress_parallel(data, 9, 4)
+	};
+	for (const auto &stream : streams) {
+		REQUIRE( zlib::zlib_decompress(stream) == data );
+		// Chunks under the 32 KB window too, whose window spans several chunks.
+		for (size_t chunkSize : {size_t(10000), size_t(30000), size_t(100000)}) {
+			REQUIRE( zlib::zlib_decompress_parallel(stream.data(), stream.size(), 4, chunkSize) == data );
+		}
+	}
+}
+
+TEST_CASE( "zlib_decompress_parallel_into keeps the bytes before offset", "[zlib]" ) {
+	const std::vector<uint8_t> data = sampleData(300 * 1024);
+	const std::vector<uint8_t> stream = zlib::zlib_compress(data, 9);
+	std::vector<uint8_t> out(3, 7);
+	REQUIRE( zlib::zlib_decompress_parallel_into(stream.data(), stream.size(), out, 3, 3, 20000) );
+	REQUIRE( out.size() == data.size() + 3 );
+	REQUIRE( out[0] == 7 );
+	REQUIRE( std::vector<uint8_t>(out.begin() + 3, out.end()) == data );
+}
+
+TEST_CASE( "zlib_decompress_parallel rejects what zlib rejects", "[zlib]" ) {
+	const std::vector<uint8_t> data = sampleData(300 * 1024);
+	std::vector<uint8_t> stream = zlib::zlib_compress(data, 9);
+	stream.back() ^= 1; // checksum
+	CHECK_THROWS_AS( zlib::zlib_decompress(stream), zlib::zlib_exception );
+	CHECK_THROWS_AS( zlib::zlib_decompress_parallel(stream.data(), stream.size(), 4, 20000), zlib::zlib_exception );
+	stream.resize(stream.size() / 2);
+	CHECK_THROWS_AS( zlib::zlib_decompress_parallel(stream.data(), stream.size(), 4, 20000), zlib::zlib_exception );
+}
+
+TEST_CASE( "zlib_compress_optimal output is accepted by zlib's uncompress", "[zlib]" ) {
+	std::vector<uint8_t> data = sampleData(200 * 1024);
+	std::fill(data.begin() + 150000, data.begin() + 160000, uint8_t(0)); // long matches
+	std::vector<std::vector<uint8_t>> inputs = { data, std::vector<uint8_t>(), std::vector<uint8_t>(1, 'x') };
+	for (const auto &input : inputs) {
+		// Several segments on several threads, and one segment.
+		for (size_t segmentSize : {size_t(40000), size_t(1024 * 1024)}) {
+			std::vector<uint8_t> stream = zlib::zlib_compress_optimal(input.data(), input.size(), 2, 3, segmentSize);
+			std::vector<uint8_t> out(input.size() + 1);
+			uLongf outSize = static_cast<uLongf>(out.size());
+			REQUIRE( uncompress(out.data(), &outSize, stream.data(), static_cast<uLong>(stream.size())) == Z_OK );
+			out.resize(outSize);
+			REQUIRE( out == input );
+		}
+	}
+	REQUIRE( zlib::zlib_compress_optimal(data.data(), data.size(), 3, 1).size() < zlib::zlib_compress(data, 9).size() );
+}
+
+TEST_CASE( "deflater and inflater stream in small chunks", "[zlib]" ) {
+	const std::vector<uint8_t> data = sampleData(200 * 1024);
+	const std::vector<uint8_t> whole = zlib::zlib_compress(data, 9);
+
+	// Push: small feeds, through a small output buffer.
+	zlib::deflater compressor(9, Z_DEFAULT_STRATEGY, 15, 100);
+	std::vector<uint8_t> stream;
+	auto keep = [&stream](const uint8_t *chunk, size_t size) {
+		REQUIRE( size <= 100 );
+		stream.insert(stream.end(), chunk, chunk + size);
+		return true;
+	};
+	for (size_t done = 0; done < data.size(); done += 777) {
+		REQUIRE( compressor.feed(data.data() + done, std::min<size_t>(777, data.size() - done), keep) );
+	}
+	REQUIRE( compressor.finish(keep) );
+	REQUIRE( compressor.finished() );
+	REQUIRE( stream == whole );
+
+	zlib::inflater decompressor(15, 100);
+	std::vector<uint8_t> out;
+	for (size_t done = 0; done < stream.size(); done += 333) {
+		decompressor.feed(stream.data() + done, std::min<size_t>(333, stream.size() - done),
+		                  [&out](const uint8_t *chunk, size_t size) {
+			REQUIRE( size <= 100 );
+			out.insert(out.end(), chunk, chunk + size);
+			return true;
+		});
+	}
+	REQUIRE( decompressor.finished() );
+	REQUIRE( out == data );
+
+	// Pull: input in small pieces, read into a small buffer.
+	compressor.reset();
+	stream.clear();
+	uint8_t buffer[64];
+	for (size_t done = 0; done < data.size(); done += 1000) {
+		size_t n = std::min<size_t>(1000, data.size() - done);
+		compressor.input(data.data() + done, n);
+		int flush = (done + n == data.size()) ? Z_FINISH : Z_NO_FLUSH;
+		size_t got;
+		do {
+			got = compressor.read(buffer, sizeof(buffer), flush);
+			stream.insert(stream.end(), buffer, buffer + got);
+		} while (got == sizeof(buffer));
+		REQUIRE( compressor.pending_input() == 0 );
+	}
+	REQUIRE( compressor.finished() );
+	REQUIRE( stream == whole );
+
+	decompressor.reset();
+	out.clear();
+	for (size_t done = 0; done < stream.size(); done += 50) {
+		decompressor.input(stream.data() + done, std::min<size_t>(50, stream.size() - done));
+		size_t got;
+		do {
+			got = decompressor.read(buffer, sizeof(buffer));
+			out.insert(out.end(), buffer, buffer + got);
+		} while (got == sizeof(buffer));
+	}
+	REQUIRE( decompressor.finished() );
+	REQUIRE( decompressor.pending_input() == 0 );
+	REQUIRE( out == data );
+}
+
+TEST_CASE( "A copied deflater continues the stream on its own", "[zlib]" ) {
+	const std::vector<uint8_t> data = sampleData(300 * 1024);
+	const size_t half = data.size() / 2;
+	std::vector<uint8_t> head;
+	auto keepHead = [&head](const uint8_t *chunk, size_t size) {
+		head.insert(head.end(), chunk, chunk + size);
+		return true;
+	};
+	zlib::deflater original(9);
+	REQUIRE( original.feed(data.data(), half, keepHead) );
+
+	// The copy finishes the data, the original another ending.
+	zlib::deflater copy(original);
+	std::vector<uint8_t> copied = head, other = head;
+	auto keepCopied = [&copied](const uint8_t *chunk, size_t size) {
+		copied.insert(copied.end(), chunk, chunk + size);
+		return true;
+	};
+	auto keepOther = [&other](const uint8_t *chunk, size_t size) {
+		other.insert(other.end(), chunk, chunk + size);
+		return true;
+	};
+	const std::vector<uint8_t> ending(1000, 'z');
+	REQUIRE( original.feed(ending.data(), ending.size(), keepOther) );
+	REQUIRE( copy.feed(data.data() + half, data.size() - half, keepCopied) );
+	REQUIRE( original.finish(keepOther) );
+	REQUIRE( copy.finish(keepCopied) );
+
+	REQUIRE( copied == zlib::zlib_compress(data, 9) );
+	std::vector<uint8_t> expected(data.begin(), data.begin() + static_cast<std::ptrdiff_t>(half));
+	expected.insert(expected.end(), ending.begin(), ending.end());
+	REQUIRE( zlib::zlib_decompress(other) == expected );
+}